@@ -0,0 +1,66 @@
+/****************************************************
+ * mxalloc.c - allocation counter for the benchmarks, loaded into mxtool with
+ * LD_PRELOAD. Counts the calls to malloc, calloc, realloc and free (libxml2
+ * allocates through these too) and the bytes asked for, and writes them as
+ * JSON to the file named by MXALLOC_OUT (or stderr) when the program exits:
+ *   {"allocs":N,"frees":N,"bytes":N}
+ * Built as a shared object by "make bench", glibc only.
+ ****************************************************/
+
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//glibc's own allocator, which the wrappers hand on to
+extern void *__libc_malloc( size_t size );
+extern void *__libc_calloc( size_t n, size_t size );
+extern void *__libc_realloc( void *ptr, size_t size );
+extern void __libc_free( void *ptr );
+
+static unsigned long allocs = 0;
+static unsigned long frees = 0;
+static unsigned long long bytes = 0;
+
+static void counted( size_t size ){
+  __atomic_add_fetch( &allocs, 1, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &bytes, size, __ATOMIC_RELAXED );
+}
+
+void *malloc( size_t size ){
+  counted( size );
+  return __libc_malloc( size );
+}
+
+void *calloc( size_t n, size_t size ){
+  counted( n * size );
+  return __libc_calloc( n, size );
+}
+
+void *realloc( void *ptr, size_t size ){
+  counted( size );
+  return __libc_realloc( ptr, size );
+}
+
+void free( void *ptr ){
+  if (ptr != NULL) __atomic_add_fetch( &frees, 1, __ATOMIC_RELAXED );
+  __libc_free( ptr );
+}
+
+/****************************************************
+write the counts at exit, without allocating (so they are not changed)
+****************************************************/
+__attribute__((destructor)) static void report( void ){
+  char line[128];
+  int len = snprintf( line, sizeof(line), "{\"allocs\":%lu,\"frees\":%lu,\"bytes\":%llu}\n",
+                      allocs, frees, bytes );
+  const char *path = getenv( "MXALLOC_OUT" );
+  int fd = (path != NULL ? open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : STDERR_FILENO);
+  if (fd < 0) return;
+  if ( write( fd, line, len ) != len ){
+    //nothing more can be done about it at exit
+  }
+  if (fd != STDERR_FILENO) close( fd );
+}
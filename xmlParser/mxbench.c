@@ -0,0 +1,259 @@
+/****************************************************
+ * mxbench.c - times mxtool on a MARCXML file, one run per mode, and prints the
+ * results as JSON on stdout: seconds, records/sec, peak RSS and (with
+ * mxalloc.so) allocation counts for each mode. The best of -runs runs is
+ * reported. Modes: cat, keep, discard, lib, bib, plus parse (mxReadFile with
+ * validation, nothing else) and stream (mxReadStream with validation), which
+ * mxbench runs itself, with the -threads and -validate of the mxtool options.
+ *
+ * usage: mxbench [-runs n] [-tool path] [-alloc path] file.xml [-- mxtool options]
+ * The schema is MXTOOL_XSD, MARC21slim.xsd if it is not set.
+ ****************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mxutil.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+//a mode: the arguments given to mxtool (or mxbench itself for parse/stream)
+typedef struct BenchMode BenchMode;
+struct BenchMode {
+  const char *name;
+  const char *args[4];  // NULL terminated, "@" stands for the input file
+  int self;             // flag: 1 if mxbench runs it rather than mxtool
+  int factor;           // records handled per input record
+};
+
+static const BenchMode modes[] = {
+  { "cat", { "-cat", "@", NULL }, 0, 2 },
+  { "keep", { "-keep", "a=^[A-M]", NULL }, 0, 1 },
+  { "discard", { "-discard", "a=^[A-M]", NULL }, 0, 1 },
+  { "lib", { "-lib", NULL }, 0, 1 },
+  { "bib", { "-bib", NULL }, 0, 1 },
+  { "parse", { "-parse", NULL }, 1, 1 },
+  { "stream", { "-stream", NULL }, 1, 1 },
+};
+#define NMODES ((int)(sizeof(modes) / sizeof(modes[0])))
+
+//result of one run
+typedef struct BenchRun BenchRun;
+struct BenchRun {
+  double seconds;
+  long rssKb;
+  int status;           // exit status, or 128 + signal
+  long long allocs;     // -1 when not counted
+  long long frees;
+  long long bytes;
+};
+
+static int countRecord( XmElem *rec, void *ctx ){
+  (*(long *)ctx)++;
+  return 0;
+}
+
+/****************************************************
+The parse and stream modes, run in the child: read file from stdin and drop
+the result. Of the mxtool options, -threads and -validate apply to them, the
+rest are passed over.
+Post: returns the exit status
+****************************************************/
+static int selfMode( int argc, char *argv[] ){
+  const char *mode = argv[1];
+  for (int i = 2; i < argc; i++){
+    if ( strcmp( argv[i], "-threads" ) == 0 && i + 1 < argc ){
+      mxSetOption( MX_THREADS, atoi( argv[++i] ) );
+    }else if ( strcmp( argv[i], "-validate" ) == 0 && i + 1 < argc ){
+      static const char *validations[] = { "xsd", "builtin", "none" };
+      i++;
+      for (int v = 0; v < 3; v++){
+        if ( strcmp( argv[i], validations[v] ) == 0 ) mxSetOption( MX_VALIDATION, v );
+      }
+    }
+  }
+
+  //the schema is only read for the validation that needs it, as by mxtool
+  xmlSchemaPtr sp = NULL;
+  if ( mxGetOption( MX_VALIDATION ) == MX_VALIDATE_XSD ){
+    sp = mxInit( getenv( "MXTOOL_XSD" ) );
+    if (sp == NULL){
+      fprintf( stderr, "mxbench: could not load the schema\n" );
+      return EXIT_FAILURE;
+    }
+  }
+  mxSetOption( MX_ARENA, 1 );
+
+  int status;
+  if ( strcmp( mode, "-parse" ) == 0 ){
+    XmElem *top = NULL;
+    status = mxReadFile( stdin, sp, &top );
+    if (status == 0) mxCleanElem( top );
+  }else{
+    long n = 0;
+    status = mxReadStream( stdin, sp, countRecord, &n );
+  }
+  if (sp != NULL) mxTerm( sp );
+  return (status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static double now( void ){
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/****************************************************
+Run argv with file on stdin and stdout thrown away, counting allocations with
+allocLib if it is not NULL.
+Post: returns the run's measurements
+****************************************************/
+static BenchRun runOnce( char *argv[], const char *file, const char *allocLib ){
+  BenchRun run = { 0, 0, 0, -1, -1, -1 };
+  char countFile[] = "/tmp/mxbench-XXXXXX";
+  int countFd = (allocLib != NULL ? mkstemp( countFile ) : -1);
+
+  double start = now();
+  pid_t pid = fork();
+  if (pid == 0){
+    int in = open( file, O_RDONLY );
+    int out = open( "/dev/null", O_WRONLY );
+    if (in < 0 || out < 0) _exit( 127 );
+    dup2( in, STDIN_FILENO );
+    dup2( out, STDOUT_FILENO );
+    if (countFd >= 0){
+      setenv( "LD_PRELOAD", allocLib, 1 );
+      setenv( "MXALLOC_OUT", countFile, 1 );
+    }
+    execv( argv[0], argv );
+    _exit( 127 );
+  }
+
+  int wstatus = 0;
+  struct rusage usage;
+  memset( &usage, 0, sizeof(usage) );
+  if ( pid < 0 || wait4( pid, &wstatus, 0, &usage ) < 0 ){
+    run.status = 127;
+  }else{
+    run.status = (WIFEXITED( wstatus ) ? WEXITSTATUS( wstatus ) : 128 + WTERMSIG( wstatus ));
+  }
+  run.seconds = now() - start;
+  run.rssKb = usage.ru_maxrss;
+
+  if (countFd >= 0){
+    FILE *counts = fdopen( countFd, "r" );
+    if ( counts == NULL || fscanf( counts, "{\"allocs\":%lld,\"frees\":%lld,\"bytes\":%lld}",
+                                   &run.allocs, &run.frees, &run.bytes ) != 3 ){
+      run.allocs = run.frees = run.bytes = -1;
+    }
+    if (counts != NULL) fclose( counts );
+    unlink( countFile );
+  }
+  return run;
+}
+
+/****************************************************
+print n as a JSON number, or null if it was not measured
+****************************************************/
+static void printCount( const char *name, long long n ){
+  if (n < 0){
+    printf( ",\"%s\":null", name );
+  }else{
+    printf( ",\"%s\":%lld", name, n );
+  }
+}
+
+static void usage( void ){
+  fprintf( stderr, "usage: mxbench [-runs n] [-tool path] [-alloc path] file.xml [-- mxtool options]\n" );
+  exit( EXIT_FAILURE );
+}
+
+int main( int argc, char *argv[] ){
+  if (argc >= 2 && (strcmp( argv[1], "-parse" ) == 0 || strcmp( argv[1], "-stream" ) == 0)){
+    return selfMode( argc, argv );
+  }
+
+  int runs = 3;
+  const char *tool = "./mxtool";
+  const char *allocLib = "./mxalloc.so";
+  const char *file = NULL;
+  int i = 1;
+  for ( ; i < argc && strcmp( argv[i], "--" ) != 0; i++){
+    if ( strcmp( argv[i], "-runs" ) == 0 && i + 1 < argc ){
+      runs = atoi( argv[++i] );
+    }else if ( strcmp( argv[i], "-tool" ) == 0 && i + 1 < argc ){
+      tool = argv[++i];
+    }else if ( strcmp( argv[i], "-alloc" ) == 0 && i + 1 < argc ){
+      allocLib = argv[++i];
+    }else if (argv[i][0] != '-' && file == NULL){
+      file = argv[i];
+    }else{
+      usage();
+    }
+  }
+  if (file == NULL || runs < 1) usage();
+  //what follows -- is given to mxtool on every run
+  char **extra = &argv[i < argc ? i + 1 : argc];
+  int nextra = argc - (i < argc ? i + 1 : argc);
+
+  setenv( "MXTOOL_XSD", "MARC21slim.xsd", 0 );
+  //LD_PRELOAD needs a path it can find from anywhere
+  char *allocPath = (access( allocLib, R_OK ) == 0 ? realpath( allocLib, NULL ) : NULL);
+  char *self = realpath( "/proc/self/exe", NULL );
+
+  //the record count, not timed
+  FILE *fp = fopen( file, "r" );
+  struct stat st;
+  long nrecs = 0;
+  if ( fp == NULL || fstat( fileno(fp), &st ) != 0 || mxReadStream( fp, NULL, countRecord, &nrecs ) != 0 ){
+    fprintf( stderr, "mxbench: could not read %s\n", file );
+    return EXIT_FAILURE;
+  }
+  fclose( fp );
+
+  printf( "{\"file\":\"%s\",\"bytes\":%lld,\"records\":%ld,\"runs\":%d,\"results\":[",
+          file, (long long)st.st_size, nrecs, runs );
+  for (int m = 0; m < NMODES; m++){
+    //tool (or mxbench), the extra options for mxtool, then the mode's own;
+    //mxbench's own modes come first and take the options after them
+    char *args[8 + nextra];
+    int nargs = 0;
+    args[nargs++] = (char *)(modes[m].self ? self : tool);
+    for (int j = 0; j < nextra && !modes[m].self; j++){
+      args[nargs++] = extra[j];
+    }
+    for (int j = 0; modes[m].args[j] != NULL; j++){
+      args[nargs++] = (char *)(strcmp( modes[m].args[j], "@" ) == 0 ? file : modes[m].args[j]);
+    }
+    for (int j = 0; j < nextra && modes[m].self; j++){
+      args[nargs++] = extra[j];
+    }
+    args[nargs] = NULL;
+
+    BenchRun best = { -1 };
+    for (int r = 0; r < runs; r++){
+      BenchRun run = runOnce( args, file, allocPath );
+      if (best.seconds < 0 || run.seconds < best.seconds) best = run;
+    }
+
+    long handled = nrecs * modes[m].factor;
+    printf( "%s\n  {\"mode\":\"%s\",\"status\":%d,\"seconds\":%.6f,\"records_per_sec\":%.1f,\"peak_rss_kb\":%ld",
+            (m > 0 ? "," : ""), modes[m].name, best.status, best.seconds,
+            (best.seconds > 0 ? handled / best.seconds : 0.0), best.rssKb );
+    printCount( "allocs", best.allocs );
+    printCount( "frees", best.frees );
+    printCount( "alloc_bytes", best.bytes );
+    printf( "}" );
+    fflush( stdout );
+  }
+  printf( "\n]}\n" );
+
+  free( allocPath );
+  free( self );
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,307 @@
+/****************************************************
+ * mxcache.c - on-disk record cache, see mxcache.h
+ ****************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mxcache.h"
+#include "mxwriter.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//first bytes of a cache file
+#define CACHE_MAGIC "MXCACHE"
+
+/****************************************************
+A cache file is the header, the offset of each entry's strings, the slots
+sorted by hash, then the strings. An entry's strings follow one another, each
+ending in a NUL byte.
+****************************************************/
+typedef struct MxCacheHeader MxCacheHeader;
+struct MxCacheHeader {
+  char magic[8];        // CACHE_MAGIC
+  uint32_t nfields;
+  int32_t order;
+  uint64_t nentries;
+  uint64_t size;        // bytes in the file
+};
+
+typedef struct MxCacheSlot MxCacheSlot;
+struct MxCacheSlot {
+  uint64_t hash;
+  uint64_t entry;
+};
+
+struct MxCacheBuilder {
+  int nfields;
+  int order;
+  uint64_t *offsets;    // of each entry's strings in pool
+  MxCacheSlot *slots;   // in the order added
+  size_t nentries;
+  size_t cap;
+  char *pool;
+  size_t poolLen;
+  size_t poolCap;
+  size_t *table;        // open addressing on hash, entry + 1 (0 for an empty slot)
+  size_t size;          // slots in table, a power of 2
+};
+
+struct MxCache {
+  void *addr;           // the mapped file
+  size_t size;
+  const MxCacheHeader *header;
+  const uint64_t *offsets;
+  const MxCacheSlot *slots;
+  const char *pool;
+  size_t poolLen;
+};
+
+uint64_t mxCacheHash( const void *data, size_t len, uint64_t seed ){
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  const unsigned char *p = data;
+  uint64_t h = seed ^ (len * m);
+
+  for (; len >= 8; p += 8, len -= 8){
+    uint64_t k;
+    memcpy( &k, p, 8 );
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h ^= k;
+    h *= m;
+  }
+  if (len > 0){
+    uint64_t k = 0;
+    for (size_t i = len; i-- > 0; ) k = (k << 8) | p[i];
+    h ^= k;
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+MxCacheBuilder *mxCacheNew( int nfields, int order ){
+  MxCacheBuilder *b = calloc( 1, sizeof(MxCacheBuilder) );
+  assert(b);
+  b->nfields = nfields;
+  b->order = order;
+  b->size = 1024;
+  b->table = calloc( b->size, sizeof(size_t) );
+  assert(b->table);
+  return b;
+}
+
+/****************************************************
+the table slot for hash: the one holding it, or the empty one it would go in
+****************************************************/
+static size_t *findSlot( const MxCacheBuilder *b, uint64_t hash ){
+  size_t i = hash & (b->size - 1);
+  while (b->table[i] != 0 && b->slots[b->table[i] - 1].hash != hash){
+    i = (i + 1) & (b->size - 1);
+  }
+  return &b->table[i];
+}
+
+static void growTable( MxCacheBuilder *b ){
+  free( b->table );
+  b->size *= 2;
+  b->table = calloc( b->size, sizeof(size_t) );
+  assert(b->table);
+  for (size_t e = 0; e < b->nentries; e++){
+    *findSlot( b, b->slots[e].hash ) = e + 1;
+  }
+}
+
+int mxCacheAdd( MxCacheBuilder *b, uint64_t hash, const char *fields[] ){
+  size_t *slot = findSlot( b, hash );
+  if (*slot != 0) return 0;
+
+  if (b->nentries == b->cap){
+    b->cap = (b->cap == 0 ? 1024 : 2 * b->cap);
+    b->offsets = realloc( b->offsets, b->cap * sizeof(uint64_t) );
+    b->slots = realloc( b->slots, b->cap * sizeof(MxCacheSlot) );
+    assert(b->offsets && b->slots);
+  }
+  b->offsets[b->nentries] = b->poolLen;
+  b->slots[b->nentries].hash = hash;
+  b->slots[b->nentries].entry = b->nentries;
+  for (int f = 0; f < b->nfields; f++){
+    size_t n = strlen( fields[f] ) + 1;
+    if (b->poolLen + n > b->poolCap){
+      b->poolCap = (2 * b->poolCap > b->poolLen + n ? 2 * b->poolCap : b->poolLen + n + (1 << 16));
+      b->pool = realloc( b->pool, b->poolCap );
+      assert(b->pool);
+    }
+    memcpy( b->pool + b->poolLen, fields[f], n );
+    b->poolLen += n;
+  }
+  *slot = ++b->nentries;
+
+  if (b->nentries * 2 > b->size) growTable( b );
+  return 1;
+}
+
+static int compareSlots( const void *a, const void *b ){
+  uint64_t ha = ((const MxCacheSlot *)a)->hash;
+  uint64_t hb = ((const MxCacheSlot *)b)->hash;
+  return (ha > hb) - (ha < hb);
+}
+
+int mxCacheSave( MxCacheBuilder *b, const char *path ){
+  //written next to path, then renamed over it
+  char *tmp = malloc( strlen( path ) + 8 );
+  assert(tmp);
+  sprintf( tmp, "%s.XXXXXX", path );
+  int fd = mkstemp( tmp );
+  mode_t mask = umask( 0 );
+  umask( mask );
+  if (fd >= 0) fchmod( fd, 0666 & ~mask );
+  FILE *fp = (fd >= 0 ? fdopen( fd, "w" ) : NULL);
+  if (fp == NULL){
+    fprintf( stderr, "\nError, could not write cache \"%s\": %s\n", path, strerror( errno ) );
+    if (fd >= 0){
+      close( fd );
+      unlink( tmp );
+    }
+    free( tmp );
+    return -1;
+  }
+
+  MxCacheSlot *sorted = malloc( (b->nentries + 1) * sizeof(MxCacheSlot) );
+  assert(sorted);
+  memcpy( sorted, b->slots, b->nentries * sizeof(MxCacheSlot) );
+  qsort( sorted, b->nentries, sizeof(MxCacheSlot), compareSlots );
+
+  MxCacheHeader header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC) );
+  header.nfields = b->nfields;
+  header.order = b->order;
+  header.nentries = b->nentries;
+  header.size = sizeof(header) + b->nentries * (sizeof(uint64_t) + sizeof(MxCacheSlot)) + b->poolLen;
+
+  MxWriter *w = mxWriterNew( fp );
+  mxPutBytes( w, (char *)&header, sizeof(header) );
+  mxPutBytes( w, (char *)b->offsets, b->nentries * sizeof(uint64_t) );
+  mxPutBytes( w, (char *)sorted, b->nentries * sizeof(MxCacheSlot) );
+  mxPutBytes( w, b->pool, b->poolLen );
+  int failed = ( mxWriterFree( w ) != 0 );
+  failed |= ( fclose( fp ) != 0 );
+  if ( failed || rename( tmp, path ) != 0 ){
+    fprintf( stderr, "\nError, could not write cache \"%s\": %s\n", path, strerror( errno ) );
+    unlink( tmp );
+    failed = 1;
+  }
+
+  free( sorted );
+  free( tmp );
+  return (failed ? -1 : 0);
+}
+
+void mxCacheFree( MxCacheBuilder *b ){
+  free( b->offsets );
+  free( b->slots );
+  free( b->pool );
+  free( b->table );
+  free( b );
+}
+
+MxCache *mxCacheOpen( const char *path, int nfields ){
+  int fd = open( path, O_RDONLY );
+  if (fd < 0){
+    if (errno != ENOENT){
+      fprintf( stderr, "\nWarning, could not open cache \"%s\", it is not used\n", path );
+    }
+    return NULL;
+  }
+
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(MxCacheHeader) ){
+    addr = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  }
+  close( fd );
+
+  //the offsets and slots have to fit, the strings have to point into the file and end in it
+  const MxCacheHeader *header = addr;
+  int ok = ( addr != MAP_FAILED && memcmp( header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC) ) == 0 &&
+             header->nfields == (uint32_t)nfields && header->size == (uint64_t)st.st_size &&
+             header->nentries <= (header->size - sizeof(MxCacheHeader)) /
+                                 (sizeof(uint64_t) + sizeof(MxCacheSlot)) );
+  const uint64_t *offsets = NULL;
+  const MxCacheSlot *slots = NULL;
+  const char *pool = NULL;
+  size_t poolLen = 0;
+  if (ok){
+    offsets = (const uint64_t *)(header + 1);
+    slots = (const MxCacheSlot *)(offsets + header->nentries);
+    pool = (const char *)(slots + header->nentries);
+    poolLen = header->size - (pool - (const char *)addr);
+    ok = ( header->nentries == 0 || (poolLen > 0 && pool[poolLen - 1] == '\0') );
+  }
+  for (uint64_t i = 0; ok && i < header->nentries; i++){
+    ok = ( offsets[i] < poolLen && slots[i].entry < header->nentries );
+  }
+  if (!ok){
+    fprintf( stderr, "\nWarning, \"%s\" is not a usable cache, it is not used\n", path );
+    if (addr != MAP_FAILED) munmap( addr, st.st_size );
+    return NULL;
+  }
+
+  MxCache *c = malloc( sizeof(MxCache) );
+  assert(c);
+  c->addr = addr;
+  c->size = st.st_size;
+  c->header = header;
+  c->offsets = offsets;
+  c->slots = slots;
+  c->pool = pool;
+  c->poolLen = poolLen;
+  return c;
+}
+
+unsigned long mxCacheEntries( const MxCache *c ){
+  return c->header->nentries;
+}
+
+int mxCacheOrder( const MxCache *c ){
+  return c->header->order;
+}
+
+long mxCacheFind( const MxCache *c, uint64_t hash ){
+  size_t lo = 0;
+  size_t hi = c->header->nentries;
+  while (lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if (c->slots[mid].hash < hash){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+  return (lo < c->header->nentries && c->slots[lo].hash == hash ? (long)c->slots[lo].entry : -1);
+}
+
+const char *mxCacheField( const MxCache *c, unsigned long entry, int field ){
+  //the pool ends in a NUL, so each string does too, a field past the end is ""
+  size_t at = c->offsets[entry];
+  for (int f = 0; f < field && at < c->poolLen; f++){
+    at += strlen( c->pool + at ) + 1;
+  }
+  return (at < c->poolLen ? c->pool + at : "");
+}
+
+void mxCacheClose( MxCache *c ){
+  munmap( c->addr, c->size );
+  free( c );
+}
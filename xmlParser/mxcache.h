@@ -0,0 +1,55 @@
+/****************************************************
+ * mxcache.h - on-disk cache of what was taken out of each record, for
+ * mxtool's -cache. Each entry is a record's content hash and a few strings
+ * (its fields and sort keys), kept in the order the entries were added, so a
+ * run can both look records up by their hash and go through them in the
+ * order the run that saved them put them in.
+ ****************************************************/
+
+#ifndef MXCACHE_H_
+#define MXCACHE_H_ 1
+
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct MxCacheBuilder MxCacheBuilder;
+typedef struct MxCache MxCache;
+
+/*************************************************
+64-bit hash of len bytes of data (MurmurHash64A), seed lets the bytes around
+them count as well. Two records with different bytes are taken to be the
+same if their hashes are, which for a million records happens about once in
+every 30 million runs.
+**************************************************/
+uint64_t mxCacheHash( const void *data, size_t len, uint64_t seed );
+
+/*************************************************
+Build a cache in memory: entries are numbered from 0 in the order they are
+added, each with nfields strings. order is the caller's note of what the
+entries are sorted by, given back by mxCacheOrder.
+Post: mxCacheAdd returns 1, or 0 if an entry with the same hash was added
+already (which is left as it was). mxCacheSave writes the cache to a new file
+that then replaces path, so a cache open on path can still be read; it
+returns 0, or -1 after reporting why it could not be written.
+**************************************************/
+MxCacheBuilder *mxCacheNew( int nfields, int order );
+int mxCacheAdd( MxCacheBuilder *b, uint64_t hash, const char *fields[] );
+int mxCacheSave( MxCacheBuilder *b, const char *path );
+void mxCacheFree( MxCacheBuilder *b );
+
+/*************************************************
+Open a saved cache, which is mapped rather than read in.
+Post: mxCacheOpen returns the cache (closed with mxCacheClose), or NULL if
+there is no file at path, or after a warning if it is not a cache with
+nfields strings to an entry. mxCacheFind returns the number of the entry with
+hash, or -1 if there is none. The strings of mxCacheField are in the mapping,
+valid until the cache is closed.
+**************************************************/
+MxCache *mxCacheOpen( const char *path, int nfields );
+unsigned long mxCacheEntries( const MxCache *c );
+int mxCacheOrder( const MxCache *c );
+long mxCacheFind( const MxCache *c, uint64_t hash );
+const char *mxCacheField( const MxCache *c, unsigned long entry, int field );
+void mxCacheClose( MxCache *c );
+
+#endif
@@ -0,0 +1,256 @@
+/****************************************************
+ * mxgen.c - writes a synthetic MARCXML collection for benchmarking mxtool.
+ * Records are modelled on trellis.xml: the same fields, in the same order,
+ * present about as often, with made up but plausible names, titles, call
+ * numbers and subjects. The output only depends on the options, so the same
+ * command always gives the same collection.
+ *
+ * usage: mxgen [-n records] [-dup percent] [-subjects mean] [-notes mean]
+ *              [-seed n] > collection.xml
+ ****************************************************/
+
+#include "mxwriter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//records whose keys later records can repeat, see -dup
+#define KEPT_KEYS 4096
+
+static const char *surnames[] = {
+  "Smith", "Jasio", "Monk", "Sandburg", "Nguyen", "Garcia", "Okafor", "Lehmann",
+  "Tanaka", "MacDonald", "O'Brien", "Kowalski", "Haddad", "Lindqvist", "Rossi",
+  "Dubois", "Kim", "Patel", "Ivanova", "Schmidt", "Moreau", "Silva", "Cohen",
+  "Fischer", "Gardner", "Novak", "Andersen", "Costa", "Walsh", "Yamamoto"
+};
+static const char *forenames[] = {
+  "Lucio", "Carl", "Anne", "Wei", "Maria", "Chinua", "Craig", "Yuki", "Fiona",
+  "Sean", "Piotr", "Rania", "Erik", "Giulia", "Claire", "Min-jun", "Priya",
+  "Olga", "Hans", "Paulo", "Ruth", "Lena", "Tomas", "Ines", "Bridget", "Kenji"
+};
+static const char *words[] = {
+  "programming", "history", "microcontrollers", "poems", "introduction", "theory",
+  "practice", "systems", "design", "networks", "music", "garden", "river",
+  "economics", "language", "children", "science", "art", "war", "peace", "data",
+  "engineering", "philosophy", "cooking", "ocean", "city", "mathematics", "law",
+  "medicine", "jazz", "photography", "architecture", "letters", "essays", "travel"
+};
+static const char *cities[] = {
+  "Boston :", "New York :", "London :", "Toronto :", "Chicago :", "Guelph, Ont. :",
+  "Oxford :", "Berlin :", "Paris :", "San Francisco :", "Cambridge, Mass. :"
+};
+static const char *publishers[] = {
+  "Newnes,", "Harcourt, Brace & World,", "O'Reilly,", "Penguin,", "Wiley & Sons,",
+  "Oxford University Press,", "Springer,", "Random House,", "MIT Press,", "Knopf,"
+};
+static const char *notes[] = {
+  "Includes bibliographical references and index.", "Includes index.",
+  "Mode of access: World Wide Web.", "Originally published: 1950.",
+  "Title from title screen.", "\"A Borzoi book.\"", "Translation of the 2nd ed."
+};
+#define COUNT(a) ((int)(sizeof(a) / sizeof((a)[0])))
+
+/****************************************************
+xorshift64*, a small PRNG that is the same everywhere
+****************************************************/
+static unsigned long long rngState = 88172645463325252ULL;
+
+static unsigned long long rng( void ){
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 2685821657736338717ULL;
+}
+
+static int pick( int n ){
+  return (int)(rng() % n);
+}
+
+//1 with the given chance in percent
+static int chance( int percent ){
+  return pick( 100 ) < percent;
+}
+
+//how many of something there are, mean on average
+static int howMany( int mean ){
+  int n = 0;
+  while (n < 4 * mean && pick( mean + 1 ) != 0) n++;
+  return n;
+}
+
+/****************************************************
+Keys that decide -keep/-discard matches and -lib/-bib order, kept so later
+records can repeat them
+****************************************************/
+typedef struct GenKeys GenKeys;
+struct GenKeys {
+  char author[64];
+  char title[128];
+  char callnum[32];
+};
+
+static void newKeys( GenKeys *k ){
+  snprintf( k->author, sizeof(k->author), "%s, %s.", surnames[pick( COUNT(surnames) )],
+            forenames[pick( COUNT(forenames) )] );
+
+  int nwords = 1 + pick( 5 );
+  size_t len = 0;
+  for (int i = 0; i < nwords; i++){
+    const char *w = words[pick( COUNT(words) )];
+    len += snprintf( k->title + len, sizeof(k->title) - len, "%s%s", (i > 0 ? " " : ""), w );
+  }
+  k->title[0] = k->title[0] - 'a' + 'A';
+
+  snprintf( k->callnum, sizeof(k->callnum), "%c%c%d.%c%d", 'A' + pick( 26 ), 'A' + pick( 26 ),
+            1 + pick( 9999 ), 'A' + pick( 26 ), pick( 100 ) );
+}
+
+/****************************************************
+field writers, in the layout of trellis.xml
+****************************************************/
+static void putControl( MxWriter *w, const char *tag, const char *text ){
+  mxPuts( w, "    <marc:controlfield tag=\"" );
+  mxPuts( w, tag );
+  mxPuts( w, "\">" );
+  mxPutEscaped( w, text );
+  mxPuts( w, "</marc:controlfield>\n" );
+}
+
+/****************************************************
+a data field, subs being pairs of code (as a one character string) and text
+ended by NULL
+****************************************************/
+static void putData( MxWriter *w, const char *tag, const char *ind, const char **subs ){
+  char head[64];
+  snprintf( head, sizeof(head), "    <marc:datafield tag=\"%s\" ind1=\"%c\" ind2=\"%c\">\n", tag, ind[0], ind[1] );
+  mxPuts( w, head );
+  for (int i = 0; subs[i] != NULL; i += 2){
+    mxPuts( w, "      <marc:subfield code=\"" );
+    mxPuts( w, subs[i] );
+    mxPuts( w, "\">" );
+    mxPutEscaped( w, subs[i + 1] );
+    mxPuts( w, "</marc:subfield>\n" );
+  }
+  mxPuts( w, "    </marc:datafield>\n" );
+}
+
+static void putRecord( MxWriter *w, long id, const GenKeys *k, int subjects, int nnotes ){
+  char buf[128];
+  char buf2[128];
+  int year = 1900 + pick( 120 );
+
+  mxPuts( w, "  <marc:record>\n" );
+  mxPuts( w, "    <marc:leader>00925njm  22002777a 4500</marc:leader>\n" );
+  snprintf( buf, sizeof(buf), "%ld", 4000000 + id );
+  putControl( w, "001", buf );
+  snprintf( buf, sizeof(buf), "%04d%02d%02d%06d.0", 2000 + pick( 12 ), 1 + pick( 12 ), 1 + pick( 28 ), pick( 240000 ) );
+  putControl( w, "005", buf );
+  snprintf( buf, sizeof(buf), "070329s%04d    maua    sb    001 0 eng d", year );
+  putControl( w, "008", buf );
+
+  if ( chance( 72 ) ){
+    snprintf( buf, sizeof(buf), "978%010llu (pbk.)", rng() % 10000000000ULL );
+    putData( w, "020", "  ", (const char *[]){ "a", buf, NULL } );
+  }
+  putData( w, "040", "  ", (const char *[]){ "a", "CaPaEBR", "c", "CaPaEBR", NULL } );
+
+  //call number in 090 (what -lib sorts on) or 050, sometimes neither
+  snprintf( buf, sizeof(buf), "%c%d %d", 'A' + pick( 26 ), pick( 100 ), year );
+  if ( chance( 73 ) ){
+    putData( w, "090", "  ", (const char *[]){ "a", k->callnum, "b", buf, NULL } );
+  }else if ( chance( 60 ) ){
+    putData( w, "050", "14", (const char *[]){ "a", k->callnum, "b", buf, NULL } );
+  }
+
+  if ( chance( 88 ) ){
+    putData( w, "100", "1 ", (const char *[]){ "a", k->author, NULL } );
+  }
+  snprintf( buf, sizeof(buf), "by %s", k->author );
+  putData( w, "245", "10", (const char *[]){ "a", k->title, "b", words[pick( COUNT(words) )], "c", buf, NULL } );
+  if ( chance( 13 ) ){
+    putData( w, "250", "  ", (const char *[]){ "a", "2nd ed.", NULL } );
+  }
+  snprintf( buf, sizeof(buf), "c%d.", year );
+  putData( w, "260", "  ", (const char *[]){ "a", cities[pick( COUNT(cities) )],
+                                             "b", publishers[pick( COUNT(publishers) )], "c", buf, NULL } );
+  snprintf( buf, sizeof(buf), "xix, %d p. :", 50 + pick( 900 ) );
+  putData( w, "300", "  ", (const char *[]){ "a", buf, "b", "ill.", NULL } );
+
+  for (int i = howMany( nnotes ); i > 0; i--){
+    putData( w, "500", "  ", (const char *[]){ "a", notes[pick( COUNT(notes) )], NULL } );
+  }
+  for (int i = howMany( subjects ); i > 0; i--){
+    snprintf( buf, sizeof(buf), "%s", words[pick( COUNT(words) )] );
+    buf[0] = buf[0] - 'a' + 'A';
+    putData( w, "650", " 0", (const char *[]){ "a", buf, "x", words[pick( COUNT(words) )], NULL } );
+  }
+  if ( chance( 70 ) ){
+    snprintf( buf2, sizeof(buf2), "%s, %s.", surnames[pick( COUNT(surnames) )], forenames[pick( COUNT(forenames) )] );
+    putData( w, "700", "1 ", (const char *[]){ "a", buf2, NULL } );
+  }
+  mxPuts( w, "  </marc:record>\n" );
+}
+
+/****************************************************
+value of option argv[i], exits with usage if it is missing or not a number
+****************************************************/
+static long numberArg( int argc, char *argv[], int i ){
+  char *end = NULL;
+  long n = (i + 1 < argc ? strtol( argv[i + 1], &end, 10 ) : -1);
+  if (end == NULL || end == argv[i + 1] || *end != '\0' || n < 0){
+    fprintf( stderr, "usage: mxgen [-n records] [-dup percent] [-subjects mean] [-notes mean] [-seed n]\n" );
+    exit( EXIT_FAILURE );
+  }
+  return n;
+}
+
+int main( int argc, char *argv[] ){
+  long nrecs = 10000;
+  long dup = 10;
+  long subjects = 2;
+  long nnotes = 1;
+
+  for (int i = 1; i < argc; i += 2){
+    long n = numberArg( argc, argv, i );
+    if ( strcmp( argv[i], "-n" ) == 0 ){
+      nrecs = n;
+    }else if ( strcmp( argv[i], "-dup" ) == 0 ){
+      dup = (n > 100 ? 100 : n);
+    }else if ( strcmp( argv[i], "-subjects" ) == 0 ){
+      subjects = n;
+    }else if ( strcmp( argv[i], "-notes" ) == 0 ){
+      nnotes = n;
+    }else if ( strcmp( argv[i], "-seed" ) == 0 ){
+      rngState ^= (unsigned long long)n * 0x9E3779B97F4A7C15ULL;
+      if (rngState == 0) rngState = 1;
+    }else{
+      numberArg( 0, argv, i ); //usage
+    }
+  }
+
+  GenKeys *kept = malloc( KEPT_KEYS * sizeof(GenKeys) );
+  if (kept == NULL) return EXIT_FAILURE;
+
+  MxWriter *w = mxWriterNew( stdout );
+  mxPuts( w, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+             "<marc:collection xmlns:marc=\"http://www.loc.gov/MARC21/slim\" "
+             "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+             "xsi:schemaLocation=\"http://www.loc.gov/MARC21/slim "
+             "http://www.loc.gov/standards/marcxml/schema/MARC21slim.xsd\">\n" );
+  for (long i = 0; i < nrecs && !mxWriterError( w ); i++){
+    //a duplicate repeats the author, title and call number of an earlier record
+    GenKeys k;
+    long nkept = (i < KEPT_KEYS ? i : KEPT_KEYS);
+    if ( nkept > 0 && chance( dup ) ){
+      k = kept[pick( nkept )];
+    }else{
+      newKeys( &k );
+    }
+    kept[i % KEPT_KEYS] = k;
+    putRecord( w, i, &k, subjects, nnotes );
+  }
+  mxPuts( w, "</marc:collection>\n" );
+
+  free( kept );
+  return (mxWriterFree( w ) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
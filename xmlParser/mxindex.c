@@ -0,0 +1,300 @@
+/****************************************************
+ * mxindex.c - on-disk trigram index, see mxindex.h
+ ****************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mxindex.h"
+#include "mxwriter.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//first bytes of an index file
+#define INDEX_MAGIC "MXIDX1"
+
+/****************************************************
+An index file is the header, the keys sorted by key, then the posting lists.
+A posting list is its record numbers in order, each given as the difference
+from the one before (the first from -1) in groups of 7 bits, low group first,
+with the high bit set on every group but the last.
+****************************************************/
+typedef struct MxIndexHeader MxIndexHeader;
+struct MxIndexHeader {
+  char magic[8];        // INDEX_MAGIC
+  uint32_t nfields;
+  uint32_t reserved;
+  uint64_t nrecs;
+  uint64_t nkeys;
+  int64_t srcSize;      // size and modification time (in nanoseconds) of the
+  int64_t srcMtime;     //   indexed file, -1 if it was not a regular file
+  uint64_t size;        // bytes in the file
+};
+
+typedef struct MxIndexKey MxIndexKey;
+struct MxIndexKey {
+  uint32_t key;         // field << 24 | the trigram's three bytes
+  uint32_t count;       // records in the posting list
+  uint64_t offset;      // of the posting list, from the end of the keys
+  uint64_t len;         // bytes in the posting list
+};
+
+// a key's posting list while the index is built
+typedef struct MxPosting MxPosting;
+struct MxPosting {
+  uint32_t key;
+  uint32_t count;       // 0 for an empty slot of the table
+  long last;            // the last record added
+  unsigned char *data;
+  size_t len;
+  size_t cap;
+};
+
+struct MxIndexBuilder {
+  int nfields;
+  MxPosting *table;     // open addressing on key
+  size_t size;          // slots, a power of 2
+  size_t used;
+};
+
+struct MxIndex {
+  void *addr;           // the mapped file
+  size_t size;
+  const MxIndexHeader *header;
+  const MxIndexKey *keys;
+  const unsigned char *postings;
+};
+
+static unsigned char fold( char c ){
+  unsigned char u = c;
+  return (u >= 'A' && u <= 'Z' ? u - 'A' + 'a' : u);
+}
+
+static uint32_t trigramKey( int field, const char *p ){
+  return (uint32_t)field << 24 | (uint32_t)fold( p[0] ) << 16 | (uint32_t)fold( p[1] ) << 8 | fold( p[2] );
+}
+
+/****************************************************
+slot of key in b's table, or the empty slot it would go in
+****************************************************/
+static MxPosting *findPosting( const MxIndexBuilder *b, uint32_t key ){
+  size_t i = ((uint64_t)key * 0x9E3779B97F4A7C15ULL >> 32) & (b->size - 1);
+  while (b->table[i].count != 0 && b->table[i].key != key){
+    i = (i + 1) & (b->size - 1);
+  }
+  return &b->table[i];
+}
+
+static void growTable( MxIndexBuilder *b ){
+  MxPosting *old = b->table;
+  size_t oldSize = b->size;
+  b->size *= 2;
+  b->table = calloc( b->size, sizeof(MxPosting) );
+  assert(b->table);
+  for (size_t i = 0; i < oldSize; i++){
+    if (old[i].count != 0) *findPosting( b, old[i].key ) = old[i];
+  }
+  free( old );
+}
+
+MxIndexBuilder *mxIndexNew( int nfields ){
+  MxIndexBuilder *b = malloc( sizeof(MxIndexBuilder) );
+  assert(b);
+  b->nfields = nfields;
+  b->size = 4096;
+  b->used = 0;
+  b->table = calloc( b->size, sizeof(MxPosting) );
+  assert(b->table);
+  return b;
+}
+
+void mxIndexAdd( MxIndexBuilder *b, unsigned long rec, int field, const char *text ){
+  size_t n = strlen( text );
+  for (size_t i = 0; i + 3 <= n; i++){
+    uint32_t key = trigramKey( field, text + i );
+    MxPosting *p = findPosting( b, key );
+    int added = (p->count == 0);
+    if (added){
+      p->key = key;
+      p->last = -1;
+      p->data = NULL;
+      p->len = p->cap = 0;
+    }else if (p->last == (long)rec){
+      continue;//the record already has it
+    }
+
+    if (p->cap - p->len < 10){
+      p->cap = (p->cap == 0 ? 8 : 2 * p->cap);
+      p->data = realloc( p->data, p->cap );
+      assert(p->data);
+    }
+    unsigned long delta = rec - p->last;
+    while (delta >= 0x80){
+      p->data[p->len++] = (delta & 0x7F) | 0x80;
+      delta >>= 7;
+    }
+    p->data[p->len++] = delta;
+    p->last = rec;
+    p->count++;
+
+    if (added && ++b->used * 2 > b->size) growTable( b );
+  }
+}
+
+static int compareKeys( const void *a, const void *b ){
+  uint32_t ka = (*(MxPosting *const *)a)->key;
+  uint32_t kb = (*(MxPosting *const *)b)->key;
+  return (ka > kb) - (ka < kb);
+}
+
+int mxIndexSave( MxIndexBuilder *b, unsigned long nrecs, int src, FILE *fp ){
+  MxPosting **sorted = malloc( (b->used + 1) * sizeof(MxPosting *) );
+  assert(sorted);
+  size_t nkeys = 0;
+  for (size_t i = 0; i < b->size; i++){
+    if (b->table[i].count != 0) sorted[nkeys++] = &b->table[i];
+  }
+  qsort( sorted, nkeys, sizeof(MxPosting *), compareKeys );
+
+  MxIndexHeader header;
+  memset( &header, 0, sizeof(header) );
+  memcpy( header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC) );
+  header.nfields = b->nfields;
+  header.nrecs = nrecs;
+  header.nkeys = nkeys;
+  struct stat st;
+  int isFile = ( fstat( src, &st ) == 0 && S_ISREG( st.st_mode ) );
+  header.srcSize = (isFile ? st.st_size : -1);
+  header.srcMtime = (isFile ? st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec : -1);
+  header.size = sizeof(header) + nkeys * sizeof(MxIndexKey);
+  for (size_t i = 0; i < nkeys; i++) header.size += sorted[i]->len;
+
+  MxWriter *w = mxWriterNew( fp );
+  mxPutBytes( w, (char *)&header, sizeof(header) );
+  uint64_t offset = 0;
+  for (size_t i = 0; i < nkeys; i++){
+    MxIndexKey key = { sorted[i]->key, sorted[i]->count, offset, sorted[i]->len };
+    mxPutBytes( w, (char *)&key, sizeof(key) );
+    offset += sorted[i]->len;
+  }
+  for (size_t i = 0; i < nkeys; i++){
+    mxPutBytes( w, (char *)sorted[i]->data, sorted[i]->len );
+  }
+  free( sorted );
+  return mxWriterFree( w );
+}
+
+void mxIndexFree( MxIndexBuilder *b ){
+  for (size_t i = 0; i < b->size; i++) free( b->table[i].data );
+  free( b->table );
+  free( b );
+}
+
+MxIndex *mxIndexOpen( const char *path ){
+  int fd = open( path, O_RDONLY );
+  if (fd < 0){
+    fprintf( stderr, "\nError, could not open index \"%s\"\n", path );
+    return NULL;
+  }
+
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if ( fstat( fd, &st ) == 0 && st.st_size >= (off_t)sizeof(MxIndexHeader) ){
+    addr = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  }
+  close( fd );
+
+  //the keys have to fit, and every posting list has to be inside the file
+  const MxIndexHeader *header = addr;
+  int ok = ( addr != MAP_FAILED && memcmp( header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC) ) == 0 &&
+             header->size == (uint64_t)st.st_size &&
+             header->nkeys <= (header->size - sizeof(MxIndexHeader)) / sizeof(MxIndexKey) );
+  const MxIndexKey *keys = (const MxIndexKey *)(header + 1);
+  uint64_t postingsLen = (ok ? header->size - sizeof(MxIndexHeader) - header->nkeys * sizeof(MxIndexKey) : 0);
+  for (uint64_t i = 0; ok && i < header->nkeys; i++){
+    ok = ( keys[i].offset <= postingsLen && keys[i].len <= postingsLen - keys[i].offset );
+  }
+  if (!ok){
+    fprintf( stderr, "\nError, \"%s\" is not a usable index\n", path );
+    if (addr != MAP_FAILED) munmap( addr, st.st_size );
+    return NULL;
+  }
+
+  MxIndex *ix = malloc( sizeof(MxIndex) );
+  assert(ix);
+  ix->addr = addr;
+  ix->size = st.st_size;
+  ix->header = header;
+  ix->keys = keys;
+  ix->postings = (const unsigned char *)(keys + header->nkeys);
+  return ix;
+}
+
+unsigned long mxIndexRecords( const MxIndex *ix ){
+  return ix->header->nrecs;
+}
+
+int mxIndexFor( const MxIndex *ix, int src ){
+  struct stat st;
+  return ( fstat( src, &st ) == 0 && S_ISREG( st.st_mode ) && ix->header->srcSize == st.st_size &&
+           ix->header->srcMtime == st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec );
+}
+
+void mxIndexClose( MxIndex *ix ){
+  munmap( ix->addr, ix->size );
+  free( ix );
+}
+
+static int compareKey( const void *key, const void *entry ){
+  uint32_t k = *(const uint32_t *)key;
+  uint32_t e = ((const MxIndexKey *)entry)->key;
+  return (k > e) - (k < e);
+}
+
+/****************************************************
+set the bit of every record in k's posting list
+****************************************************/
+static void postingBits( const MxIndex *ix, const MxIndexKey *k, unsigned char *bits ){
+  const unsigned char *p = ix->postings + k->offset;
+  const unsigned char *end = p + k->len;
+  uint64_t rec = (uint64_t)-1;
+  while (p < end){
+    uint64_t delta = 0;
+    int shift = 0;
+    while (p < end && (*p & 0x80) && shift < 63){
+      delta |= (uint64_t)(*p++ & 0x7F) << shift;
+      shift += 7;
+    }
+    if (p < end) delta |= (uint64_t)*p++ << shift;
+    rec += delta;
+    if (rec < ix->header->nrecs) bits[rec >> 3] |= 1 << (rec & 7);
+  }
+}
+
+int mxIndexLookup( const MxIndex *ix, int field, const char *str, unsigned char *bits ){
+  size_t n = strlen( str );
+  if (n < 3) return 0;
+
+  size_t nbytes = (ix->header->nrecs + 7) / 8;
+  unsigned char *have = malloc( nbytes + 1 );
+  assert(have);
+  for (size_t i = 0; i + 3 <= n; i++){
+    uint32_t key = trigramKey( field, str + i );
+    const MxIndexKey *k = bsearch( &key, ix->keys, ix->header->nkeys, sizeof(MxIndexKey), compareKey );
+    if (k == NULL){
+      //no record has it at all
+      memset( bits, 0, nbytes );
+      break;
+    }
+    memset( have, 0, nbytes );
+    postingBits( ix, k, have );
+    for (size_t j = 0; j < nbytes; j++) bits[j] &= have[j];
+  }
+  free( have );
+  return 1;
+}
@@ -0,0 +1,52 @@
+/****************************************************
+ * mxindex.h - on-disk trigram index for mxtool's -keep and -discard. The text
+ * of a few fields of every record is cut into trigrams (each run of three
+ * bytes, with ASCII letters folded to lower case), and each trigram is mapped
+ * to the numbers of the records whose field has it. Looking a string up gives
+ * the records that have all of its trigrams, which takes in every record the
+ * string is part of.
+ ****************************************************/
+
+#ifndef MXINDEX_H_
+#define MXINDEX_H_ 1
+
+#include <stdio.h>
+
+typedef struct MxIndexBuilder MxIndexBuilder;
+typedef struct MxIndex MxIndex;
+
+/*************************************************
+Build an index in memory: records are numbered from 0 in the order they are
+added, and the fields of each are added with mxIndexAdd.
+Pre: rec is never less than the rec of an earlier call, field < nfields
+Post: mxIndexSave writes it to fp and returns 0, or -1 if it could not be
+written. The source file (the records' input, src a file descriptor for it)
+is noted down by size and modification time, so mxIndexFor can tell if it is
+still the file that was indexed.
+**************************************************/
+MxIndexBuilder *mxIndexNew( int nfields );
+void mxIndexAdd( MxIndexBuilder *b, unsigned long rec, int field, const char *text );
+int mxIndexSave( MxIndexBuilder *b, unsigned long nrecs, int src, FILE *fp );
+void mxIndexFree( MxIndexBuilder *b );
+
+/*************************************************
+Open a saved index, which is mapped rather than read in.
+Post: mxIndexOpen returns the index (closed with mxIndexClose), or NULL after
+reporting why it could not be used. mxIndexFor returns 1 if the file open on
+src is a regular file that has not changed since it was indexed, else 0.
+**************************************************/
+MxIndex *mxIndexOpen( const char *path );
+unsigned long mxIndexRecords( const MxIndex *ix );
+int mxIndexFor( const MxIndex *ix, int src );
+void mxIndexClose( MxIndex *ix );
+
+/*************************************************
+Narrow a search down to the records whose field has every trigram of str.
+Pre: bits holds a bit for each of the index's records (mxIndexRecords), bit
+n of byte n / 8 for record n
+Post: Returns 1 with the bits of the other records cleared, or 0 (leaving bits
+alone) if str is too short to have any trigrams
+**************************************************/
+int mxIndexLookup( const MxIndex *ix, int field, const char *str, unsigned char *bits );
+
+#endif
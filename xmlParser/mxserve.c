@@ -0,0 +1,269 @@
+/****************************************************
+ * mxserve.c - resident request server, see mxserve.h
+ ****************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mxserve.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef struct MxServer MxServer;
+struct MxServer {
+  int listener;
+  MxServeFunc handle;
+  void *ctx;
+  pthread_mutex_t lock; // guards clients and stopping
+  int *clients;         // each thread's client socket, -1 while it has none
+  int stopping;         // flag: 1 once the server is shutting down
+};
+
+typedef struct MxServeThread MxServeThread;
+struct MxServeThread {
+  MxServer *server;
+  int slot;             // in the server's clients
+  pthread_t thread;
+};
+
+/****************************************************
+read or write exactly len bytes
+Post: returns 0, or -1 if the client is gone
+****************************************************/
+static int readFull( int fd, char *buf, size_t len ){
+  while (len > 0){
+    ssize_t n = recv( fd, buf, len, 0 );
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int writeFull( int fd, const char *buf, size_t len ){
+  while (len > 0){
+    ssize_t n = send( fd, buf, len, MSG_NOSIGNAL );
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int respond( int fd, int failed, const char *body, size_t len ){
+  char head[64];
+  int headLen = snprintf( head, sizeof(head), "%s %zu\n", (failed ? "error" : "ok"), len );
+  return ( writeFull( fd, head, headLen ) == 0 && writeFull( fd, body, len ) == 0 ? 0 : -1 );
+}
+
+/****************************************************
+Read the next request from fd
+Post: returns 1 with *req (to be freed) holding its len bytes, 0 if the client
+closed the connection between requests, or -1 if it is gone or the request is
+malformed (*req is then NULL)
+****************************************************/
+static int readRequest( int fd, char **req, size_t *len ){
+  //the length, a byte at a time so nothing after it is read
+  size_t n = 0;
+  int digits = 0;
+  for (;;){
+    char c;
+    if ( readFull( fd, &c, 1 ) != 0 ) return (digits == 0 ? 0 : -1);
+    if (c == '\n' && digits > 0) break;
+    if (c < '0' || c > '9' || ++digits > 8) return -1;
+    n = n * 10 + (c - '0');
+  }
+  if (n == 0 || n > MX_SERVE_MAXREQUEST) return -1;
+
+  *req = malloc( n );
+  assert(*req);
+  if ( readFull( fd, *req, n ) != 0 ){
+    free( *req );
+    *req = NULL;
+    return -1;
+  }
+  *len = n;
+  return 1;
+}
+
+/****************************************************
+Answer the requests of the client on fd until it closes the connection (or
+a request is malformed, which leaves no way to find the next)
+****************************************************/
+static void serveClient( MxServer *server, int fd ){
+  for (;;){
+    char *req = NULL;
+    size_t len = 0;
+    int got = readRequest( fd, &req, &len );
+    if (got == 0) return;
+    if (got < 0 || req[len - 1] != '\0'){
+      static const char bad[] = "malformed request\n";
+      respond( fd, 1, bad, sizeof(bad) - 1 );
+      free( req );
+      return;
+    }
+
+    int nargs = 0;
+    for (size_t i = 0; i < len; i++){
+      nargs += (req[i] == '\0');
+    }
+    char **args = malloc( (nargs + 1) * sizeof(char *) );
+    assert(args);
+    nargs = 0;
+    for (size_t i = 0; i < len; i += strlen( req + i ) + 1){
+      args[nargs++] = req + i;
+    }
+    args[nargs] = NULL;
+
+    char *body = NULL;
+    size_t bodyLen = 0;
+    FILE *out = open_memstream( &body, &bodyLen );
+    assert(out);
+    int failed = server->handle( nargs, args, out, server->ctx );
+    fclose( out );
+
+    int gone = respond( fd, failed, body, bodyLen );
+    free( body );
+    free( args );
+    free( req );
+    if (gone) return;
+  }
+}
+
+static void *serveThread( void *arg ){
+  MxServeThread *t = arg;
+  MxServer *server = t->server;
+  for (;;){
+    int fd = accept( server->listener, NULL, NULL );
+
+    pthread_mutex_lock( &server->lock );
+    int stopping = server->stopping;
+    if (fd >= 0 && !stopping) server->clients[t->slot] = fd;
+    pthread_mutex_unlock( &server->lock );
+
+    if (fd < 0){
+      if (stopping) break;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf( stderr, "\nError, could not accept a client: %s\n", strerror( errno ) );
+      break;
+    }
+    if (stopping){
+      close( fd );
+      break;
+    }
+
+    serveClient( server, fd );
+    pthread_mutex_lock( &server->lock );
+    server->clients[t->slot] = -1;
+    pthread_mutex_unlock( &server->lock );
+    close( fd );
+  }
+  return NULL;
+}
+
+/****************************************************
+Bind listener to path, replacing a socket there that nothing answers on
+Post: returns 0, or -1 after reporting why not
+****************************************************/
+static int bindSocket( int listener, const char *path ){
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+  if (strlen( path ) >= sizeof(addr.sun_path)){
+    fprintf( stderr, "\nError, socket path \"%s\" is too long\n", path );
+    return -1;
+  }
+  strcpy( addr.sun_path, path );
+
+  if ( bind( listener, (struct sockaddr *)&addr, sizeof(addr) ) == 0 ) return 0;
+
+  struct stat st;
+  int stale = 0;
+  if ( errno == EADDRINUSE && lstat( path, &st ) == 0 && S_ISSOCK( st.st_mode ) ){
+    int probe = socket( AF_UNIX, SOCK_STREAM, 0 );
+    stale = ( probe >= 0 && connect( probe, (struct sockaddr *)&addr, sizeof(addr) ) != 0 && errno == ECONNREFUSED );
+    if (probe >= 0) close( probe );
+  }
+  if ( stale && unlink( path ) == 0 && bind( listener, (struct sockaddr *)&addr, sizeof(addr) ) == 0 ){
+    return 0;
+  }
+  fprintf( stderr, "\nError, could not serve on \"%s\": %s\n", path,
+           (stale || errno != EADDRINUSE ? strerror( errno ) : "another server is running there") );
+  return -1;
+}
+
+int mxServe( const char *path, int nthreads, MxServeFunc handle, void *ctx ){
+  MxServer server = { .handle = handle, .ctx = ctx };
+  server.listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+  if (server.listener < 0){
+    fprintf( stderr, "\nError, could not make a socket: %s\n", strerror( errno ) );
+    return -1;
+  }
+  if ( bindSocket( server.listener, path ) != 0 ){
+    close( server.listener );
+    return -1;
+  }
+  if ( listen( server.listener, SOMAXCONN ) != 0 ){
+    fprintf( stderr, "\nError, could not listen on \"%s\": %s\n", path, strerror( errno ) );
+    close( server.listener );
+    unlink( path );
+    return -1;
+  }
+
+  //the signals that stop the server are left to this thread, which waits for them
+  sigset_t stop, old;
+  sigemptyset( &stop );
+  sigaddset( &stop, SIGINT );
+  sigaddset( &stop, SIGTERM );
+  sigaddset( &stop, SIGHUP );
+  pthread_sigmask( SIG_BLOCK, &stop, &old );
+
+  pthread_mutex_init( &server.lock, NULL );
+  server.clients = malloc( nthreads * sizeof(int) );
+  MxServeThread *threads = malloc( nthreads * sizeof(MxServeThread) );
+  assert(server.clients && threads);
+  int started = 0;
+  while (started < nthreads){
+    server.clients[started] = -1;
+    threads[started].server = &server;
+    threads[started].slot = started;
+    if ( pthread_create( &threads[started].thread, NULL, serveThread, &threads[started] ) != 0 ) break;
+    started++;
+  }
+
+  int sig;
+  if (started > 0){
+    sigwait( &stop, &sig );
+  }else{
+    fprintf( stderr, "\nError, could not start any server threads\n" );
+  }
+
+  //wake the threads waiting for a client, and hang up on the clients being served
+  pthread_mutex_lock( &server.lock );
+  server.stopping = 1;
+  shutdown( server.listener, SHUT_RDWR );
+  for (int i = 0; i < started; i++){
+    if (server.clients[i] >= 0) shutdown( server.clients[i], SHUT_RDWR );
+  }
+  pthread_mutex_unlock( &server.lock );
+  for (int i = 0; i < started; i++){
+    pthread_join( threads[i].thread, NULL );
+  }
+
+  close( server.listener );
+  unlink( path );
+  pthread_sigmask( SIG_SETMASK, &old, NULL );
+  pthread_mutex_destroy( &server.lock );
+  free( server.clients );
+  free( threads );
+  return (started > 0 ? 0 : -1);
+}
@@ -0,0 +1,38 @@
+/****************************************************
+ * mxserve.h - resident request server for mxtool -serve. Clients connect to
+ * a Unix domain socket and send requests, each answered in turn on the same
+ * connection, which they can keep open for as many requests as they like.
+ *
+ * A request is its length in bytes as a decimal number and a newline, then
+ * that many bytes: the request's arguments, each followed by a NUL byte
+ * (the first is the command). The response is "ok" or "error", a space, the
+ * length of its body in bytes and a newline, then the body.
+ ****************************************************/
+
+#ifndef MXSERVE_H_
+#define MXSERVE_H_ 1
+
+#include <stdio.h>
+
+//longest request accepted, in bytes
+#define MX_SERVE_MAXREQUEST (1 << 20)
+
+/*************************************************
+Handler for one request, called on one of the server's threads, so it may be
+running for several clients at once.
+Pre: args[0] to args[nargs - 1] are the request's arguments, nargs >= 1
+Post: writes the response body to out and returns 0, or nonzero (with the
+body saying what was wrong) for an error response
+**************************************************/
+typedef int (*MxServeFunc)( int nargs, char *args[], FILE *out, void *ctx );
+
+/*************************************************
+Serve requests on the socket at path until SIGINT, SIGTERM or SIGHUP, from a
+pool of nthreads threads that each take one client at a time. A socket left
+at path by a server that is gone is replaced.
+Post: Returns 0 once the clients have been let go and the socket removed, or
+-1 after reporting why the socket could not be set up
+**************************************************/
+int mxServe( const char *path, int nthreads, MxServeFunc handle, void *ctx );
+
+#endif
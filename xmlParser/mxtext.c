@@ -0,0 +1,188 @@
+/****************************************************
+ * mxtext.c - vectorized text kernels, see mxtext.h
+ ****************************************************/
+
+#include "mxtext.h"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(MX_TEXT_SCALAR)
+#define MX_TEXT_X86 1
+#include <immintrin.h>
+#endif
+
+/****************************************************
+A byte at a time for short text, on other CPUs, and for what is left after
+the last vector
+****************************************************/
+
+//the bytes each kernel looks for
+static const unsigned char blanks[256] = {
+  [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\v'] = 1, ['\f'] = 1, ['\r'] = 1
+};
+static const unsigned char specials[256] = {
+  ['<'] = 1, ['>'] = 1, ['&'] = 1, ['"'] = 1, ['\r'] = 1
+};
+
+//the vector kernels picked for this CPU, NULL for none
+static struct {
+  int (*blank)( const char *text, size_t len );
+  size_t (*special)( const char *text, size_t len );
+  void (*fold)( char *dst, const char *src, size_t len );
+} kernels;
+
+//text shorter than a vector is not worth a call through them
+#define MIN_VECTOR 16
+
+int mxTextBlank( const char *text, size_t len ){
+  if (len >= MIN_VECTOR && kernels.blank != NULL) return kernels.blank( text, len );
+  for (size_t i = 0; i < len; i++){
+    if (blanks[(unsigned char)text[i]] == 0) return 0;
+  }
+  return 1;
+}
+
+size_t mxTextSpecial( const char *text, size_t len ){
+  if (len >= MIN_VECTOR && kernels.special != NULL) return kernels.special( text, len );
+  for (size_t i = 0; i < len; i++){
+    if (specials[(unsigned char)text[i]]) return i;
+  }
+  return len;
+}
+
+void mxTextFold( char *dst, const char *src, size_t len ){
+  if (len >= MIN_VECTOR && kernels.fold != NULL){
+    kernels.fold( dst, src, len );
+    return;
+  }
+  for (size_t i = 0; i < len; i++){
+    char c = src[i];
+    dst[i] = (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+  }
+}
+
+#ifdef MX_TEXT_X86
+
+/****************************************************
+SSE2, which every x86-64 CPU has. Byte compares are signed, so bytes of 0x80
+and up are below every character looked for and never match a range.
+****************************************************/
+
+//0xFF in each byte of v that is white space
+static inline __m128i blank16( __m128i v ){
+  __m128i ctrl = _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( '\t' - 1 ) ),
+                                _mm_cmplt_epi8( v, _mm_set1_epi8( '\r' + 1 ) ) );
+  return _mm_or_si128( ctrl, _mm_cmpeq_epi8( v, _mm_set1_epi8( ' ' ) ) );
+}
+
+static inline __m128i special16( __m128i v ){
+  __m128i m = _mm_or_si128( _mm_cmpeq_epi8( v, _mm_set1_epi8( '<' ) ), _mm_cmpeq_epi8( v, _mm_set1_epi8( '>' ) ) );
+  m = _mm_or_si128( m, _mm_cmpeq_epi8( v, _mm_set1_epi8( '&' ) ) );
+  m = _mm_or_si128( m, _mm_cmpeq_epi8( v, _mm_set1_epi8( '"' ) ) );
+  return _mm_or_si128( m, _mm_cmpeq_epi8( v, _mm_set1_epi8( '\r' ) ) );
+}
+
+static inline __m128i fold16( __m128i v ){
+  __m128i upper = _mm_and_si128( _mm_cmpgt_epi8( v, _mm_set1_epi8( 'A' - 1 ) ),
+                                 _mm_cmplt_epi8( v, _mm_set1_epi8( 'Z' + 1 ) ) );
+  return _mm_or_si128( v, _mm_and_si128( upper, _mm_set1_epi8( 'a' - 'A' ) ) );
+}
+
+static int blankSse2( const char *text, size_t len ){
+  size_t i = 0;
+  for ( ; i + 16 <= len; i += 16){
+    __m128i v = _mm_loadu_si128( (const __m128i *)(text + i) );
+    if ( _mm_movemask_epi8( blank16( v ) ) != 0xFFFF ) return 0;
+  }
+  return mxTextBlank( text + i, len - i );
+}
+
+static size_t specialSse2( const char *text, size_t len ){
+  size_t i = 0;
+  for ( ; i + 16 <= len; i += 16){
+    int bits = _mm_movemask_epi8( special16( _mm_loadu_si128( (const __m128i *)(text + i) ) ) );
+    if (bits != 0) return i + __builtin_ctz( bits );
+  }
+  return i + mxTextSpecial( text + i, len - i );
+}
+
+static void foldSse2( char *dst, const char *src, size_t len ){
+  size_t i = 0;
+  for ( ; i + 16 <= len; i += 16){
+    _mm_storeu_si128( (__m128i *)(dst + i), fold16( _mm_loadu_si128( (const __m128i *)(src + i) ) ) );
+  }
+  mxTextFold( dst + i, src + i, len - i );
+}
+
+/****************************************************
+AVX2, 32 bytes at a time, what is left is handed to SSE2. The upper halves
+of the registers are cleared first, as the compiler does not do it for a
+call, and the SSE2 code would otherwise pay for a state transition on every
+short string.
+****************************************************/
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i blank32( __m256i v ){
+  __m256i ctrl = _mm256_and_si256( _mm256_cmpgt_epi8( v, _mm256_set1_epi8( '\t' - 1 ) ),
+                                   _mm256_cmpgt_epi8( _mm256_set1_epi8( '\r' + 1 ), v ) );
+  return _mm256_or_si256( ctrl, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( ' ' ) ) );
+}
+
+static inline AVX2 __m256i special32( __m256i v ){
+  __m256i m = _mm256_or_si256( _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '<' ) ),
+                               _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '>' ) ) );
+  m = _mm256_or_si256( m, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '&' ) ) );
+  m = _mm256_or_si256( m, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '"' ) ) );
+  return _mm256_or_si256( m, _mm256_cmpeq_epi8( v, _mm256_set1_epi8( '\r' ) ) );
+}
+
+static inline AVX2 __m256i fold32( __m256i v ){
+  __m256i upper = _mm256_and_si256( _mm256_cmpgt_epi8( v, _mm256_set1_epi8( 'A' - 1 ) ),
+                                    _mm256_cmpgt_epi8( _mm256_set1_epi8( 'Z' + 1 ), v ) );
+  return _mm256_or_si256( v, _mm256_and_si256( upper, _mm256_set1_epi8( 'a' - 'A' ) ) );
+}
+
+static AVX2 int blankAvx2( const char *text, size_t len ){
+  size_t i = 0;
+  for ( ; i + 32 <= len; i += 32){
+    __m256i v = _mm256_loadu_si256( (const __m256i *)(text + i) );
+    if ( (unsigned)_mm256_movemask_epi8( blank32( v ) ) != 0xFFFFFFFFu ) return 0;
+  }
+  _mm256_zeroupper();
+  return blankSse2( text + i, len - i );
+}
+
+static AVX2 size_t specialAvx2( const char *text, size_t len ){
+  size_t i = 0;
+  for ( ; i + 32 <= len; i += 32){
+    unsigned bits = _mm256_movemask_epi8( special32( _mm256_loadu_si256( (const __m256i *)(text + i) ) ) );
+    if (bits != 0) return i + __builtin_ctz( bits );
+  }
+  _mm256_zeroupper();
+  return i + specialSse2( text + i, len - i );
+}
+
+static AVX2 void foldAvx2( char *dst, const char *src, size_t len ){
+  size_t i = 0;
+  for ( ; i + 32 <= len; i += 32){
+    _mm256_storeu_si256( (__m256i *)(dst + i), fold32( _mm256_loadu_si256( (const __m256i *)(src + i) ) ) );
+  }
+  _mm256_zeroupper();
+  foldSse2( dst + i, src + i, len - i );
+}
+
+/****************************************************
+pick the kernels for this CPU before main, so the threads only ever read them
+****************************************************/
+__attribute__((constructor)) static void pickKernels( void ){
+  __builtin_cpu_init();
+  if ( __builtin_cpu_supports( "avx2" ) ){
+    kernels.blank = blankAvx2;
+    kernels.special = specialAvx2;
+    kernels.fold = foldAvx2;
+  }else{
+    kernels.blank = blankSse2;
+    kernels.special = specialSse2;
+    kernels.fold = foldSse2;
+  }
+}
+
+#endif
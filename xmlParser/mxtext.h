@@ -0,0 +1,29 @@
+/****************************************************
+ * mxtext.h - text kernels for the byte loops of parsing (white space only
+ * text), writing (finding what to escape) and sorting (case folding). On
+ * x86-64 they take 32 bytes at a time with AVX2 or 16 with SSE2, whichever
+ * the CPU has (looked up once, at start up); elsewhere, or built with
+ * -DMX_TEXT_SCALAR, a byte at a time. Every version gives the same results.
+ ****************************************************/
+
+#ifndef MXTEXT_H_
+#define MXTEXT_H_ 1
+
+#include <stddef.h>
+
+/*************************************************
+Post: mxTextBlank returns 1 if the len bytes at text are all white space (as
+isspace has it in the C locale: space, \t, \n, \v, \f and \r), else 0.
+mxTextSpecial returns the offset of the first of the len bytes at text that
+mxPutEscaped replaces (< > & " or a carriage return), or len if there is none.
+**************************************************/
+int mxTextBlank( const char *text, size_t len );
+size_t mxTextSpecial( const char *text, size_t len );
+
+/*************************************************
+Copy len bytes from src to dst with the ASCII capitals in lower case, as
+tolower does in the C locale. dst may be src.
+**************************************************/
+void mxTextFold( char *dst, const char *src, size_t len );
+
+#endif
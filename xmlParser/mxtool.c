@@ -9,36 +9,187 @@
 
 #include "mxtool.h"
 #include "mxutil.h"
+#include "mxindex.h"
+#include "mxserve.h"
+#include "mxcache.h"
+#include "mxtext.h"
 #include <stdlib.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
 #include <termios.h>
 #include <regex.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+//the schema, parsed on first use and shared by every file read
+static xmlSchemaPtr schema = NULL;
+//the MX_VALIDATION mode given with -validate
+static int validation = MX_VALIDATE_XSD;
+//MXFORMAT of the input given with -from (-1: tell it from each input), and of the output
+static int inFormat = -1;
+static int outFormat = MX_FORMAT_XML;
+//flag: 1 if -stats was given as -stats json
+static int statsJson = 0;
+//the index given with -lookup, NULL for none
+static const char *indexPath = NULL;
+//the lines of -lib/-bib output skipped (-offset) and printed (-limit)
+static unsigned long pageOffset = 0;
+static unsigned long pageLimit = ULONG_MAX;
+//bytes of -lib/-bib lines held before they are spilled to a temporary file (-sortmem)
+static size_t sortMemory = (size_t)256 << 20;
+//the cache given with -cache for -lib/-bib, NULL for none
+static const char *cachePath = NULL;
+
+static void unloadSchema( void ){
+  mxTerm( schema );
+  schema = NULL;
+}
 
 /*******************************************
-Print out a collection header, avoids repetitive code
-Pre: top is a collection element
-Post: Returns 1 for successfull print, 0 for any issue/error
+Parse the schema named by MXTOOL_XSD, once per run. With -validate builtin or
+none no schema is needed and none is read.
+Post: returns 1 if the files can be read (schema is set when it is needed),
+else 0 after reporting the error
 ********************************************/
-static int printCollectionHeader(const XmElem *top, FILE *outfile){
-  if ( fprintf (outfile, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n") < 1 ){
-   fprintf (stderr, "\n Error, could not write to outfile\n");
-   return 0;
+static int loadSchema( void ){
+  if ( schema != NULL || validation != MX_VALIDATE_XSD ){
+    return 1;
   }
-  fprintf (outfile,  "<!-- Output by mxutil library ( Craig Lehmann ) -->\n");
-  fprintf( outfile, "<marc:%s", top->tag );
-  fprintf(outfile, " xmlns:marc=\"http://www.loc.gov/MARC21/slim\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.loc.gov/MARC21/slim http://www.loc.gov/standards/marcxml/schema/MARC21slim.xsd\">\n");
   
+  char *schemaPath = getenv("MXTOOL_XSD"); //get the pathname of marc21 schema
+  schema = mxInit( schemaPath );
+  if (schema==NULL){
+    fprintf(stderr, "Error, check MXTOOL_XSD environment variable\n");
+    return 0;
+  }
+  atexit( unloadSchema );
   return 1;
 }
 
+//the -stats summary, at exit on stderr
+static void printStats( void ){
+  mxPrintStats( stderr, statsJson );
+}
+
+/*******************************************
+Look up the value given to option argv[i] among the nvalues in values
+Post: returns its position, or -1 after reporting a missing or unknown value
+********************************************/
+static int optionValue( int args, char *argv[], int i, const char *values[], int nvalues ){
+  for (int v = 0; v < nvalues && i + 1 < args; v++){
+    if ( strcmp( argv[i + 1], values[v] ) == 0 ) return v;
+  }
+  fprintf(stderr, "\nError, %s needs one of:", argv[i]);
+  for (int v = 0; v < nvalues; v++){
+    fprintf(stderr, " %s", values[v]);
+  }
+  fprintf(stderr, "\n");
+  return -1;
+}
+
+/*******************************************
+Apply and remove the options that can be given anywhere on the command line
+(-threads N, -validate xsd|builtin|none, -from auto|xml|marc|snapshot,
+-to xml|marc, -stats [json], -lookup FILE, -offset N, -limit N, -sortmem MB,
+-cache FILE),
+so the rest of main only sees the command and its arguments
+Pre: args and argv as given to main
+Post: returns 1 with *args and argv updated, or 0 if an option is missing its
+value or the value is invalid
+********************************************/
+static int globalOptions( int *args, char *argv[] ){
+  int kept = 1;
+  for (int i = 1; i < *args; i++){
+    if ( strcmp( argv[i], "-threads" ) == 0 ){
+      char *end = NULL;
+      long n = (i + 1 < *args ? strtol( argv[i + 1], &end, 10 ) : 0);
+      if (end == NULL || end == argv[i + 1] || *end != '\0' || n < 1 || n > 256){
+        fprintf(stderr, "\nError, -threads needs a thread count from 1 to 256\n");
+        return 0;
+      }
+      mxSetOption( MX_THREADS, (int)n );
+      i++;
+    }else if ( strcmp( argv[i], "-validate" ) == 0 ){
+      static const char *modes[] = { "xsd", "builtin", "none" };
+      validation = optionValue( *args, argv, i, modes, 3 );
+      if (validation < 0){
+        return 0;
+      }
+      mxSetOption( MX_VALIDATION, validation );
+      i++;
+    }else if ( strcmp( argv[i], "-from" ) == 0 || strcmp( argv[i], "-to" ) == 0 ){
+      //in MXFORMAT order, after "auto" for -from (snapshots are made with -snapshot)
+      static const char *formats[] = { "auto", "xml", "marc", "snapshot" };
+      int from = ( strcmp( argv[i], "-from" ) == 0 );
+      int format = optionValue( *args, argv, i, formats + !from, (from ? 4 : 2) );
+      if (format < 0){
+        return 0;
+      }
+      if (from){
+        inFormat = format - 1;
+      }else{
+        outFormat = format;
+      }
+      i++;
+    }else if ( strcmp( argv[i], "-stats" ) == 0 ){
+      //timings and counts on stderr at exit, as JSON if json follows
+      if ( i + 1 < *args && strcmp( argv[i + 1], "json" ) == 0 ){
+        statsJson = 1;
+        i++;
+      }
+      if ( mxSetOption( MX_STATS, 1 ) == 0 ) atexit( printStats );
+    }else if ( strcmp( argv[i], "-lookup" ) == 0 ){
+      if (i + 1 >= *args){
+        fprintf(stderr, "\nError, -lookup needs an index file made with -index\n");
+        return 0;
+      }
+      indexPath = argv[++i];
+    }else if ( strcmp( argv[i], "-cache" ) == 0 ){
+      if (i + 1 >= *args){
+        fprintf(stderr, "\nError, -cache needs a file to keep the -lib/-bib cache in\n");
+        return 0;
+      }
+      cachePath = argv[++i];
+    }else if ( strcmp( argv[i], "-offset" ) == 0 || strcmp( argv[i], "-limit" ) == 0 ){
+      char *end = NULL;
+      unsigned long n = (i + 1 < *args && argv[i + 1][0] != '-' ? strtoul( argv[i + 1], &end, 10 ) : 0);
+      if (end == NULL || end == argv[i + 1] || *end != '\0'){
+        fprintf(stderr, "\nError, %s needs a number of lines\n", argv[i]);
+        return 0;
+      }
+      if ( strcmp( argv[i], "-offset" ) == 0 ){
+        pageOffset = n;
+      }else{
+        pageLimit = n;
+      }
+      i++;
+    }else if ( strcmp( argv[i], "-sortmem" ) == 0 ){
+      char *end = NULL;
+      unsigned long n = (i + 1 < *args && argv[i + 1][0] != '-' ? strtoul( argv[i + 1], &end, 10 ) : 0);
+      if (end == NULL || end == argv[i + 1] || *end != '\0' || n < 1 || n > (SIZE_MAX >> 20)){
+        fprintf(stderr, "\nError, -sortmem needs a number of megabytes\n");
+        return 0;
+      }
+      sortMemory = (size_t)n << 20;
+      i++;
+    }else{
+      argv[kept++] = argv[i];
+    }
+  }
+  argv[kept] = NULL;
+  *args = kept;
+  return 1;
+}
 
 /*******************************************
 Check input arguments
 Pre: argv's contain 1 of the valid valid arguments
 Post: checks for validity of arguments, returns a number corresponding to each argument
-review = 1, cat = 2, keep = 3, discard = 4, lib = 5, bib = 6, if error return 0
+review = 1, cat = 2, keep = 3, discard = 4, lib = 5, bib = 6, snapshot = 7,
+index = 8, serve = 9, dedup = 10, if error return 0
 ********************************************/
 static int checkArgs( int args, char *argv[]){
   
@@ -63,23 +214,67 @@ static int checkArgs( int args, char *argv[]){
     return 5;
   }else if ( strcmp(argv[1], "-bib")==0){
     return 6;
+  }else if ( strcmp(argv[1], "-snapshot")==0){
+    return 7;
+  }else if ( strcmp(argv[1], "-index")==0){
+    return 8;
+  }else if ( strcmp(argv[1], "-serve")==0){
+    return 9;
+  }else if ( strcmp(argv[1], "-dedup")==0){
+    return 10;
   }
   
   fprintf (stderr, "\nError invalid command option\n");
   return 0;
 }
 
-int concat( const XmElem *top1, const XmElem *top2, FILE *outfile ){
-  
-  if ( printCollectionHeader(top1, outfile) == 0 ){
-    return EXIT_FAILURE;
+/*******************************************
+Format of the input in marcXMLfp: the one given with -from, or else told from
+its first bytes
+********************************************/
+static int inputFormat( FILE *marcXMLfp ){
+  return (inFormat >= 0 ? inFormat : mxInputFormat( marcXMLfp ));
+}
+
+/*******************************************
+Write the output in the format given with -to: putHeader and putFooter go
+around the records (only MARCXML has any), putRecords writes a record or
+each record of a collection. A record too long for ISO 2709 is reported and
+skipped.
+Post: putRecords returns -1 if the writer has failed, else 0
+********************************************/
+static void putHeader( MxWriter *w ){
+  if (outFormat == MX_FORMAT_XML) mxWriteHeader( w );
+}
+
+static void putFooter( MxWriter *w ){
+  if (outFormat == MX_FORMAT_XML) mxWriteFooter( w );
+}
+
+static int putRecords( MxWriter *w, const XmElem *elem ){
+  MxStamp start = mxPhaseStart();
+  if (outFormat == MX_FORMAT_XML){
+    mxPutElement( w, elem, (elem->nameid == MX_COLLECTION ? 0 : 1) );
+  }else if (elem->nameid != MX_COLLECTION){
+    mxPutMarc( w, elem );
+  }else{
+    for (unsigned long i = 0; i < elem->nsubs; i++){
+      mxPutMarc( w, (*elem->subelem)[i] );
+    }
   }
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  return (mxWriterError( w ) ? -1 : 0);
+}
+
+int concat( const XmElem *top1, const XmElem *top2, FILE *outfile ){
   
-  int t1 = printElement( top1, outfile, 0 );
-  int t2 = printElement( top2, outfile, 0 );
-  fprintf (outfile, "</marc:collection>\n");
+  MxWriter *w = mxWriterNew( outfile );
+  putHeader( w );
+  putRecords( w, top1 );
+  putRecords( w, top2 );
+  putFooter( w );
 
-  if (t1 == EXIT_FAILURE || t2 == EXIT_FAILURE){
+  if ( mxWriterFree( w ) != 0 ){
     return EXIT_FAILURE;
   }
   
@@ -93,22 +288,27 @@ Post: Returns pointer to a parsed tree datastructure, Caller is responsible for
 freeing marcXMLfp
 *******************************************/
 static XmElem * openXmElemTree( FILE *marcXMLfp ){
-  char *schemaPath = getenv("MXTOOL_XSD"); //get the pathname of marc21 schema  
-  xmlSchemaPtr schemaPtr = mxInit( schemaPath );
-  if (schemaPtr==NULL){
-    fprintf(stderr, "Error, check MXTOOL_XSD environment variable\n");
-    return NULL;
-  }
-  
   if (marcXMLfp==NULL){
     fprintf(stderr, "Error, could not open xml file\n");
-    mxTerm(schemaPtr);
     return NULL;
   }
   
   XmElem *top = NULL;
-  int mxReadFileError = mxReadFile( marcXMLfp, schemaPtr, &top );
-  mxTerm(schemaPtr);
+  int format = inputFormat( marcXMLfp );
+  if ( format == MX_FORMAT_SNAPSHOT ){
+    return ( mxOpenSnapshot( marcXMLfp, &top ) == 0 ? top : NULL );
+  }else if ( format == MX_FORMAT_MARC ){
+    if ( mxReadMarc( marcXMLfp, &top ) != 0 ){
+      fprintf(stderr, "\nFailed to read MARC file\n");
+      return NULL;
+    }
+    return top;
+  }
+  
+  if ( !loadSchema() ){
+    return NULL;
+  }
+  int mxReadFileError = mxReadFile( marcXMLfp, schema, &top );
   
   if (mxReadFileError == 1){
     fprintf(stderr, "\nFailed to parse XML file\n");
@@ -121,179 +321,543 @@ static XmElem * openXmElemTree( FILE *marcXMLfp ){
   return (top);
 }
 
-void marc2bib( const XmElem *mrec, BibData bdata ){
-  
-  /*get author info*/
-  const char *author = mxGetData(mrec, 100, 1,'a', 1);
-  if (author == NULL){
-    author = mxGetData(mrec, 130, 1, 'a', 1);
+/*******************************************
+Hand the records of the snapshot in marcXMLfp to recFunc in turn, each built
+as it comes up. With wanted, a record is only built if wanted gives 1 for its
+number (from 0), the others are passed over.
+Post: Returns 0, or 1 if marcXMLfp is not a sound snapshot
+*******************************************/
+static int streamSnapshot( FILE *marcXMLfp, MxRecordFunc recFunc, void *ctx,
+                           int (*wanted)( unsigned long n, void *ctx ) ){
+  MxSnapshot *snap = mxSnapshotOpen( marcXMLfp );
+  if (snap == NULL){
+    return 1;
   }
-  if (author != NULL){
-    bdata[AUTHOR] = customCopy( author );
-  }else{
-    bdata[AUTHOR] = customCopy( "na" );
+  MxArena *arena = mxArenaNew();
+  unsigned long nrecs = mxSnapshotRecords( snap );
+  for (unsigned long n = 0; n < nrecs; n++){
+    if ( wanted != NULL && !wanted( n, ctx ) ) continue;
+    XmElem *rec = mxSnapshotRecord( snap, n, arena );
+    int stop = ( rec->nameid == MX_RECORD && recFunc( rec, ctx ) != 0 );
+    mxArenaReset( arena );
+    if (stop) break;
+  }
+  mxArenaFree( arena );
+  mxSnapshotClose( snap );
+  return 0;
+}
+
+/*******************************************
+Streaming version of openXmElemTree, hands each record of marcXMLfp to recFunc
+rather than building the whole tree, so memory is bounded by the largest record
+Pre: marcXMLfp contains a pointer to a an xmlFile
+Post: Returns 0 if every record was read and validated, else 1. Caller is
+responsible for freeing marcXMLfp
+*******************************************/
+static int streamXmElems( FILE *marcXMLfp, MxRecordFunc recFunc, void *ctx ){
+  if (marcXMLfp==NULL){
+    fprintf(stderr, "Error, could not open xml file\n");
+    return 1;
+  }
+
+  int format = inputFormat( marcXMLfp );
+  if ( format == MX_FORMAT_SNAPSHOT ){
+    return streamSnapshot( marcXMLfp, recFunc, ctx, NULL );
+  }else if ( format == MX_FORMAT_MARC ){
+    if ( mxReadMarcStream( marcXMLfp, recFunc, ctx ) != 0 ){
+      fprintf(stderr, "\nFailed to read MARC file\n");
+      return 1;
+    }
+    return 0;
+  }
+
+  if ( !loadSchema() ){
+    return 1;
+  }
+  int mxReadStreamError = mxReadStream( marcXMLfp, schema, recFunc, ctx );
+
+  if (mxReadStreamError == 1){
+    fprintf(stderr, "\nFailed to parse XML file\n");
+    return 1;
+  }else if (mxReadStreamError == 2){
+    fprintf(stderr, "\nXml did not match schema\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+/*******************************************
+MxRecordFunc for binary MARC input to renderXmElems, renders records one at a
+time as worker 0
+*******************************************/
+typedef struct RenderCtx RenderCtx;
+struct RenderCtx {
+  MxRenderFunc render;
+  void *ctx;
+  MxWriter *out;
+};
+
+static int renderOne( XmElem *rec, void *ctx ){
+  RenderCtx *rc = ctx;
+  return ( rc->render( rec, 0, rc->out, rc->ctx ) != 0 || mxWriterError( rc->out ) );
+}
+
+/*******************************************
+streamXmElems for an MxRenderFunc: each record of marcXMLfp is rendered to out,
+in document order. MARCXML and snapshot input is rendered on -threads N
+threads, binary MARC on this one.
+Pre: marcXMLfp contains a pointer to a an xmlFile
+Post: Returns 0 if every record was read and validated, else 1. Caller is
+responsible for freeing marcXMLfp
+*******************************************/
+static int renderXmElems( FILE *marcXMLfp, MxRenderFunc render, void *ctx, MxWriter *out ){
+  if (marcXMLfp==NULL){
+    fprintf(stderr, "Error, could not open xml file\n");
+    return 1;
   }
   
-  /*get Title info*/
-  const char *title1 = mxGetData(mrec, 245, 1, 'a', 1);
-  const char *title2 = mxGetData(mrec, 245, 1, 'p', 1);
-  const char *title3 = mxGetData(mrec, 245, 1, 'b', 1);
+  int format = inputFormat( marcXMLfp );
+  if ( format == MX_FORMAT_SNAPSHOT ){
+    MxSnapshot *snap = mxSnapshotOpen( marcXMLfp );
+    if (snap == NULL){
+      return 1;
+    }
+    mxRenderSnapshot( snap, render, ctx, out );
+    mxSnapshotClose( snap );
+    return 0;
+  }else if ( format == MX_FORMAT_MARC ){
+    RenderCtx rc = { render, ctx, out };
+    return streamXmElems( marcXMLfp, renderOne, &rc );
+  }
   
-  if (title1 != NULL || title2 != NULL || title3 != NULL){
-    assert ( asprintf(&bdata[TITLE], "%s%s%s", (title1==NULL ? "": title1), 
-                      (title2==NULL ? "": title2), 
-                      (title3==NULL ? "": title3)) != -1 );
-  }else{
-    bdata[TITLE] = customCopy( "na" );
-  }
-  
-  /*get Publication info*/
-  const char *pub1 = mxGetData(mrec, 260, 1, 'a', 1);
-  const char *pub2 = mxGetData(mrec, 260, 1, 'b', 1);
-  const char *pub3 = mxGetData(mrec, 260, 1, 'c', 1);
-  const char *pub4 = mxGetData(mrec, 250, 1, 'a', 1);
-  if (pub1 != NULL || pub2 != NULL || pub3 != NULL || pub4 != NULL){
-    assert ( asprintf(&bdata[PUBINFO], "%s%s%s%s", 
-                      (pub1==NULL ? "": pub1), 
-                      (pub2==NULL ? "": pub2), 
-                      (pub3==NULL ? "": pub3), 
-                      (pub4==NULL ? "": pub4)) != -1 ); 
-  }else{
-    bdata[PUBINFO] = customCopy( "na" );
+  if ( !loadSchema() ){
+    return 1;
   }
+  int mxRenderStreamError = mxRenderStream( marcXMLfp, schema, render, ctx, out );
   
-  /*get Call number */
-  const char *call1 = mxGetData(mrec, 90, 1, 'a', 1);
-  const char *call2 = mxGetData(mrec, 90, 1, 'b', 1);
-  if (call1 != NULL || call2 != NULL){
-    assert ( asprintf(&bdata[CALLNUM], "%s%s", (call1==NULL ? "": call1), 
-                      (call2==NULL ? "": call2)) != -1);
-  }else{
-    const char *call3 = mxGetData(mrec, 50, 1, 'a', 1);
-    const char *call4 = mxGetData(mrec, 50, 1, 'b', 1);
-    if (call3 != NULL || call2 != NULL){
-      assert ( asprintf(&bdata[CALLNUM], "%s%s", 
-                        (call3==NULL ? "": call3), 
-                        (call4==NULL ? "": call4)) != -1);
-    }else{
-      bdata[CALLNUM] = customCopy( "na" );
-    }
+  if (mxRenderStreamError == 1){
+    fprintf(stderr, "\nFailed to parse XML file\n");
+    return 1;
+  }else if (mxRenderStreamError == 2){
+    fprintf(stderr, "\nXml did not match schema\n");
+    return 1;
   }
+  
+  return 0;
+}
+
+/*******************************************
+MxRecordFunc that copies each record to the MxWriter passed in ctx
+Pre: rec is a record element, ctx is an MxWriter
+Post: rec is printed, returns 1 to stop streaming if the writer has failed
+*******************************************/
+static int printRecord( XmElem *rec, void *ctx ){
+  return ( putRecords( (MxWriter *)ctx, rec ) == -1 );
 }
 
+/*******************************************
+How marc2bib makes each BibData field: the text of a recipe's pieces joined
+in order, a piece being the first subfield with its code in the first field
+with its tag. A recipe is used if the record has any of its first nkey
+pieces, else the next recipe for the same field is tried, and the field is
+"na" if none can be used.
+********************************************/
+#define BIB_RECIPE_PIECES 4
+
+typedef struct BibRecipe BibRecipe;
+struct BibRecipe {
+  enum BIBFIELD field;
+  int nkey;
+  int npieces;
+  int tags[BIB_RECIPE_PIECES];
+  char codes[BIB_RECIPE_PIECES + 1];
+};
 
-int review( const XmElem *top, FILE *outfile ){
+static const BibRecipe bibRecipes[] = {
+  { AUTHOR, 1, 1, { 100 }, "a" },
+  { AUTHOR, 1, 1, { 130 }, "a" },
+  { TITLE, 3, 3, { 245, 245, 245 }, "apb" },
+  { PUBINFO, 4, 4, { 260, 260, 260, 250 }, "abca" },
+  { CALLNUM, 2, 2, { 90, 90 }, "ab" },
+  { CALLNUM, 1, 2, { 50, 50 }, "ab" },
+};
+#define BIB_NRECIPES ((int)(sizeof(bibRecipes) / sizeof(bibRecipes[0])))
+
+//every BibData field, for extractBib
+#define BIB_ALL ((1u << AUTHOR) | (1u << TITLE) | (1u << PUBINFO) | (1u << CALLNUM))
+
+/*******************************************
+The recipes compiled for a single pass over a record: for each tag they use,
+the subfield codes wanted from its first field and the recipe piece each fills
+********************************************/
+#define BIB_MAXTAGS 16
+#define BIB_TAGPIECES 16
+
+typedef struct BibPiece BibPiece;
+struct BibPiece {
+  char code;
+  int recipe;           // in bibRecipes
+  int piece;            // in the recipe
+};
+
+static struct {
+  short tagIndex[1000]; // each tag's entry below, -1 if no recipe uses it
+  int ntags;
+  int npieces[BIB_MAXTAGS];
+  BibPiece pieces[BIB_MAXTAGS][BIB_TAGPIECES];
+} bibMap;
+static pthread_once_t bibMapOnce = PTHREAD_ONCE_INIT;
+
+static void compileBibMap( void ){
+  for (int tag = 0; tag < 1000; tag++){
+    bibMap.tagIndex[tag] = -1;
+  }
+  for (int r = 0; r < BIB_NRECIPES; r++){
+    for (int p = 0; p < bibRecipes[r].npieces; p++){
+      int tag = bibRecipes[r].tags[p];
+      if (bibMap.tagIndex[tag] < 0){
+        assert(bibMap.ntags < BIB_MAXTAGS);
+        bibMap.tagIndex[tag] = bibMap.ntags++;
+      }
+      int t = bibMap.tagIndex[tag];
+      assert(bibMap.npieces[t] < BIB_TAGPIECES);
+      bibMap.pieces[t][bibMap.npieces[t]++] = (BibPiece){ bibRecipes[r].codes[p], r, p };
+    }
+  }
+}
+
+/*******************************************
+Fill the BibData fields in mask (a bit for each BIBFIELD) from one pass over
+mrec's fields, as marc2bib does
+Post: the fields not in mask are NULL, the others are new strings
+********************************************/
+static void extractBib( const XmElem *mrec, unsigned mask, BibData bdata ){
+  pthread_once( &bibMapOnce, compileBibMap );
+  MxStamp start = mxPhaseStart();
   
-  if ( printCollectionHeader(top, outfile) == 0 ){
-    return EXIT_FAILURE;
+  //each piece's text (can be NULL), found once its first subfield was seen
+  const char *texts[BIB_NRECIPES][BIB_RECIPE_PIECES];
+  char found[BIB_NRECIPES][BIB_RECIPE_PIECES];
+  char seen[BIB_MAXTAGS];
+  memset( texts, 0, sizeof(texts) );
+  memset( found, 0, sizeof(found) );
+  memset( seen, 0, sizeof(seen) );
+  int nfound = 0;
+  
+  for (unsigned long i = 0; i < mrec->nsubs; i++){
+    const XmElem *field = (*mrec->subelem)[i];
+    int t = (field->tagnum >= 0 && field->tagnum < 1000 ? bibMap.tagIndex[field->tagnum] : -1);
+    if (t < 0 || seen[t]) continue;
+    seen[t] = 1;
+    
+    for (unsigned long j = 0; j < field->nsubs; j++){
+      const XmElem *sub = (*field->subelem)[j];
+      if (sub->tagnum >= 0 || sub->code == '\0') continue;
+      for (int k = 0; k < bibMap.npieces[t]; k++){
+        const BibPiece *p = &bibMap.pieces[t][k];
+        if ( p->code == sub->code && !found[p->recipe][p->piece] && (mask & 1u << bibRecipes[p->recipe].field) ){
+          found[p->recipe][p->piece] = 1;
+          texts[p->recipe][p->piece] = sub->text;
+          nfound++;
+        }
+      }
+    }
   }
   
-  FILE *input = fopen("/dev/tty", "r");
-  FILE *output = fopen("/dev/tty", "w");
-  if (input==NULL || output==NULL){
+  for (int field = AUTHOR; field <= CALLNUM; field++){
+    bdata[field] = NULL;
+    for (int r = 0; r < BIB_NRECIPES && (mask & 1u << field) && bdata[field] == NULL; r++){
+      const BibRecipe *recipe = &bibRecipes[r];
+      int usable = 0;
+      for (int p = 0; p < recipe->nkey; p++){
+        usable |= (texts[r][p] != NULL);
+      }
+      if (recipe->field != field || !usable) continue;
+      
+      size_t len = 0;
+      for (int p = 0; p < recipe->npieces; p++){
+        if (texts[r][p] != NULL) len += strlen( texts[r][p] );
+      }
+      bdata[field] = malloc( len + 1 );
+      assert(bdata[field]);
+      len = 0;
+      for (int p = 0; p < recipe->npieces; p++){
+        if (texts[r][p] == NULL) continue;
+        size_t n = strlen( texts[r][p] );
+        memcpy( bdata[field] + len, texts[r][p], n );
+        len += n;
+      }
+      bdata[field][len] = '\0';
+    }
+    if ( (mask & 1u << field) && bdata[field] == NULL ){
+      bdata[field] = customCopy( "na" );
+    }
+  }
+  mxCount( MX_COUNT_LOOKUPS, nfound );
+  mxPhaseEnd( MX_PHASE_EXTRACT, start );
+}
+
+/*******************************************
+One of the fields marc2bib gets out of mrec
+Post: Returns it as a new string
+********************************************/
+static char *bibField( const XmElem *mrec, enum BIBFIELD field ){
+  BibData bdata;
+  extractBib( mrec, 1u << field, bdata );
+  return bdata[field];
+}
+
+void marc2bib( const XmElem *mrec, BibData bdata ){
+  extractBib( mrec, BIB_ALL, bdata );
+}
+
+
+/*******************************************
+State for reviewing records one at a time, shared by review and the streaming
+-review command
+********************************************/
+typedef struct ReviewCtx ReviewCtx;
+struct ReviewCtx {
+  FILE *input;        // /dev/tty, keystrokes
+  FILE *output;       // /dev/tty, record summaries
+  MxWriter *out;      // kept records
+  struct termios initial_settings;
+  int recNum;         // sequential record number shown to the user
+  int keepRest;       // flag: 1 once 'k' has been pressed
+  int error;          // flag: 1 if a record could not be written
+};
+
+/*******************************************
+Open the terminal for review and switch it to unbuffered, no echo input
+Pre: rc points to a ReviewCtx with out set
+Post: Returns 1 if the tty is ready, 0 for any issue/error
+********************************************/
+static int openReviewTty( ReviewCtx *rc ){
+  rc->input = fopen("/dev/tty", "r");
+  rc->output = fopen("/dev/tty", "w");
+  if (rc->input==NULL || rc->output==NULL){
     fprintf (stderr, "\nError, could not open /dev/tty\n");
-    return EXIT_FAILURE;
+    return 0;
   }
   
   //Page 195, Begining Linux Programming 4th Ed. 
-  struct termios initial_settings, new_settings;
-  tcgetattr(fileno(input) ,&initial_settings);
-  new_settings = initial_settings;
+  struct termios new_settings;
+  tcgetattr(fileno(rc->input) ,&rc->initial_settings);
+  new_settings = rc->initial_settings;
   new_settings.c_lflag &= ~ICANON;
   new_settings.c_lflag &= ~ECHO;
   new_settings.c_cc[VMIN] = 1;
   new_settings.c_cc[VTIME] = 0;
   new_settings.c_lflag &= ~ISIG;
-  if(tcsetattr(fileno(input), TCSANOW, &new_settings) != 0){
+  if(tcsetattr(fileno(rc->input), TCSANOW, &new_settings) != 0){
     fprintf(stderr,"could not set attributes\n");
-    return EXIT_FAILURE;
+    return 0;
+  }
+  return 1;
+}
+
+/*******************************************
+Restore the terminal settings changed by openReviewTty
+********************************************/
+static void closeReviewTty( ReviewCtx *rc ){
+  tcsetattr(fileno(rc->input), TCSANOW, &rc->initial_settings); //Page 195, Begining Linux Programming 4th ed
+  
+  fclose (rc->input);
+  fclose (rc->output);
+}
+
+/*******************************************
+MxRecordFunc for review, shows a record summary and acts on the key pressed
+Pre: rec is a record element, ctx is a ReviewCtx ready from openReviewTty
+Post: rec is copied to out if kept. Returns 1 to stop reviewing ('d' or
+a write error), else 0
+********************************************/
+static int reviewRecord( XmElem *rec, void *ctx ){
+  ReviewCtx *rc = ctx;
+  rc->recNum++;
+  
+  if (rc->keepRest){
+    if ( putRecords( rc->out, rec ) == -1 ){
+      rc->error = 1;
+      return 1;
+    }
+    return 0;
   }
   
   BibData bibinfo;
-  for (int i = 0; i < top->nsubs; i++){
-    if ( (*top->subelem)[i] != NULL && strcmp( (*top->subelem)[i]->tag, "record") == 0 ){
-      marc2bib( (*top->subelem)[i], bibinfo );
-      fprintf (output, "%d. %s %s %s %s", i+1, bibinfo[AUTHOR], bibinfo[TITLE],
-              bibinfo[PUBINFO], bibinfo[CALLNUM]);
-      
-      if ( bibinfo[CALLNUM][ strlen( bibinfo[CALLNUM])-1 ] != '.'){
-        fprintf(output, "%c\n", '.');
-      }else{
-        fprintf(output, "\n");
-      }
-      //get input and act on it
-      char c = fgetc( input );
-      if ( c != ' ' && c != '\n' && c != 'd' && c != 'k' ){
-        fprintf (output, "\nInvalid input:");
-        fprintf (output, "\n< enter > : keep record");
-        fprintf (output, "\n< space > : skip record");
-        fprintf (output, "\n< k > : keep remaining records");
-        fprintf (output, "\n< d > : discard remaining records\n");
-        i --; //this will cause the last record to be displayed again
-      }else if (c == ' '){
-        //skip record, therefor do nothing
-      }else if (c == '\n'){
-        if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-          return EXIT_FAILURE;
-        }
-      }else if (c == 'd'){
-        i = top->nsubs; //this will break the loop and 'discard' the rest of the records
-      }else if (c == 'k'){
-        for (int g = i; g < top->nsubs; g++){
-          if ( printElement( (*top->subelem)[g] , outfile, 1) == -1 ){
-          return EXIT_FAILURE;
-          }
-        }
-        i = top->nsubs; //break i forloop
-      }
-        
-      free(bibinfo[AUTHOR]);
-      free(bibinfo[TITLE]);
-      free(bibinfo[PUBINFO]);
-      free(bibinfo[CALLNUM]);
+  marc2bib( rec, bibinfo );
+  int stop = 0;
+  char c;
+  do {
+    fprintf (rc->output, "%d. %s %s %s %s", rc->recNum, bibinfo[AUTHOR], bibinfo[TITLE],
+            bibinfo[PUBINFO], bibinfo[CALLNUM]);
+    
+    if ( bibinfo[CALLNUM][ strlen( bibinfo[CALLNUM])-1 ] != '.'){
+      fprintf(rc->output, "%c\n", '.');
+    }else{
+      fprintf(rc->output, "\n");
+    }
+    //get input and act on it
+    c = fgetc( rc->input );
+    if ( c != ' ' && c != '\n' && c != 'd' && c != 'k' ){
+      fprintf (rc->output, "\nInvalid input:");
+      fprintf (rc->output, "\n< enter > : keep record");
+      fprintf (rc->output, "\n< space > : skip record");
+      fprintf (rc->output, "\n< k > : keep remaining records");
+      fprintf (rc->output, "\n< d > : discard remaining records\n");
+    }
+  } while ( c != ' ' && c != '\n' && c != 'd' && c != 'k' ); //display the last record again
+  
+  if (c == ' '){
+    //skip record, therefor do nothing
+  }else if (c == 'd'){
+    stop = 1; //'discard' the rest of the records
+  }else{
+    rc->keepRest = (c == 'k');
+    if ( putRecords( rc->out, rec ) == -1 ){
+      rc->error = 1;
+      stop = 1;
     }
   }
   
-  tcsetattr(fileno(input), TCSANOW, &initial_settings); //Page 195, Begining Linux Programming 4th ed
+  free(bibinfo[AUTHOR]);
+  free(bibinfo[TITLE]);
+  free(bibinfo[PUBINFO]);
+  free(bibinfo[CALLNUM]);
+  return stop;
+}
+
+int review( const XmElem *top, FILE *outfile ){
+  
+  ReviewCtx rc = { .out = mxWriterNew( outfile ) };
+  putHeader( rc.out );
+  if ( openReviewTty( &rc ) == 0 ){
+    mxWriterFree( rc.out );
+    return EXIT_FAILURE;
+  }
   
-  fclose (input);
-  fclose (output);
+  for (int i = 0; i < top->nsubs; i++){
+    rc.recNum = i;
+    if ( (*top->subelem)[i] != NULL && (*top->subelem)[i]->nameid == MX_RECORD ){
+      if ( reviewRecord( (*top->subelem)[i], &rc ) ){
+        break;
+      }
+    }
+  }
   
-  fprintf (outfile, "</marc:collection>\n");
+  closeReviewTty( &rc );
+  if (rc.error == 0){
+    putFooter( rc.out );
+  }
+  if ( mxWriterFree( rc.out ) != 0 || rc.error ){
+    return EXIT_FAILURE;
+  }
 
   return 0;
 }
 
 /*******************************************
-Helper function for concat system, opens two files and sends them to concat function
-Pre: args contains the number of strings in argv, argv[2] contains the file to be 
+Streaming -review, records are read from marcXMLfp as the user goes
+Pre: marcXMLfp contains a pointer to a an xmlFile, outfile is open for writing
+Post: outfile contains the kept records, Return EXIT_FAILURE for any problem
+*******************************************/
+static int streamReview( FILE *marcXMLfp, FILE *outfile ){
+  
+  ReviewCtx rc = { .out = mxWriterNew( outfile ) };
+  putHeader( rc.out );
+  if ( openReviewTty( &rc ) == 0 ){
+    mxWriterFree( rc.out );
+    return EXIT_FAILURE;
+  }
+  
+  int readError = streamXmElems( marcXMLfp, reviewRecord, &rc );
+  closeReviewTty( &rc );
+  if (readError == 0 && rc.error == 0){
+    putFooter( rc.out );
+  }
+  if ( mxWriterFree( rc.out ) != 0 || readError || rc.error ){
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/*******************************************
+Helper function for concat system, streams the file on stdin followed by the ones
+named in argv[2..] to outfile. MARCXML files are all validated first, together,
+then their records are copied byte for byte (see mxCopyRecords); anything else
+(pipes, binary MARC, snapshots, -to marc) is read and written a record at a time.
+Pre: args contains the number of strings in argv, argv[2..] contain the files to be 
 combined with stdin,outfile contains the file to write combined files to
 Post: outfile contains the combined marcXML files, Return EXIT_FAILURE for any 
 problem
 *******************************************/
 static int combineFiles(int args, char *argv[], FILE *outfile){
   
-  XmElem *top1 = openXmElemTree( stdin );
-  if (top1 == NULL){
-    fprintf(stderr, "\nError, could not open file on stdin\n");
-    return (EXIT_FAILURE);
+  if (args < 3){
+    fprintf(stderr, "\nError, no file given to concatenate\n");
+    return EXIT_FAILURE;
+  }
+  
+  //stdin, then the files in the order given
+  int nfiles = args - 1;
+  FILE **fps = calloc( nfiles, sizeof(FILE *) );
+  int *status = calloc( nfiles, sizeof(int) );
+  assert(fps && status);
+  fps[0] = stdin;
+  int returnVal = EXIT_SUCCESS;
+  for (int i = 1; i < nfiles && returnVal == EXIT_SUCCESS; i++){
+    fps[i] = fopen (argv[i + 1], "r");
+    if (fps[i] == NULL){
+      fprintf(stderr, "\nError, could not open file \"%s\"\n",argv[i + 1] ); 
+      returnVal = EXIT_FAILURE;
+    }
   }
   
-  FILE *marcXMLfp1 = fopen (argv[2], "r");
-  if (marcXMLfp1 == NULL){
-    fprintf(stderr, "\nError, could not open file \"%s\"\n",argv[2] ); 
-    return EXIT_FAILURE; 
+  //the MARCXML files are checked up front, so nothing is written for a bad one
+  FILE **xmlFps = calloc( nfiles, sizeof(FILE *) );
+  assert(xmlFps);
+  int nxml = 0;
+  for (int i = 0; i < nfiles && returnVal == EXIT_SUCCESS && outFormat == MX_FORMAT_XML; i++){
+    if ( inputFormat( fps[i] ) == MX_FORMAT_XML ) xmlFps[nxml++] = fps[i];
   }
-  XmElem *top2 = openXmElemTree( marcXMLfp1 );
-  if (top2 == NULL){
-    return(EXIT_FAILURE);
+  if ( nxml > 0 && returnVal == EXIT_SUCCESS ){
+    int readError = (loadSchema() ? mxValidateFiles( xmlFps, nxml, schema, status ) : -1);
+    if (readError == 1){
+      fprintf(stderr, "\nFailed to parse XML file\n");
+    }else if (readError == 2){
+      fprintf(stderr, "\nXml did not match schema\n");
+    }
+    if (readError != 0) returnVal = EXIT_FAILURE;
   }
-  fclose (marcXMLfp1);
   
-  int returnVal = concat( top1, top2, outfile );
-  mxCleanElem (top1);
-  mxCleanElem (top2);
+  MxWriter *w = NULL;
+  if (returnVal == EXIT_SUCCESS){
+    w = mxWriterNew( outfile );
+    putHeader( w );
+  }
+  for (int i = 0, x = 0; i < nfiles && returnVal == EXIT_SUCCESS; i++){
+    int copied = 3;
+    if (x < nxml && xmlFps[x] == fps[i]){
+      copied = (status[x++] == 0 ? mxCopyRecords( fps[i], w ) : 3);
+    }
+    if (copied == 3){
+      copied = streamXmElems( fps[i], printRecord, w );
+      if (copied != 0 && i == 0) fprintf(stderr, "\nError, could not open file on stdin\n");
+    }
+    if (copied != 0) returnVal = EXIT_FAILURE;
+  }
+  if (w != NULL){
+    if (returnVal == EXIT_SUCCESS) putFooter( w );
+    if ( mxWriterFree( w ) != 0 ) returnVal = EXIT_FAILURE;
+  }
   
+  for (int i = 1; i < nfiles; i++){
+    if (fps[i] != NULL) fclose (fps[i]);
+  }
+  free( xmlFps );
+  free( status );
+  free( fps );
   return returnVal;
 }
 
@@ -314,365 +878,1782 @@ int match( const char *data, const char *regex ){
   }
 }
 
-int selects( const XmElem *top, const enum SELECTOR sel, const char *pattern, FILE *outfile ){
-  
-  //check for valid input pattern
-  if ( (pattern[0] != 'a' && pattern[0] != 't' && pattern[0] != 'p') || pattern[1] != '='){
-    fprintf (stderr, "\nIncorrect string match pattern. Should be: <field>=<regex>\n");
-    return EXIT_FAILURE;
+/*******************************************
+One compiled <field>=<regex> condition of an MxQuery
+********************************************/
+typedef struct MxCond MxCond;
+struct MxCond {
+  enum BIBFIELD field;  // field the regex is matched against
+  int negate;           // flag: 1 if the condition must not match
+  int newGroup;         // flag: 1 if an -or came before this condition
+  regex_t regex;
+  char *literals;       // strings the field must contain, see requiredLiterals
+};
+
+struct MxQuery {
+  int nconds;
+  MxCond *conds;        // OR of groups, each an AND of its conditions
+  unsigned fields;      // a bit for each BIBFIELD the conditions look at
+};
+
+/*******************************************
+Skip a bracket expression, p just after its '['
+Post: returns the position after its ']', or the end of the pattern
+********************************************/
+static const char *skipBracket( const char *p ){
+  if (*p == '^') p++;
+  if (*p == ']') p++;
+  while (*p != '\0' && *p != ']'){
+    if (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')){
+      //a class like [:alpha:], which can hold a ']' of its own
+      char close = p[1];
+      for (p += 2; *p != '\0' && !(p[0] == close && p[1] == ']'); p++);
+      if (*p != '\0') p += 2;
+    }else{
+      p++;
+    }
   }
-  
-  if ( printCollectionHeader(top, outfile) == 0 ){
-    return EXIT_FAILURE;
+  return (*p == ']' ? p + 1 : p);
+}
+
+/*******************************************
+Skip a group, p just after its opening ( or \( in a basic regex
+Post: returns the position after its closing one, or the end of the pattern
+********************************************/
+static const char *skipGroup( const char *p, int ere ){
+  for (int depth = 1; *p != '\0' && depth > 0; ){
+    if (*p == '['){
+      p = skipBracket( p + 1 );
+    }else if (*p == '\\' && p[1] != '\0'){
+      if (!ere && p[1] == '(') depth++;
+      if (!ere && p[1] == ')') depth--;
+      p += 2;
+    }else{
+      if (ere && *p == '(') depth++;
+      if (ere && *p == ')') depth--;
+      p++;
+    }
   }
+  return p;
+}
+
+/*******************************************
+Strings that any text matched by the regex pattern must contain, used to
+narrow a search down with the -lookup index. Only runs of plain characters
+outside groups and bracket expressions are taken, less a character a
+quantifier makes optional, and only runs of 3 or more are kept, so they never
+ask for more than the regex does.
+Pre: pattern and cflags as given to regcomp
+Post: Returns the strings one after another, each ended by '\0', with an empty
+one last (to be freed by the caller), or NULL if there are none or the pattern
+is an alternation
+********************************************/
+static char *requiredLiterals( const char *pattern, int cflags ){
+  int ere = (cflags & REG_EXTENDED);
+  int icase = (cflags & REG_ICASE);
+  char *lits = malloc( 2 * strlen( pattern ) + 2 );
+  assert(lits);
+  size_t n = 0;         // bytes in lits
+  size_t run = 0;       // where the current run starts in lits
   
-  char const *reggie = &pattern[2];
-  
-  //search each child for string reggie it it's specified tag
-  BibData bibinfo;
-  if (sel==KEEP){
-    for (int i = 0; i < top->nsubs; i++){
-      
-      if ( (*top->subelem)[i] != NULL ){
-        marc2bib( (*top->subelem)[i], bibinfo );
+  for (const char *p = pattern; *p != '\0'; ){
+    unsigned char c = *p++;
+    int quantifier = 0; // flag: 1 if c makes the character before it optional
+    if (c == '\\' && *p != '\0'){
+      char e = *p++;
+      if (e == '|'){
+        free( lits );
+        return NULL;
       }
-      
-      switch (pattern[0]){
-        case 'a':{
-          if ( match(bibinfo[AUTHOR], reggie) ){         
-            if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-              return EXIT_FAILURE;
-            }
-          }
-          break;
-        }
-        case 't':{
-          if ( match(bibinfo[TITLE], reggie) ){         
-            if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-              return EXIT_FAILURE;
-            }
-          }
-          break;
-        }
-        case 'p':{
-          if ( match(bibinfo[PUBINFO], reggie) ){         
-            if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-              return EXIT_FAILURE;
-            }
-          }
-          break;
-        }
-        default:;
+      if (!ere && e == '('){
+        p = skipGroup( p, ere );
+      }else if (!ere && (e == '?' || e == '{')){
+        quantifier = 1;
+        const char *close = (e == '{' ? strstr( p, "\\}" ) : NULL);
+        if (close != NULL) p = close + 2;
       }
-      
-      free(bibinfo[AUTHOR]);
-      free(bibinfo[TITLE]);
-      free(bibinfo[PUBINFO]);
-      free(bibinfo[CALLNUM]);
+    }else if (c == '['){
+      p = skipBracket( p );
+    }else if (ere && c == '('){
+      p = skipGroup( p, ere );
+    }else if (ere && c == '|'){
+      free( lits );
+      return NULL;
+    }else if (c == '*' || (ere && (c == '?' || c == '{'))){
+      quantifier = 1;
+      const char *close = (c == '{' ? strchr( p, '}' ) : NULL);
+      if (close != NULL) p = close + 1;
+    }else if (c != '.' && c != '^' && c != '$' && !(ere && (c == '+' || c == ')')) && !(icase && c >= 0x80)){
+      lits[n++] = c;
+      continue;
     }
-  }else if (sel == DISCARD){
-    for (int i = 0; i < top->nsubs; i++){
-      
-      if ( (*top->subelem)[i] != NULL ){
-        marc2bib( (*top->subelem)[i], bibinfo );
+    
+    //anything else ends the run, a quantifier taking the (UTF-8) character before it
+    if (quantifier && n > run){
+      n--;
+      while (n > run && ((unsigned char)lits[n] & 0xC0) == 0x80) n--;
+    }
+    if (n - run >= 3){
+      lits[n++] = '\0';
+      run = n;
+    }else{
+      n = run;
+    }
+  }
+  if (n - run >= 3){
+    lits[n++] = '\0';
+    run = n;
+  }
+  if (run == 0){
+    free( lits );
+    return NULL;
+  }
+  lits[run] = '\0';
+  return lits;
+}
+
+/*******************************************
+Parse one condition, [!]<field>[i][e]=<regex>, into cond
+Pre: arg is a condition from the command line
+Post: Returns 1 if arg was valid and its regex compiled, else prints an error
+and returns 0
+********************************************/
+static int compileCond( MxCond *cond, const char *arg ){
+  if (arg[0] == '!'){
+    cond->negate = !cond->negate;
+    arg++;
+  }
+  
+  switch (arg[0]){
+    case 'a': cond->field = AUTHOR; break;
+    case 't': cond->field = TITLE; break;
+    case 'p': cond->field = PUBINFO; break;
+    default:
+      fprintf (stderr, "\nIncorrect string match pattern. Should be: <field>[i][e]=<regex>\n");
+      return 0;
+  }
+  
+  //flags between the field and the '='
+  int cflags = REG_NOSUB;
+  const char *c = &arg[1];
+  for ( ; *c == 'i' || *c == 'e'; c++ ){
+    cflags |= (*c == 'i' ? REG_ICASE : REG_EXTENDED);
+  }
+  if (*c != '='){
+    fprintf (stderr, "\nIncorrect string match pattern. Should be: <field>[i][e]=<regex>\n");
+    return 0;
+  }
+  
+  int err = regcomp( &cond->regex, c + 1, cflags );
+  if (err != 0){
+    char msg[256];
+    regerror( err, &cond->regex, msg, sizeof msg );
+    fprintf (stderr, "\nRegex compilation failed: %s\n", msg);
+    return 0;
+  }
+  cond->literals = requiredLiterals( c + 1, cflags );
+  return 1;
+}
+
+MxQuery *compileQuery( int nargs, char *args[] ){
+  if (nargs < 1 || args[0] == NULL){
+    fprintf (stderr, "\nIncorrect string match pattern. Should be: <field>=<regex>\n");
+    return NULL;
+  }
+  
+  MxQuery *query = malloc( sizeof(MxQuery) );
+  assert(query);
+  query->nconds = 0;
+  query->fields = 0;
+  query->conds = malloc( nargs * sizeof(MxCond) );
+  assert(query->conds);
+  
+  int negate = 0;
+  int newGroup = 0;
+  for (int i = 0; i < nargs; i++){
+    if ( strcmp(args[i], "-or") == 0 ){
+      newGroup = 1;
+    }else if ( strcmp(args[i], "-and") == 0 ){
+      //conditions are and-ed by default
+    }else if ( strcmp(args[i], "-not") == 0 ){
+      negate = !negate;
+    }else{
+      MxCond *cond = &query->conds[query->nconds];
+      cond->negate = negate;
+      cond->newGroup = newGroup;
+      if ( compileCond( cond, args[i] ) == 0 ){
+        freeQuery( query );
+        return NULL;
       }
+      query->fields |= 1u << cond->field;
+      query->nconds++;
+      negate = 0;
+      newGroup = 0;
+      continue;
+    }
     
-      switch (pattern[0]){
-        case 'a':{
-          if ( match(bibinfo[AUTHOR], reggie) == 0 ){         
-            if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-              return EXIT_FAILURE;
-            }
-          }
-          break;
-        }
-        case 't':{
-          if ( match(bibinfo[TITLE], reggie) == 0 ){         
-            if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-              return EXIT_FAILURE;
-            }
-          }
-          break;
-        }
-        case 'p':{
-          if ( match(bibinfo[PUBINFO], reggie) ==0 ){         
-            if ( printElement( (*top->subelem)[i] , outfile, 1) == -1 ){
-              return EXIT_FAILURE;
-            }
-          }
-          break;
-        }
-        default:;
+    //an operator must be followed by a condition
+    if (i == nargs - 1 || (newGroup && query->nconds == 0)){
+      fprintf (stderr, "\nMisplaced \"%s\" in match pattern\n", args[i]);
+      freeQuery( query );
+      return NULL;
+    }
+  }
+  return query;
+}
+
+int matchQuery( const MxQuery *query, BibData bdata ){
+  int groupOk = 1;
+  for (int i = 0; i < query->nconds; i++){
+    const MxCond *cond = &query->conds[i];
+    if (cond->newGroup){
+      if (groupOk) return 1; //the previous group matched, no need to go on
+      groupOk = 1;
+    }else if (groupOk == 0){
+      continue; //this group has already failed
+    }
+    
+    int matched = ( regexec( &cond->regex, bdata[cond->field], 0, NULL, 0 ) == 0 );
+    if (matched == cond->negate){
+      groupOk = 0;
+    }
+  }
+  return groupOk;
+}
+
+void freeQuery( MxQuery *query ){
+  if (query == NULL) return;
+  for (int i = 0; i < query->nconds; i++){
+    regfree( &query->conds[i].regex );
+    free( query->conds[i].literals );
+  }
+  free( query->conds );
+  free( query );
+}
+
+/*******************************************
+State for selecting records, shared by selects and the streaming -keep/-discard.
+A chain of -keep and -discard operations is a stage each, and a record is
+selected if it gets through every stage in turn.
+********************************************/
+typedef struct SelectStage SelectStage;
+struct SelectStage {
+  enum SELECTOR sel;
+  MxQuery **queries;    // the query compiled for each worker, see compileQueries
+  unsigned char *candidates; // from the -lookup index (NULL for none), see queryCandidates
+};
+
+typedef struct BibPage BibPage;
+
+typedef struct SelectCtx SelectCtx;
+struct SelectCtx {
+  SelectStage *stages;
+  int nstages;
+  unsigned fields;      // a bit for each BIBFIELD the stages look at
+  MxWriter *out;        // where selected records are written, unless the chain
+  BibPage *page;        //   ends in -lib/-bib and they go to its page
+  unsigned long nrecs;  // records of the -lookup index, a bit each in candidates
+  unsigned long recNum; // records seen so far
+  unsigned long lastCandidate; // of the -keep stages, nothing after it is selected
+};
+
+/*******************************************
+Compile the conditions once for each MxRenderFunc worker (one per MX_THREADS):
+glibc's regexec locks a compiled regex while it matches, so workers sharing
+one would take turns
+Post: Returns the workers' queries (freed with freeQueries), or NULL after
+printing why the conditions are invalid
+********************************************/
+static int queryWorkers( void ){
+  return (mxGetOption( MX_THREADS ) > 1 ? mxGetOption( MX_THREADS ) : 1);
+}
+
+static void freeQueries( MxQuery **queries ){
+  for (int i = 0; i < queryWorkers(); i++){
+    freeQuery( queries[i] );
+  }
+  free( queries );
+}
+
+static MxQuery **compileQueries( int nargs, char *args[] ){
+  MxQuery **queries = calloc( queryWorkers(), sizeof(MxQuery *) );
+  assert(queries);
+  for (int i = 0; i < queryWorkers(); i++){
+    queries[i] = compileQuery( nargs, args );
+    if (queries[i] == NULL){
+      freeQueries( queries );
+      return NULL;
+    }
+  }
+  return queries;
+}
+
+/*******************************************
+Whether rec gets through every stage of sc, matched with worker's queries
+Pre: rec is a record element, record n of the input (ULONG_MAX if records are
+not numbered, when there are no candidates)
+Post: Returns 1 if it is selected, else 0
+********************************************/
+static int selected( const SelectCtx *sc, int worker, unsigned long n, const XmElem *rec ){
+  BibData bibinfo = { NULL, NULL, NULL, NULL };
+  int extracted = 0;
+  int through = 1;
+  for (int i = 0; i < sc->nstages && through; i++){
+    const SelectStage *stage = &sc->stages[i];
+    
+    //a record the index rules out cannot match, so it is not looked at
+    int matched = 0;
+    if ( stage->candidates == NULL || n >= sc->nrecs || (stage->candidates[n >> 3] & 1 << (n & 7)) ){
+      if (!extracted){
+        extractBib( rec, sc->fields, bibinfo );
+        extracted = 1;
       }
-      
-      free(bibinfo[AUTHOR]);
-      free(bibinfo[TITLE]);
-      free(bibinfo[PUBINFO]);
-      free(bibinfo[CALLNUM]);
+      MxStamp start = mxPhaseStart();
+      matched = matchQuery( stage->queries[worker], bibinfo );
+      mxPhaseEnd( MX_PHASE_MATCH, start );
     }
+    //keep matching records, or discard them
+    through = ( matched == (stage->sel == KEEP) );
   }
   
-  fprintf (outfile, "</marc:collection>\n");
-  return EXIT_SUCCESS;
+  free(bibinfo[AUTHOR]);
+  free(bibinfo[TITLE]);
+  free(bibinfo[PUBINFO]);
+  free(bibinfo[CALLNUM]);
+  return through;
+}
+
+/*******************************************
+MxRenderFunc for selects and streamSelects, copies rec to out if it is selected
+Pre: rec is a record element, ctx is a SelectCtx with compiled queries and no
+candidates
+Post: Returns 1 to stop if the writer has failed, else 0
+********************************************/
+static int renderSelect( XmElem *rec, int worker, MxWriter *out, void *ctx ){
+  SelectCtx *sc = ctx;
+  return ( selected( sc, worker, ULONG_MAX, rec ) && putRecords( out, rec ) == -1 );
 }
 
-/********************************************
-Helper function for GetOrder. (solves issue with duplicate records)
-Pre: length corresponds to the length of array. val contains an int to
-check the array for.
-Post: returns val if found, else 0
+/*******************************************
+selects for a query of nargs conditions, see compileQuery
 ********************************************/
-static int checkArrayForInt ( int *array, int val, int length ){
+static int selectTree( const XmElem *top, const enum SELECTOR sel, int nargs, char *args[], FILE *outfile ){
   
-  for (int i = 0; i < length; i++){
-    if ( array[i] == val ){
-      return val;
-    }
+  //check for valid input pattern, compiled once for all the records
+  MxQuery **queries = compileQueries( nargs, args );
+  if ( queries == NULL ){
+    return EXIT_FAILURE;
   }
-  return -1;
+  SelectStage stage = { sel, queries, NULL };
+  SelectCtx sc = { .stages = &stage, .nstages = 1, .fields = queries[0]->fields };
+  MxWriter *out = mxWriterNew( outfile );
+  putHeader( out );
+  
+  //search each child for string reggie it it's specified tag
+  if (top->nsubs > 0){
+    mxRenderRecords( *top->subelem, top->nsubs, renderSelect, &sc, out );
+  }
+  freeQueries( queries );
+  
+  putFooter( out );
+  if ( mxWriterFree( out ) != 0 ){
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
 }
 
-/*********************************************
-Helper function for sortRecs
-Pre: collections contains a collection root node, keysOriginal is an array of
-strings corresponding to collection elements, keysSorted is keysOriginal in a 
-sorted order
-Post: Return a pointer an integer array corresponding to correct order of elements
-nodes. Caller must free returned array
-**********************************************/
-static int *getOrder( XmElem *collection, const char ** keysOriginal, char **keysSorted ){
-  int *order = malloc( sizeof(int) * collection->nsubs );
-  int length = 0;
+int selects( const XmElem *top, const enum SELECTOR sel, const char *pattern, FILE *outfile ){
+  return selectTree( top, sel, 1, (char **)&pattern, outfile );
+}
+
+/*******************************************
+Records of index that can match query: those that are candidates for every
+condition of some group, a condition's candidates being the records whose
+field has all of its required literals. Negated conditions rule nothing out.
+Post: Returns a bit for each record (as in mxIndexLookup, to be freed by the
+caller), or NULL if some group has no condition the index can narrow down
+********************************************/
+static unsigned char *queryCandidates( const MxQuery *query, const MxIndex *index ){
+  size_t nbytes = (mxIndexRecords( index ) + 7) / 8;
+  unsigned char *candidates = calloc( nbytes + 1, 1 );
+  unsigned char *group = malloc( nbytes + 1 );
+  assert(candidates && group);
   
-  for (int i = 0; i < collection->nsubs; i++){
-    
-    for (int g = 0; g < collection->nsubs; g++){
-      if ( strcmp( keysSorted[i], keysOriginal[g] ) == 0 ){
-        if (checkArrayForInt(order, g, length) != g){
-          order[i] = g;
-          length++;
-          g = collection->nsubs; //break out g for loop
-        }
+  int narrowed = 0;     // flag: 1 if the index narrowed the current group down
+  for (int i = 0; i <= query->nconds; i++){
+    if (i == query->nconds || query->conds[i].newGroup){
+      if (!narrowed){
+        free( group );
+        free( candidates );
+        return NULL;
       }
+      for (size_t j = 0; j < nbytes; j++) candidates[j] |= group[j];
+      if (i == query->nconds) break;
+    }
+    if (i == 0 || query->conds[i].newGroup){
+      memset( group, 0xFF, nbytes );
+      narrowed = 0;
     }
     
+    const MxCond *cond = &query->conds[i];
+    for (const char *lit = cond->literals; lit != NULL && !cond->negate && *lit != '\0'; lit += strlen( lit ) + 1){
+      narrowed |= mxIndexLookup( index, cond->field, lit, group );
+    }
+  }
+  free( group );
+  return candidates;
+}
+
+/*******************************************
+State for -index
+********************************************/
+typedef struct IndexCtx IndexCtx;
+struct IndexCtx {
+  MxIndexBuilder *builder;
+  unsigned long nrecs;  // records added so far
+};
+
+/*******************************************
+MxRecordFunc for -index, adds the author, title and publication info of rec
+(as marc2bib gives them) to the index being built
+Pre: rec is a record element, ctx is an IndexCtx
+Post: Returns 0 to go on streaming
+********************************************/
+static int indexRecord( XmElem *rec, void *ctx ){
+  IndexCtx *ic = ctx;
+  
+  BibData bibinfo;
+  extractBib( rec, (1u << AUTHOR) | (1u << TITLE) | (1u << PUBINFO), bibinfo );
+  for (int field = AUTHOR; field <= PUBINFO; field++){
+    mxIndexAdd( ic->builder, ic->nrecs, field, bibinfo[field] );
   }
+  ic->nrecs++;
   
-  return order;
+  free(bibinfo[AUTHOR]);
+  free(bibinfo[TITLE]);
+  free(bibinfo[PUBINFO]);
+  free(bibinfo[CALLNUM]);
+  return 0;
 }
 
+/*******************************************
+-index, writes an index of the records in marcXMLfp for -lookup
+Pre: marcXMLfp contains a pointer to a an xmlFile, outfile is open for writing
+Post: outfile contains the index, nothing is written if the input could not
+be read. Return EXIT_FAILURE for any problem
+********************************************/
+static int indexRecords( FILE *marcXMLfp, FILE *outfile ){
+  IndexCtx ic = { mxIndexNew( PUBINFO + 1 ), 0 };
+  int returnVal = EXIT_FAILURE;
+  if ( streamXmElems( marcXMLfp, indexRecord, &ic ) == 0 ){
+    MxStamp start = mxPhaseStart();
+    if ( mxIndexSave( ic.builder, ic.nrecs, fileno(marcXMLfp), outfile ) == 0 ){
+      returnVal = EXIT_SUCCESS;
+    }
+    mxPhaseEnd( MX_PHASE_WRITE, start );
+  }
+  mxIndexFree( ic.builder );
+  return returnVal;
+}
+
+/*********************************************
+A record's sort key, folded to lower case once, paired with its position so
+equal keys keep their original order
+*********************************************/
+typedef struct SortKey SortKey;
+struct SortKey {
+  char *key;
+  unsigned long pos;
+};
+
+/*********************************************
+Lower case copy of key, comparing these with strcmp gives the case
+insensitive order promised for -lib and -bib
+Pre: key is a string or NULL (sorted as "")
+Post: returns a new string, caller must free it
+*********************************************/
+static char *foldKey( const char *key ){
+  if (key == NULL) key = "";
+  size_t len = strlen( key );
+  char *folded = malloc( len + 1 );
+  assert(folded);
+  mxTextFold( folded, key, len + 1 );
+  return folded;
+}
 
 /*********************************************
 qsort compare helper function
-Pre: a and b contain trwo char arrays to be compared
-Post: returns -1, 0, 1 for a less than, equal to or greater to b
+Pre: a and b point to two SortKeys to be compared
+Post: returns <0, 0, >0 for a less than, equal to or greater than b, ties are
+broken by original position so the sort is stable
 *********************************************/
-static int compare (const void *a, const void *b){
-  return strcmp ((char*)a, (char*)b);
+static int compareKeys (const void *a, const void *b){
+  const SortKey *ka = a;
+  const SortKey *kb = b;
+  int cmp = strcmp (ka->key, kb->key);
+  if (cmp != 0) return cmp;
+  return (ka->pos < kb->pos ? -1 : (ka->pos > kb->pos));
 }
 
 void sortRecs( XmElem *collection, const char *keys[] ){
   if (collection->nsubs < 2){
     return;
   }
+  MxStamp start = mxPhaseStart();
   
-  //copy keys into an array and sort new array
-  char **keysSorted = malloc ( collection->nsubs * sizeof(char*) );
-  assert(keysSorted);
-  for (int i = 0; i < collection->nsubs; i++){
-    keysSorted[i] = customCopy( keys[i] );
+  //sort (key, position) pairs, then place each record by its position
+  SortKey *sorted = malloc ( collection->nsubs * sizeof(SortKey) );
+  assert(sorted);
+  for (unsigned long i = 0; i < collection->nsubs; i++){
+    sorted[i].key = foldKey( keys[i] );
+    sorted[i].pos = i;
   }
   
-  qsort(keysSorted, collection->nsubs, sizeof *keysSorted, compare);
-  
-  int *order = getOrder( collection, keys, keysSorted );
+  qsort(sorted, collection->nsubs, sizeof(SortKey), compareKeys);
   
   //backup collection kid pointer addresses
   XmElem **backUpPtrs = malloc (sizeof ( XmElem *) * collection->nsubs );
-  for (int i = 0; i < collection->nsubs; i++){
+  assert(backUpPtrs);
+  for (unsigned long i = 0; i < collection->nsubs; i++){
     backUpPtrs[i] = (*collection->subelem)[i];
   }
   
-  //reasign collection's kids based on backUpPtrs and order array.
-  for (int i = 0; i < collection->nsubs; i++){
-    (*collection->subelem)[i] = backUpPtrs[ order[i] ];
+  //reasign collection's kids based on backUpPtrs and sorted positions.
+  for (unsigned long i = 0; i < collection->nsubs; i++){
+    (*collection->subelem)[i] = backUpPtrs[ sorted[i].pos ];
+    free (sorted[i].key);
   }
   
-  free (order);
   free (backUpPtrs);
-  
-  //free keys
-  for (int i = 0; i < collection->nsubs; i++){
-    if (keysSorted[i] != NULL){
-      free ((char*)keysSorted[i]);
+  free (sorted);
+  mxPhaseEnd( MX_PHASE_SORT, start );
+}
+
+/*******************************************
+Print a -lib or -bib line: the two key fields in the command's order, then
+the title and publication info, ending in a period
+********************************************/
+static void printBibLine( FILE *outfile, const char *first, const char *second,
+                          const char *title, const char *pubinfo ){
+  MxStamp start = mxPhaseStart();
+  int n = fprintf(outfile, "\n%s %s %s %s%s\n", first, second, title, pubinfo,
+                  (pubinfo[ strlen(pubinfo)-1 ] != '.' ? "." : ""));
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  if (n > 0) mxCount( MX_COUNT_WRITTEN, n );
+}
+
+/*********************************************
+A -lib/-bib line waiting to be printed, the record's fields with its sort key
+(so BibLines sort with compareKeys)
+*********************************************/
+typedef struct BibLine BibLine;
+struct BibLine {
+  SortKey sort;
+  BibData bibinfo;
+};
+
+/*********************************************
+The lines of -lib or -bib output from -offset to -limit, taken from the
+records as they come. Only the first offset + limit lines in sort order are
+kept, in a heap with the greatest at the top, so a record is only formatted
+if it sorts ahead of those kept so far. Once the lines take more than
+-sortmem, they are sorted and spilled to a temporary file as a run, and the
+runs are merged when the lines are printed.
+*********************************************/
+struct BibPage {
+  enum BIBFIELD keyField; // CALLNUM for -lib, AUTHOR for -bib
+  unsigned long offset; // lines skipped before printing
+  unsigned long want;   // lines to keep, ULONG_MAX for every line
+  BibLine *lines;       // a heap while want is bounded
+  unsigned long nlines;
+  unsigned long cap;
+  unsigned long seen;   // records so far
+  size_t bytes;         // held by lines
+  FILE **runs;          // spilled runs, each sorted
+  int nruns;
+  int failed;           // flag: 1 if a run could not be written
+};
+
+//runs merged at once, more are first merged into fewer, longer runs
+#define MERGE_FANIN 64
+
+static void initPage( BibPage *pg, enum BIBFIELD keyField, unsigned long offset, unsigned long limit ){
+  memset( pg, 0, sizeof(*pg) );
+  pg->keyField = keyField;
+  pg->offset = offset;
+  pg->want = (limit > ULONG_MAX - offset ? ULONG_MAX : offset + limit);
+}
+
+static void freeLine( BibLine *line ){
+  free( line->sort.key );
+  for (int field = AUTHOR; field <= CALLNUM; field++){
+    free( line->bibinfo[field] );
+  }
+}
+
+//memory taken by line, as counted against -sortmem
+static size_t lineBytes( const BibLine *line ){
+  size_t bytes = sizeof(BibLine) + strlen( line->sort.key ) + 1;
+  for (int field = AUTHOR; field <= CALLNUM; field++){
+    bytes += strlen( line->bibinfo[field] ) + 1;
+  }
+  return bytes;
+}
+
+static void freePage( BibPage *pg ){
+  for (unsigned long i = 0; i < pg->nlines; i++){
+    freeLine( &pg->lines[i] );
+  }
+  free( pg->lines );
+  for (int r = 0; r < pg->nruns; r++){
+    fclose( pg->runs[r] );
+  }
+  free( pg->runs );
+}
+
+static void swapLines( BibLine *a, BibLine *b ){
+  BibLine t = *a;
+  *a = *b;
+  *b = t;
+}
+
+/*********************************************
+A temporary file for a run, in $TMPDIR (or /tmp), removed once it is closed
+Post: Returns it open for writing and reading, or NULL after reporting why
+*********************************************/
+static FILE *newRun( void ){
+  const char *dir = getenv( "TMPDIR" );
+  if (dir == NULL || dir[0] == '\0') dir = "/tmp";
+  char *path = NULL;
+  if ( asprintf( &path, "%s/mxtoolXXXXXX", dir ) == -1 ) path = NULL;
+
+  FILE *run = NULL;
+  int fd = (path != NULL ? mkstemp( path ) : -1);
+  if (fd >= 0){
+    unlink( path );
+    run = fdopen( fd, "w+" );
+    if (run == NULL) close( fd );
+  }
+  if (run == NULL){
+    fprintf( stderr, "\nError, could not make a temporary file in %s to sort in\n", dir );
+  }
+  free( path );
+  return run;
+}
+
+/*********************************************
+A line in a run is its record number, then its key and fields, each as its
+length and its bytes
+*********************************************/
+static void putRunString( FILE *run, const char *str ){
+  size_t len = strlen( str );
+  fwrite( &len, sizeof(len), 1, run );
+  fwrite( str, 1, len, run );
+}
+
+static char *getRunString( FILE *run ){
+  size_t len;
+  if ( fread( &len, sizeof(len), 1, run ) != 1 ) return NULL;
+  char *str = malloc( len + 1 );
+  assert(str);
+  if ( fread( str, 1, len, run ) != len ){
+    free( str );
+    return NULL;
+  }
+  str[len] = '\0';
+  return str;
+}
+
+static void putRunLine( FILE *run, const BibLine *line ){
+  fwrite( &line->sort.pos, sizeof(line->sort.pos), 1, run );
+  putRunString( run, line->sort.key );
+  for (int field = AUTHOR; field <= CALLNUM; field++){
+    putRunString( run, line->bibinfo[field] );
+  }
+}
+
+/*********************************************
+Read the next line of a run
+Post: Returns 1 with line filled in, 0 at the end of the run, or -1 after
+reporting a run that could not be read back
+*********************************************/
+static int getRunLine( FILE *run, BibLine *line ){
+  if ( fread( &line->sort.pos, sizeof(line->sort.pos), 1, run ) != 1 ){
+    if ( ferror( run ) == 0 ) return 0;
+  }else{
+    int ok = ( (line->sort.key = getRunString( run )) != NULL );
+    for (int field = AUTHOR; field <= CALLNUM; field++){
+      line->bibinfo[field] = (ok ? getRunString( run ) : NULL);
+      ok = ( line->bibinfo[field] != NULL );
     }
+    if (ok) return 1;
+    freeLine( line );
+  }
+  fprintf( stderr, "\nError, could not read back a temporary file sorted into\n" );
+  return -1;
+}
+
+/*********************************************
+Close a run that has been written, ready to be read from the start
+Post: Returns 0, or -1 after reporting that it could not be written
+*********************************************/
+static int endRun( FILE *run ){
+  if ( fflush( run ) != 0 || ferror( run ) != 0 ){
+    fprintf( stderr, "\nError, could not write a temporary file to sort in\n" );
+    return -1;
   }
-  if (keysSorted != NULL){
-    free ( keysSorted );
+  rewind( run );
+  return 0;
+}
+
+/*********************************************
+Sort the lines held in pg and write them out as a new run
+Post: Returns 0 with the lines freed, else -1
+*********************************************/
+static int spillPage( BibPage *pg ){
+  MxStamp start = mxPhaseStart();
+  qsort( pg->lines, pg->nlines, sizeof(BibLine), compareKeys );
+  FILE *run = newRun();
+  for (unsigned long i = 0; i < pg->nlines; i++){
+    if (run != NULL) putRunLine( run, &pg->lines[i] );
+    freeLine( &pg->lines[i] );
   }
+  pg->nlines = 0;
+  pg->bytes = 0;
+  mxPhaseEnd( MX_PHASE_SORT, start );
   
+  if (run == NULL || endRun( run ) != 0){
+    if (run != NULL) fclose( run );
+    return -1;
+  }
+  pg->runs = realloc( pg->runs, (pg->nruns + 1) * sizeof(FILE *) );
+  assert(pg->runs);
+  pg->runs[pg->nruns++] = run;
+  return 0;
 }
 
-int libFormat( const XmElem *top, FILE *outfile ){
+/*********************************************
+MxRecordFunc taking rec's line into the BibPage in ctx, if it is among the
+first want lines so far
+Post: Returns 0 to go on, or 1 to stop if a run could not be written
+*********************************************/
+static int pageRecord( XmElem *rec, void *ctx ){
+  BibPage *pg = ctx;
   
-  //prepare array of keys
-  const char **keys = keys = malloc ( top->nsubs * sizeof(char*) );
-  assert (keys != NULL);
+  char *key = bibField( rec, pg->keyField );
+  BibLine line;
+  line.sort.key = foldKey( key );
+  line.sort.pos = pg->seen++;
+  free( key );
   
-  BibData bibinfo;
-  for (int i = 0; i < top->nsubs; i++){
+  int full = (pg->nlines == pg->want);
+  if ( full && (pg->want == 0 || compareKeys( &line, &pg->lines[0] ) > 0) ){
+    free( line.sort.key );
+    return 0;
+  }
+  marc2bib( rec, line.bibinfo );
+  pg->bytes += lineBytes( &line );
+  
+  MxStamp start = mxPhaseStart();
+  if (full){
+    //it takes the place of the greatest, then sinks to where it belongs
+    pg->bytes -= lineBytes( &pg->lines[0] );
+    freeLine( &pg->lines[0] );
+    pg->lines[0] = line;
+    for (unsigned long i = 0; ; ){
+      unsigned long top = i;
+      unsigned long left = 2 * i + 1;
+      if (left < pg->nlines && compareKeys( &pg->lines[left], &pg->lines[top] ) > 0) top = left;
+      if (left + 1 < pg->nlines && compareKeys( &pg->lines[left + 1], &pg->lines[top] ) > 0) top = left + 1;
+      if (top == i) break;
+      swapLines( &pg->lines[i], &pg->lines[top] );
+      i = top;
+    }
+  }else{
+    if (pg->nlines == pg->cap){
+      pg->cap = (pg->cap == 0 ? 64 : 2 * pg->cap);
+      pg->lines = realloc( pg->lines, pg->cap * sizeof(BibLine) );
+      assert(pg->lines);
+    }
+    pg->lines[pg->nlines++] = line;
+    //rises to where it belongs, unless every line is kept
+    for (unsigned long i = pg->nlines - 1; pg->want != ULONG_MAX && i > 0; i = (i - 1) / 2){
+      if (compareKeys( &pg->lines[i], &pg->lines[(i - 1) / 2] ) <= 0) break;
+      swapLines( &pg->lines[i], &pg->lines[(i - 1) / 2] );
+    }
+  }
+  mxPhaseEnd( MX_PHASE_SORT, start );
+  
+  if ( pg->bytes > sortMemory && spillPage( pg ) != 0 ){
+    pg->failed = 1;
+    return 1;
+  }
+  return 0;
+}
+
+//-lib prints the call number and then the author, -bib the other way round
+static void printLine( const BibPage *pg, const BibLine *line, FILE *outfile ){
+  enum BIBFIELD second = (pg->keyField == CALLNUM ? AUTHOR : CALLNUM);
+  const BibData *bibinfo = &line->bibinfo;
+  printBibLine( outfile, (*bibinfo)[pg->keyField], (*bibinfo)[second], (*bibinfo)[TITLE], (*bibinfo)[PUBINFO] );
+}
+
+/*********************************************
+Move the head at j down the merge heap to where it belongs, taking its run
+with it
+*********************************************/
+static void siftHead( BibLine *heads, FILE **from, int nheads, int j ){
+  for (;;){
+    int least = j;
+    int left = 2 * j + 1;
+    if (left < nheads && compareKeys( &heads[left], &heads[least] ) < 0) least = left;
+    if (left + 1 < nheads && compareKeys( &heads[left + 1], &heads[least] ) < 0) least = left + 1;
+    if (least == j) return;
+    swapLines( &heads[j], &heads[least] );
+    FILE *run = from[j];
+    from[j] = from[least];
+    from[least] = run;
+    j = least;
+  }
+}
+
+/*********************************************
+Merge nruns runs, a line at a time from each in a heap with the least line
+at the top. The first pg->want lines go to the run out, or if out is NULL,
+those from pg->offset on are printed to outfile.
+Post: Returns 0, or -1 if a run could not be read back
+*********************************************/
+static int mergeRuns( const BibPage *pg, FILE **runs, int nruns, FILE *out, FILE *outfile ){
+  BibLine *heads = malloc( (nruns + 1) * sizeof(BibLine) );
+  FILE **from = malloc( (nruns + 1) * sizeof(FILE *) );
+  assert(heads && from);
+  
+  int nheads = 0;
+  int status = 0;
+  for (int r = 0; r < nruns && status >= 0; r++){
+    status = getRunLine( runs[r], &heads[nheads] );
+    if (status == 1) from[nheads++] = runs[r];
+  }
+  for (int i = nheads / 2 - 1; i >= 0; i--){
+    siftHead( heads, from, nheads, i );
+  }
+  
+  for (unsigned long n = 0; nheads > 0 && n < pg->want && status >= 0; n++){
+    if (out != NULL){
+      putRunLine( out, &heads[0] );
+    }else if (n >= pg->offset){
+      printLine( pg, &heads[0], outfile );
+    }
+    freeLine( &heads[0] );
     
-    if ( (*top->subelem)[i] != NULL ){
-      marc2bib( (*top->subelem)[i], bibinfo );
-      keys[i] = customCopy( bibinfo[CALLNUM] );
-      free(bibinfo[AUTHOR]);
-      free(bibinfo[TITLE]);
-      free(bibinfo[PUBINFO]);
-      free(bibinfo[CALLNUM]);  
+    //the run's next line takes its place, or the last head if the run is done
+    status = getRunLine( from[0], &heads[0] );
+    if (status != 1){
+      nheads--;
+      heads[0] = heads[nheads];
+      from[0] = from[nheads];
     }
+    siftHead( heads, from, nheads, 0 );
+  }
+  
+  for (int i = 0; i < nheads; i++){
+    freeLine( &heads[i] );
+  }
+  free( heads );
+  free( from );
+  return (status < 0 ? -1 : 0);
+}
+
+/*********************************************
+Sort the lines kept in pg and print those from pg->offset on, merging them with
+the runs spilled so far if there are any, then free them
+Post: Returns EXIT_SUCCESS, or EXIT_FAILURE if a run could not be written or
+read back
+*********************************************/
+static int printPage( BibPage *pg, FILE *outfile ){
+  if (pg->nruns == 0){
+    MxStamp start = mxPhaseStart();
+    if (pg->nlines > 0) qsort( pg->lines, pg->nlines, sizeof(BibLine), compareKeys );
+    mxPhaseEnd( MX_PHASE_SORT, start );
     
+    for (unsigned long i = pg->offset; i < pg->nlines; i++){
+      printLine( pg, &pg->lines[i], outfile );
+    }
+    freePage( pg );
+    return EXIT_SUCCESS;
   }
-  //sort records
-  XmElem collection = *top;
-  sortRecs( &collection, keys);
   
-  //free keys
-  for (int i = 0; i < top->nsubs; i++){
-    if (keys[i] != NULL){
-      free ((char*)keys[i]);
+  int ok = ( spillPage( pg ) == 0 );
+  MxStamp start = mxPhaseStart();
+  while (ok && pg->nruns > MERGE_FANIN){
+    //the first MERGE_FANIN runs make one, which goes to the back
+    FILE *run = newRun();
+    ok = ( run != NULL && mergeRuns( pg, pg->runs, MERGE_FANIN, run, NULL ) == 0 && endRun( run ) == 0 );
+    for (int r = 0; r < MERGE_FANIN; r++){
+      fclose( pg->runs[r] );
     }
+    pg->nruns -= MERGE_FANIN;
+    memmove( pg->runs, pg->runs + MERGE_FANIN, pg->nruns * sizeof(FILE *) );
+    if (run != NULL) pg->runs[pg->nruns++] = run;
   }
-  if (keys != NULL){
-    free ( keys );
+  mxPhaseEnd( MX_PHASE_SORT, start );
+  
+  ok = ( ok && mergeRuns( pg, pg->runs, pg->nruns, NULL, outfile ) == 0 );
+  freePage( pg );
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/*********************************************
+-lib or -bib output for the records of a collection tree, limit lines from
+offset on
+*********************************************/
+static int formatTree( const XmElem *top, enum BIBFIELD keyField, unsigned long offset,
+                       unsigned long limit, FILE *outfile ){
+  BibPage pg;
+  initPage( &pg, keyField, offset, limit );
+  for (unsigned long i = 0; i < top->nsubs && !pg.failed; i++){
+    if ( (*top->subelem)[i] != NULL ){
+      pageRecord( (*top->subelem)[i], &pg );
+    }
+  }
+  if (pg.failed){
+    freePage( &pg );
+    return EXIT_FAILURE;
   }
+  return printPage( &pg, outfile );
+}
+
+/*********************************************
+Streaming -lib and -bib, only the fields of the lines that may be printed are
+held while the records are read
+Pre: marcXMLfp contains a pointer to a an xmlFile, outfile is open for writing
+Post: outfile has the lines, nothing is printed if the input could not be
+read. Return EXIT_FAILURE for any problem
+*********************************************/
+static int streamFormat( FILE *marcXMLfp, enum BIBFIELD keyField, FILE *outfile ){
+  BibPage pg;
+  initPage( &pg, keyField, pageOffset, pageLimit );
+  if ( streamXmElems( marcXMLfp, pageRecord, &pg ) != 0 || pg.failed ){
+    freePage( &pg );
+    return EXIT_FAILURE;
+  }
+  return printPage( &pg, outfile );
+}
+
+int libFormat( const XmElem *top, FILE *outfile ){
+  return formatTree( top, CALLNUM, pageOffset, pageLimit, outfile );
+}
+
+int bibFormat( const XmElem *top, FILE *outfile ){
+  return formatTree( top, AUTHOR, pageOffset, pageLimit, outfile );
+}
+
+/*********************************************
+Cached -lib and -bib (-cache FILE): the cache holds, for each record of the
+last run, a hash of its bytes, its fields and both sort keys, in the order
+its line came out. Records whose hash is in the cache are not parsed or
+validated again, only the others are read, and their lines are merged with
+the cached ones, which are in order already unless records were moved.
+*********************************************/
+
+//a record's cached strings: its BibData, then its folded author and call number
+#define CACHE_FIELDS 6
+#define CACHE_KEY( keyField ) ((keyField) == CALLNUM ? 5 : 4)
+
+/*********************************************
+A line of cached -lib/-bib output, with the record's hash and its entry in
+the cache (its strings are then the cache's) or -1 if it was read this time
+*********************************************/
+typedef struct CachedLine CachedLine;
+struct CachedLine {
+  BibLine line;           // first, so CachedLines sort with compareKeys
+  uint64_t hash;
+  long entry;
+};
+
+typedef struct CacheRun CacheRun;
+struct CacheRun {
+  enum BIBFIELD keyField;
+  const MxCache *cache;   // NULL if there is none yet
+  uint64_t seed;          // hash of the document's head, set by the first record
+  int seeded;
+  uint64_t *hashes;       // of every record, in document order
+  long *entries;          // each record's cache entry, -1 if it is read
+  unsigned long nrecs;
+  unsigned long cap;
+  CachedLine *fresh;      // the lines of the records read, in document order
+  unsigned long nfresh;
+  unsigned long freshCap;
+  unsigned long nextFresh;// the record the next one read is looked for from
+};
+
+/*********************************************
+MxScanFunc for cachedFormat: note the record's hash, and have it read if the
+cache does not have it. The head and the validation mode go into the hash,
+so a record is read again if either changes.
+*********************************************/
+static int scanCached( const char *head, size_t headLen, const char *xml, size_t len, void *ctx ){
+  CacheRun *cr = ctx;
+  if (!cr->seeded){
+    cr->seed = mxCacheHash( head, headLen, validation );
+    cr->seeded = 1;
+  }
+  if (cr->nrecs == cr->cap){
+    cr->cap = (cr->cap == 0 ? 1024 : 2 * cr->cap);
+    cr->hashes = realloc( cr->hashes, cr->cap * sizeof(uint64_t) );
+    cr->entries = realloc( cr->entries, cr->cap * sizeof(long) );
+    assert(cr->hashes && cr->entries);
+  }
+  uint64_t hash = mxCacheHash( xml, len, cr->seed );
+  long entry = (cr->cache != NULL ? mxCacheFind( cr->cache, hash ) : -1);
+  cr->hashes[cr->nrecs] = hash;
+  cr->entries[cr->nrecs] = entry;
+  cr->nrecs++;
+  return (entry < 0);
+}
+
+/*********************************************
+MxRecordFunc for cachedFormat, takes the line of a record the cache did not
+have, which is the next one scanCached wanted read
+*********************************************/
+static int freshRecord( XmElem *rec, void *ctx ){
+  CacheRun *cr = ctx;
+  unsigned long pos = cr->nextFresh;
+  while (cr->entries[pos] >= 0) pos++;
+  cr->nextFresh = pos + 1;
+  
+  if (cr->nfresh == cr->freshCap){
+    cr->freshCap = (cr->freshCap == 0 ? 64 : 2 * cr->freshCap);
+    cr->fresh = realloc( cr->fresh, cr->freshCap * sizeof(CachedLine) );
+    assert(cr->fresh);
+  }
+  CachedLine *cl = &cr->fresh[cr->nfresh++];
+  marc2bib( rec, cl->line.bibinfo );
+  cl->line.sort.key = foldKey( cl->line.bibinfo[cr->keyField] );
+  cl->line.sort.pos = pos;
+  cl->hash = cr->hashes[pos];
+  cl->entry = -1;
+  return 0;
+}
+
+/*********************************************
+the entry for cl in the cache being built
+*********************************************/
+static void cacheLine( MxCacheBuilder *b, const CacheRun *cr, const CachedLine *cl ){
+  const char *fields[CACHE_FIELDS];
+  for (int field = AUTHOR; field <= CALLNUM; field++){
+    fields[field] = cl->line.bibinfo[field];
+  }
+  enum BIBFIELD other = (cr->keyField == CALLNUM ? AUTHOR : CALLNUM);
+  char *folded = NULL;
+  fields[CACHE_KEY( cr->keyField )] = cl->line.sort.key;
+  if (cl->entry >= 0){
+    fields[CACHE_KEY( other )] = mxCacheField( cr->cache, cl->entry, CACHE_KEY( other ) );
+  }else{
+    fields[CACHE_KEY( other )] = folded = foldKey( cl->line.bibinfo[other] );
+  }
+  mxCacheAdd( b, cl->hash, fields );
+  free( folded );
+}
+
+static void freeCacheRun( CacheRun *cr ){
+  for (unsigned long i = 0; i < cr->nfresh; i++){
+    freeLine( &cr->fresh[i].line );
+  }
+  free( cr->fresh );
+  free( cr->hashes );
+  free( cr->entries );
+}
+
+/*********************************************
+-lib or -bib with -cache: lines for the records the cache has are taken from
+it, the other records are read, then the cache is saved for the next run
+with every record's line. Input that is not a regular MARCXML file is read
+as usual, without the cache.
+Pre: marcXMLfp contains a pointer to a an xmlFile, outfile is open for writing
+Post: outfile has the lines, nothing is printed if the input could not be
+read. Return EXIT_FAILURE for any problem
+*********************************************/
+static int cachedFormat( FILE *marcXMLfp, enum BIBFIELD keyField, FILE *outfile ){
+  if ( inputFormat( marcXMLfp ) != MX_FORMAT_XML ){
+    fprintf(stderr, "\nWarning, -cache only works for a MARCXML file, it is not used\n");
+    return streamFormat( marcXMLfp, keyField, outfile );
+  }
+  if ( !loadSchema() ){
+    return EXIT_FAILURE;
+  }
+  
+  CacheRun cr;
+  memset( &cr, 0, sizeof(cr) );
+  cr.keyField = keyField;
+  MxCache *cache = mxCacheOpen( cachePath, CACHE_FIELDS );
+  cr.cache = cache;
+  int status = mxScanRecords( marcXMLfp, schema, scanCached, freshRecord, &cr );
+  if (status != 0){
+    freeCacheRun( &cr );
+    if (cache != NULL) mxCacheClose( cache );
+    if (status == 3){
+      fprintf(stderr, "\nWarning, -cache only works for a MARCXML file, it is not used\n");
+      return streamFormat( marcXMLfp, keyField, outfile );
+    }
+    fprintf(stderr, (status == 1 ? "\nFailed to parse XML file\n" : "\nXml did not match schema\n"));
+    return EXIT_FAILURE;
+  }
+  
+  //the records the cache has, grouped by entry in its order: counted, then placed
+  unsigned long nentries = (cache != NULL ? mxCacheEntries( cache ) : 0);
+  unsigned long *place = calloc( nentries + 1, sizeof(unsigned long) );
+  assert(place);
+  for (unsigned long i = 0; i < cr.nrecs; i++){
+    if (cr.entries[i] >= 0) place[cr.entries[i] + 1]++;
+  }
+  for (unsigned long e = 0; e < nentries; e++){
+    place[e + 1] += place[e];
+  }
+  unsigned long nkept = place[nentries];
+  CachedLine *kept = malloc( (nkept + 1) * sizeof(CachedLine) );
+  assert(kept);
+  for (unsigned long i = 0; i < cr.nrecs; i++){
+    long e = cr.entries[i];
+    if (e < 0) continue;
+    CachedLine *cl = &kept[place[e]++];
+    for (int field = AUTHOR; field <= CALLNUM; field++){
+      cl->line.bibinfo[field] = (char *)mxCacheField( cache, e, field );
+    }
+    cl->line.sort.key = (char *)mxCacheField( cache, e, CACHE_KEY( keyField ) );
+    cl->line.sort.pos = i;
+    cl->hash = cr.hashes[i];
+    cl->entry = e;
+  }
+  free( place );
+  
+  //the cached lines only need sorting if the cache was for the other command or records moved
+  MxStamp start = mxPhaseStart();
+  int ordered = ( cache != NULL && mxCacheOrder( cache ) == (int)keyField );
+  for (unsigned long i = 1; ordered && i < nkept; i++){
+    ordered = ( compareKeys( &kept[i - 1], &kept[i] ) < 0 );
+  }
+  if (!ordered && nkept > 1) qsort( kept, nkept, sizeof(CachedLine), compareKeys );
+  if (cr.nfresh > 1) qsort( cr.fresh, cr.nfresh, sizeof(CachedLine), compareKeys );
+  mxPhaseEnd( MX_PHASE_SORT, start );
   
-  //print in library format
-  XmElem *temp = &collection;
-  for (int i = 0; i < temp->nsubs; i++){
-    marc2bib( (*temp->subelem)[i], bibinfo );
-    fprintf(outfile, "\n%s %s %s %s", bibinfo[CALLNUM], bibinfo[AUTHOR],
-            bibinfo[TITLE], bibinfo[PUBINFO]);
-    if ( bibinfo[PUBINFO][ strlen( bibinfo[PUBINFO])-1 ] != '.'){
-        fprintf(outfile, "%c\n", '.');
+  //merge the two, printing the page and caching every line
+  MxCacheBuilder *b = mxCacheNew( CACHE_FIELDS, keyField );
+  enum BIBFIELD second = (keyField == CALLNUM ? AUTHOR : CALLNUM);
+  unsigned long want = (pageLimit > ULONG_MAX - pageOffset ? ULONG_MAX : pageOffset + pageLimit);
+  unsigned long k = 0;
+  unsigned long f = 0;
+  for (unsigned long n = 0; k < nkept || f < cr.nfresh; n++){
+    const CachedLine *cl;
+    if ( f == cr.nfresh || (k < nkept && compareKeys( &kept[k], &cr.fresh[f] ) < 0) ){
+      cl = &kept[k++];
     }else{
-        fprintf(outfile, "\n");
+      cl = &cr.fresh[f++];
+    }
+    if (n >= pageOffset && n < want){
+      const char *const *bibinfo = (const char *const *)cl->line.bibinfo;
+      printBibLine( outfile, bibinfo[keyField], bibinfo[second], bibinfo[TITLE], bibinfo[PUBINFO] );
     }
-    free(bibinfo[AUTHOR]);
-    free(bibinfo[TITLE]);
-    free(bibinfo[PUBINFO]);
-    free(bibinfo[CALLNUM]);
+    cacheLine( b, &cr, cl );
   }
   
-  return EXIT_SUCCESS;
+  int saved = mxCacheSave( b, cachePath );
+  mxCacheFree( b );
+  free( kept );
+  freeCacheRun( &cr );
+  if (cache != NULL) mxCacheClose( cache );
+  return (saved == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
-int bibFormat( const XmElem *top, FILE *outfile ){
+/*******************************************
+MxRecordFunc for streamSelects when records have to be taken in order: with
+the -lookup index, which numbers them, or for a chain ending in -lib/-bib.
+A selected record is copied to out, or taken into the page.
+Pre: rec is a record element, ctx is a SelectCtx with compiled queries
+Post: Returns 1 to stop streaming if the output has failed or no candidates
+are left for the -keep stages, else 0
+********************************************/
+static int selectRecord( XmElem *rec, void *ctx ){
+  SelectCtx *sc = ctx;
   
-  //prepare array of keys
-  const char **keys = keys = malloc ( top->nsubs * sizeof(char*) );
-  assert (keys != NULL);
+  unsigned long n = sc->recNum++;
+  if ( selected( sc, 0, n, rec ) ){
+    if (sc->page != NULL ? pageRecord( rec, sc->page ) != 0 : putRecords( sc->out, rec ) == -1){
+      return 1;
+    }
+  }
+  //past the last candidate there is nothing left to keep
+  return ( n >= sc->lastCandidate );
+}
+
+/*******************************************
+streamSnapshot wanted function for streamSelects: a record that the -lookup
+index rules out of a -keep stage cannot be selected, so it is not even built
+Pre: ctx is a SelectCtx, n is the number of the next record
+Post: Returns 1 if record n has to be matched, else 0 (it is counted as seen)
+********************************************/
+static int selectWanted( unsigned long n, void *ctx ){
+  SelectCtx *sc = ctx;
+  for (int i = 0; i < sc->nstages; i++){
+    const SelectStage *stage = &sc->stages[i];
+    if ( stage->sel == KEEP && stage->candidates != NULL && n < sc->nrecs &&
+         !(stage->candidates[n >> 3] & 1 << (n & 7)) ){
+      sc->recNum++;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int isOperation( const char *arg ){
+  return ( strcmp(arg, "-keep") == 0 || strcmp(arg, "-discard") == 0 ||
+           strcmp(arg, "-lib") == 0 || strcmp(arg, "-bib") == 0 );
+}
+
+static void freeStages( SelectCtx *sc ){
+  for (int i = 0; i < sc->nstages; i++){
+    if (sc->stages[i].queries != NULL) freeQueries( sc->stages[i].queries );
+    free( sc->stages[i].candidates );
+  }
+  free( sc->stages );
+}
+
+/*******************************************
+Narrow each stage of sc down to the candidates of the -lookup index, if it is
+the index of marcXMLfp
+Post: Returns 1 if no record can get through the -keep stages, else 0
+********************************************/
+static int lookupStages( SelectCtx *sc, FILE *marcXMLfp, const MxIndex *index ){
+  if ( !mxIndexFor( index, fileno(marcXMLfp) ) ){
+    fprintf(stderr, "\nWarning, %s was not made from this input, it is not used\n", indexPath);
+    return 0;
+  }
+  sc->nrecs = mxIndexRecords( index );
   
-  BibData bibinfo;
-  for (int i = 0; i < top->nsubs; i++){
+  int none = 0;
+  for (int i = 0; i < sc->nstages; i++){
+    SelectStage *stage = &sc->stages[i];
+    stage->candidates = queryCandidates( stage->queries[0], index );
+    if (stage->sel == DISCARD || stage->candidates == NULL) continue;
     
-    if ( (*top->subelem)[i] != NULL ){
-      marc2bib( (*top->subelem)[i], bibinfo );
-      keys[i] = customCopy( bibinfo[AUTHOR] );
-      free(bibinfo[AUTHOR]);
-      free(bibinfo[TITLE]);
-      free(bibinfo[PUBINFO]);
-      free(bibinfo[CALLNUM]);  
+    unsigned long last = ULONG_MAX;
+    for (unsigned long n = 0; n < sc->nrecs; n++){
+      if (stage->candidates[n >> 3] & 1 << (n & 7)) last = n;
     }
+    none |= (last == ULONG_MAX);
+    if (last < sc->lastCandidate) sc->lastCandidate = last;
   }
-  //sort records
-  XmElem collection = *top;
-  sortRecs( &collection, keys);
+  return none;
+}
+
+/*******************************************
+Streaming -keep/-discard, records are read from marcXMLfp and written as they
+are selected, so the whole collection is never in memory. Any number of -keep
+and -discard operations can be chained, each with its conditions, and the
+chain can end in -lib or -bib to print the selected records' lines instead:
+  -keep a=Monk -discard p=Atlantic -lib
+Records are parsed and validated once, and pass from one operation to the
+next in memory. With -lookup, each operation only matches the records the
+index gives as its candidates.
+Pre: marcXMLfp contains a pointer to a an xmlFile, args are the operations
+from the first -keep/-discard, outfile is open for writing
+Post: outfile contains the selected records (or their lines), Return
+EXIT_FAILURE for any problem
+********************************************/
+static int streamSelects( FILE *marcXMLfp, int nargs, char *args[], FILE *outfile ){
   
-  //free keys
-  for (int i = 0; i < top->nsubs; i++){
-    if (keys[i] != NULL){
-      free ((char*)keys[i]);
+  SelectCtx sc = { .stages = calloc( nargs, sizeof(SelectStage) ), .lastCandidate = ULONG_MAX };
+  assert(sc.stages);
+  int formatKey = -1;   // the BIBFIELD of a closing -lib/-bib
+  int ok = 1;
+  for (int i = 0; i < nargs && ok; ){
+    //an operation's conditions run up to the next operation
+    int end = i + 1;
+    while (end < nargs && !isOperation( args[end] )) end++;
+    
+    if ( strcmp(args[i], "-lib") == 0 || strcmp(args[i], "-bib") == 0 ){
+      if (end != nargs || end != i + 1){
+        fprintf(stderr, "\nError, %s has to come last, with nothing after it\n", args[i]);
+        ok = 0;
+      }
+      formatKey = (args[i][1] == 'l' ? CALLNUM : AUTHOR);
+    }else{
+      SelectStage *stage = &sc.stages[sc.nstages++];
+      stage->sel = (strcmp(args[i], "-keep") == 0 ? KEEP : DISCARD);
+      stage->queries = compileQueries( end - i - 1, args + i + 1 );
+      ok = (stage->queries != NULL);
+      if (ok) sc.fields |= stage->queries[0]->fields;
     }
-  }
-  if (keys != NULL){
-    free ( keys );
+    i = end;
   }
   
-  //print in library format
-  XmElem *temp = &collection;
-  for (int i = 0; i < temp->nsubs; i++){
-    marc2bib( (*temp->subelem)[i], bibinfo );
-    fprintf(outfile, "\n%s %s %s %s", bibinfo[AUTHOR], bibinfo[CALLNUM],
-            bibinfo[TITLE], bibinfo[PUBINFO]);
-    if ( bibinfo[PUBINFO][ strlen( bibinfo[PUBINFO])-1 ] != '.'){
-        fprintf(outfile, "%c\n", '.');
-    }else{
-      fprintf(outfile, "\n");
+  int none = 0;         // flag: 1 if the index leaves nothing to select
+  if (ok && indexPath != NULL){
+    MxIndex *index = mxIndexOpen( indexPath );
+    ok = (index != NULL);
+    if (ok){
+      none = lookupStages( &sc, marcXMLfp, index );
+      mxIndexClose( index );
     }
-            
-    free(bibinfo[AUTHOR]);
-    free(bibinfo[TITLE]);
-    free(bibinfo[PUBINFO]);
-    free(bibinfo[CALLNUM]);
+  }
+  if (!ok){
+    freeStages( &sc );
+    return EXIT_FAILURE;
+  }
+  
+  BibPage page;
+  if (formatKey >= 0){
+    initPage( &page, formatKey, pageOffset, pageLimit );
+    sc.page = &page;
+  }else{
+    sc.out = mxWriterNew( outfile );
+    putHeader( sc.out );
   }
   
+  //records are matched and written on the reading threads unless they have
+  //to be taken in order
+  int ordered = (sc.page != NULL);
+  for (int i = 0; i < sc.nstages; i++){
+    ordered |= (sc.stages[i].candidates != NULL);
+  }
+  int readError = 0;
+  if (none){
+    //nothing to read
+  }else if (!ordered){
+    readError = renderXmElems( marcXMLfp, renderSelect, &sc, sc.out );
+  }else if ( inputFormat( marcXMLfp ) == MX_FORMAT_SNAPSHOT ){
+    readError = streamSnapshot( marcXMLfp, selectRecord, &sc, selectWanted );
+  }else{
+    readError = streamXmElems( marcXMLfp, selectRecord, &sc );
+  }
+  freeStages( &sc );
+  
+  if (sc.page != NULL){
+    if (readError || page.failed){
+      freePage( &page );
+      return EXIT_FAILURE;
+    }
+    return printPage( &page, outfile );
+  }
+  if (readError == 0){
+    putFooter( sc.out );
+  }
+  if ( mxWriterFree( sc.out ) != 0 || readError ){
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
 
+/*********************************************
+-dedup: the records with the same control number are collapsed into the one
+whose 005 (date and time of latest transaction) is latest, or the first read
+if they tie. A record's key is its 001 qualified by its 003 (the agency
+that numbered it), its 001 alone if it has no 003, or without a 001 its 010$a
+(LCCN), and records with neither are never duplicates. A record that may be kept is
+spooled to a temporary file when it is read, and the winners are copied out at
+the end, in the order their keys were first seen.
+*********************************************/
+typedef struct DedupEntry DedupEntry;
+struct DedupEntry {
+  char *key;            // NULL for a record without one
+  char *stamp;          // the winner's 005, NULL if it has none
+  off_t offset;         // of the winner in the spool
+  size_t len;
+  unsigned long copies; // records read with the key
+};
+
+typedef struct DedupCtx DedupCtx;
+struct DedupCtx {
+  DedupEntry *entries;  // in the order their keys were first seen
+  unsigned long nentries;
+  unsigned long cap;
+  unsigned long *table; // open addressing on the key's hash: an entry + 1, 0 if empty
+  unsigned long size;   // slots, a power of 2
+  unsigned long nkeys;  // entries with a key
+  FILE *spool;
+  off_t spoolLen;
+  MxWriter *scratch;    // where a record is written on its way to the spool
+  unsigned long nrecs;  // records read
+};
+
+static unsigned long hashKey( const char *key ){
+  unsigned long long h = 14695981039346656037ULL;
+  for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++){
+    h = (h ^ *p) * 1099511628211ULL;
+  }
+  return (unsigned long)(h ^ (h >> 32));
+}
+
+/*********************************************
+slot of key in dc's table, or the empty slot it would go in
+*********************************************/
+static unsigned long *findKey( const DedupCtx *dc, const char *key ){
+  unsigned long i = hashKey( key ) & (dc->size - 1);
+  while (dc->table[i] != 0 && strcmp( dc->entries[dc->table[i] - 1].key, key ) != 0){
+    i = (i + 1) & (dc->size - 1);
+  }
+  return &dc->table[i];
+}
+
+static void growKeys( DedupCtx *dc ){
+  free( dc->table );
+  dc->size *= 2;
+  dc->table = calloc( dc->size, sizeof(unsigned long) );
+  assert(dc->table);
+  for (unsigned long e = 0; e < dc->nentries; e++){
+    if (dc->entries[e].key != NULL) *findKey( dc, dc->entries[e].key ) = e + 1;
+  }
+}
+
+/*********************************************
+rec's data for tag (and sub) without the spaces around it
+Post: Returns where it starts, with its length in *len, or NULL if rec has none
+*********************************************/
+static const char *trimmedData( const XmElem *rec, int tag, char sub, int *len ){
+  const char *data = mxGetData( rec, tag, 1, sub, 1 );
+  if (data == NULL) return NULL;
+  while (isspace( (unsigned char)*data )) data++;
+  *len = strlen( data );
+  while (*len > 0 && isspace( (unsigned char)data[*len - 1] )) (*len)--;
+  return (*len > 0 ? data : NULL);
+}
+
+/*********************************************
+rec's control number, prefixed with which it is: its 001 with the agency of
+its 003, its 001 alone if it has no 003, or else its 010$a
+Post: Returns a new string, or NULL if rec has neither 001 nor 010$a
+*********************************************/
+static char *recordKey( const XmElem *rec ){
+  int len, agencyLen;
+  const char *id = trimmedData( rec, 1, ' ', &len );
+  const char *agency = trimmedData( rec, 3, ' ', &agencyLen );
+  char *key = NULL;
+  int n;
+  if (id != NULL && agency != NULL){
+    //the agency's length keeps "AB" + "C" apart from "A" + "BC"
+    n = asprintf( &key, "3:%d:%.*s%.*s", agencyLen, agencyLen, agency, len, id );
+  }else if (id != NULL){
+    n = asprintf( &key, "1:%.*s", len, id );
+  }else if ( (id = trimmedData( rec, 10, 'a', &len )) != NULL ){
+    n = asprintf( &key, "10:%.*s", len, id );
+  }else{
+    return NULL;
+  }
+  if (n == -1) key = NULL;
+  assert(key);
+  return key;
+}
+
+/*********************************************
+MxRecordFunc for -dedup, spools rec if it is the first with its key or newer
+than the one kept so far
+Pre: ctx is a DedupCtx
+Post: Returns 0 to go on, or 1 to stop if the spool could not be written
+*********************************************/
+static int dedupRecord( XmElem *rec, void *ctx ){
+  DedupCtx *dc = ctx;
+  dc->nrecs++;
+  const char *stamp = mxGetData( rec, 5, 1, ' ', 1 );
+  char *key = recordKey( rec );
+  
+  DedupEntry *e = NULL;
+  unsigned long *slot = (key != NULL ? findKey( dc, key ) : NULL);
+  if (slot != NULL && *slot != 0){
+    e = &dc->entries[*slot - 1];
+    e->copies++;
+    free( key );
+    //an older (or undated) record loses to the one kept
+    if ( stamp == NULL || (e->stamp != NULL && strcmp( stamp, e->stamp ) <= 0) ){
+      return 0;
+    }
+    free( e->stamp );
+  }else{
+    if (dc->nentries == dc->cap){
+      dc->cap = (dc->cap == 0 ? 1024 : 2 * dc->cap);
+      dc->entries = realloc( dc->entries, dc->cap * sizeof(DedupEntry) );
+      assert(dc->entries);
+    }
+    e = &dc->entries[dc->nentries++];
+    e->key = key;
+    e->copies = 1;
+    if (slot != NULL){
+      *slot = dc->nentries;
+      if (++dc->nkeys * 2 > dc->size) growKeys( dc );
+    }
+  }
+  e->stamp = (stamp != NULL ? customCopy( stamp ) : NULL);
+  
+  size_t len;
+  mxWriterClear( dc->scratch );
+  putRecords( dc->scratch, rec );
+  const char *data = mxWriterData( dc->scratch, &len );
+  e->offset = dc->spoolLen;
+  e->len = len;
+  dc->spoolLen += len;
+  return ( fwrite( data, 1, len, dc->spool ) != len );
+}
+
+/*********************************************
+-dedup [FILE...] (or -cat -dedup FILE...), the records of stdin and then of
+the files, with their duplicates dropped. How many there were is reported on
+stderr.
+Pre: argv[2] on are the files
+Post: outfile has the records, nothing is written if an input could not be
+read. Return EXIT_FAILURE for any problem
+*********************************************/
+static int dedupFiles( int args, char *argv[], FILE *outfile ){
+  DedupCtx dc;
+  memset( &dc, 0, sizeof(dc) );
+  dc.size = 1024;
+  dc.table = calloc( dc.size, sizeof(unsigned long) );
+  assert(dc.table);
+  dc.scratch = mxWriterMem();
+  dc.spool = newRun();
+  
+  int ok = (dc.spool != NULL);
+  for (int i = 1; i < args && ok; i++){
+    FILE *fp = (i == 1 ? stdin : fopen( argv[i], "r" ));
+    if (fp == NULL){
+      fprintf(stderr, "\nError, could not open file \"%s\"\n", argv[i]);
+      ok = 0;
+      break;
+    }
+    ok = ( streamXmElems( fp, dedupRecord, &dc ) == 0 && ferror( dc.spool ) == 0 );
+    if (fp != stdin) fclose( fp );
+  }
+  if (ok && endRun( dc.spool ) != 0) ok = 0;
+  
+  unsigned long dupKeys = 0;
+  if (ok){
+    MxWriter *w = mxWriterNew( outfile );
+    putHeader( w );
+    char buf[1 << 16];
+    for (unsigned long e = 0; e < dc.nentries && ok; e++){
+      DedupEntry *entry = &dc.entries[e];
+      dupKeys += (entry->copies > 1);
+      ok = ( fseeko( dc.spool, entry->offset, SEEK_SET ) == 0 );
+      for (size_t left = entry->len; left > 0 && ok; ){
+        size_t n = fread( buf, 1, (left < sizeof(buf) ? left : sizeof(buf)), dc.spool );
+        ok = (n > 0);
+        mxPutBytes( w, buf, n );
+        left -= n;
+      }
+    }
+    if (!ok) fprintf(stderr, "\nError, could not read back the records kept\n");
+    putFooter( w );
+    if ( mxWriterFree( w ) != 0 ) ok = 0;
+  }
+  if (ok){
+    fprintf(stderr, "%lu records, %lu duplicates of %lu control numbers dropped\n",
+            dc.nrecs, dc.nrecs - dc.nentries, dupKeys);
+  }
+  
+  for (unsigned long e = 0; e < dc.nentries; e++){
+    free( dc.entries[e].key );
+    free( dc.entries[e].stamp );
+  }
+  free( dc.entries );
+  free( dc.table );
+  mxWriterFree( dc.scratch );
+  if (dc.spool != NULL) fclose( dc.spool );
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+//server threads for -serve when -threads is not given
+#define SERVE_THREADS 4
+
+/*********************************************
+The collections -serve holds, each known by its file name as given on the
+command line
+*********************************************/
+typedef struct Served Served;
+struct Served {
+  int ncolls;
+  char **names;
+  XmElem **trees;
+};
+
+/*********************************************
+Parse a request's number argument
+Post: returns 1 with *n set, else 0
+*********************************************/
+static int requestNumber( const char *arg, unsigned long *n ){
+  char *end = NULL;
+  *n = (arg[0] >= '0' && arg[0] <= '9' ? strtoul( arg, &end, 10 ) : 0);
+  return (end != NULL && *end == '\0');
+}
+
+/*********************************************
+MxServeFunc for -serve, the requests being
+  keep NAME COND...  and  discard NAME COND...  as -keep and -discard
+  lib NAME [OFFSET [LIMIT]]  and  bib NAME [OFFSET [LIMIT]]  as -lib and -bib
+  get NAME N...  records N... (numbered from 1) as a collection
+for the collection named NAME
+Pre: ctx is the Served collections
+Post: Returns 0 with the output written to out, else 1 with what was wrong
+*********************************************/
+static int serveRequest( int nargs, char *args[], FILE *out, void *ctx ){
+  const Served *sv = ctx;
+  const char *cmd = args[0];
+  if (nargs < 2){
+    fprintf( out, "\"%s\" needs the name of a collection\n", cmd );
+    return 1;
+  }
+  const XmElem *top = NULL;
+  for (int i = 0; i < sv->ncolls && top == NULL; i++){
+    if ( strcmp( sv->names[i], args[1] ) == 0 ) top = sv->trees[i];
+  }
+  if (top == NULL){
+    fprintf( out, "no collection \"%s\" is served\n", args[1] );
+    return 1;
+  }
+  
+  if ( strcmp( cmd, "keep" ) == 0 || strcmp( cmd, "discard" ) == 0 ){
+    if ( selectTree( top, (cmd[0] == 'k' ? KEEP : DISCARD), nargs - 2, args + 2, out ) != EXIT_SUCCESS ){
+      fprintf( out, "invalid match pattern\n" );
+      return 1;
+    }
+    return 0;
+  }else if ( strcmp( cmd, "lib" ) == 0 || strcmp( cmd, "bib" ) == 0 ){
+    unsigned long offset = 0;
+    unsigned long limit = ULONG_MAX;
+    if ( nargs > 4 || (nargs > 2 && !requestNumber( args[2], &offset )) ||
+         (nargs > 3 && !requestNumber( args[3], &limit )) ){
+      fprintf( out, "\"%s\" takes a line offset and limit\n", cmd );
+      return 1;
+    }
+    if ( formatTree( top, (cmd[0] == 'l' ? CALLNUM : AUTHOR), offset, limit, out ) != EXIT_SUCCESS ){
+      fprintf( out, "could not sort the lines\n" );
+      return 1;
+    }
+    return 0;
+  }else if ( strcmp( cmd, "get" ) == 0 ){
+    for (int i = 2; i < nargs; i++){
+      unsigned long n;
+      if ( !requestNumber( args[i], &n ) || n < 1 || n > top->nsubs ){
+        fprintf( out, "no record \"%s\" in \"%s\"\n", args[i], args[1] );
+        return 1;
+      }
+    }
+    MxWriter *w = mxWriterNew( out );
+    putHeader( w );
+    for (int i = 2; i < nargs; i++){
+      putRecords( w, (*top->subelem)[strtoul( args[i], NULL, 10 ) - 1] );
+    }
+    putFooter( w );
+    return ( mxWriterFree( w ) != 0 );
+  }
+  fprintf( out, "unknown request \"%s\", should be keep, discard, lib, bib or get\n", cmd );
+  return 1;
+}
+
+/*********************************************
+-serve SOCKET FILE..., reads the collections in FILE... once, then answers
+requests for them on the socket until stopped
+Post: Return EXIT_FAILURE if a collection could not be read or the socket
+could not be set up
+*********************************************/
+static int serveFiles( int args, char *argv[] ){
+  if (args < 4){
+    fprintf(stderr, "\nError, -serve needs a socket path and the collections to serve\n");
+    return EXIT_FAILURE;
+  }
+  Served sv = { args - 3, argv + 3, calloc( args - 3, sizeof(XmElem *) ) };
+  assert(sv.trees);
+  
+  int ok = 1;
+  for (int i = 0; i < sv.ncolls && ok; i++){
+    FILE *fp = fopen( sv.names[i], "r" );
+    sv.trees[i] = openXmElemTree( fp );
+    if (fp != NULL) fclose( fp );
+    if (sv.trees[i] != NULL && sv.trees[i]->nameid != MX_COLLECTION){
+      fprintf(stderr, "\nError, \"%s\" is not a collection\n", sv.names[i]);
+    }
+    ok = ( sv.trees[i] != NULL && sv.trees[i]->nameid == MX_COLLECTION );
+  }
+  
+  //clients are served on as many threads as -threads gave, each answering a
+  //request on its own rather than handing records to more threads
+  int nthreads = (mxGetOption( MX_THREADS ) > 1 ? mxGetOption( MX_THREADS ) : SERVE_THREADS);
+  mxSetOption( MX_THREADS, 0 );
+  if (ok){
+    ok = ( mxServe( argv[2], nthreads, serveRequest, &sv ) == 0 );
+  }
+  
+  for (int i = 0; i < sv.ncolls; i++){
+    if (sv.trees[i] != NULL) mxCleanElem( sv.trees[i] );
+  }
+  free( sv.trees );
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
 int main(int args, char *argv[]){
   
+  //each tree (or streamed record) is freed in one go rather than node by node
+  mxSetOption( MX_ARENA, 1 );
+  
+  if ( globalOptions(&args, argv) == 0 ){
+    return EXIT_FAILURE;
+  }
+  
   int option = checkArgs(args, argv);
   int returnVal = 0;
   switch (option){
     case 1:{ //-review
-        XmElem *top = openXmElemTree( stdin );
-        if (top == NULL){
-          return EXIT_FAILURE;
-        }
-        returnVal = review(top, stdout);
-        mxCleanElem (top);
-      break;
-    }
-    case 2:{ //-cat
-      returnVal = combineFiles(args, argv, stdout);
+      returnVal = streamReview(stdin, stdout);
       break;
     }
-    case 3:{ //-keep 
-      XmElem *top = openXmElemTree( stdin );
-      if (top == NULL){
-        return EXIT_FAILURE;
+    case 2:{ //-cat, or -cat -dedup as -dedup
+      if (args > 2 && strcmp(argv[2], "-dedup") == 0){
+        argv[2] = argv[1];
+        returnVal = dedupFiles(args - 1, argv + 1, stdout);
+      }else{
+        returnVal = combineFiles(args, argv, stdout);
       }
-      returnVal = selects(top, KEEP, argv[2], stdout);
-      mxCleanElem(top);
       break;
     }
+    case 3: //-keep, and whatever is chained after it
     case 4:{ //-discard
-      XmElem *top = openXmElemTree( stdin );
-      if (top == NULL){
-        return EXIT_FAILURE;
-      }
-      returnVal = selects(top, DISCARD, argv[2], stdout);
-      mxCleanElem(top);
+      returnVal = streamSelects(stdin, args - 1, &argv[1], stdout);
       break;
     }
     case 5:{ //-lib
-      XmElem *top = openXmElemTree( stdin );
-      if (top == NULL){
-        return EXIT_FAILURE;
+      if (cachePath != NULL){
+        returnVal = cachedFormat(stdin, CALLNUM, stdout);
+      }else{
+        returnVal = streamFormat(stdin, CALLNUM, stdout);
       }
-      returnVal = libFormat(top, stdout);
-      mxCleanElem(top);
       break;
     }
     case 6:{ //-bib
+      if (cachePath != NULL){
+        returnVal = cachedFormat(stdin, AUTHOR, stdout);
+      }else{
+        returnVal = streamFormat(stdin, AUTHOR, stdout);
+      }
+      break;
+    }
+    case 7:{ //-snapshot
       XmElem *top = openXmElemTree( stdin );
       if (top == NULL){
         return EXIT_FAILURE;
       }
-      returnVal = bibFormat(top, stdout);
+      returnVal = (mxWriteSnapshot(top, stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
       mxCleanElem(top);
       break;
     }
+    case 8:{ //-index
+      returnVal = indexRecords(stdin, stdout);
+      break;
+    }
+    case 9:{ //-serve
+      returnVal = serveFiles(args, argv);
+      break;
+    }
+    case 10:{ //-dedup
+      returnVal = dedupFiles(args, argv, stdout);
+      break;
+    }
     default://invalid command 
       return EXIT_FAILURE;
   }
@@ -38,4 +38,18 @@ void marc2bib( const XmElem *mrec, BibData bdata );
 
 void sortRecs( XmElem *collection, const char *keys[] );
 
+
+/* compiled -keep/-discard conditions
+
+   Each arg is a condition [!]<field>[i][e]=<regex>, where i makes the regex
+   case-insensitive and e makes it an extended regex. Conditions are and-ed,
+   "-or" starts a new alternative and "-not" (or a leading '!') negates the
+   next condition. Regexes are compiled once, by compileQuery, which returns
+   NULL (after printing why) if the conditions are invalid. */
+
+typedef struct MxQuery MxQuery;
+MxQuery *compileQuery( int nargs, char *args[] );
+int matchQuery( const MxQuery *query, BibData bdata );
+void freeQuery( MxQuery *query );
+
 #endif
\ No newline at end of file
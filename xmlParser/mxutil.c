@@ -12,10 +12,49 @@ as discussed here: http://moodle.socs.uoguelph.ca/mod/forum/discuss.php?d=4412 *
 #define _POSIX_SOURCE 1
 
 #include "mxutil.h"
+#include "mxtext.h"
+#include <libxml/parserInternals.h>
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+
+//index key for a subfield code, kept apart from the (non-negative) tag numbers
+#define CODEKEY(c) ( -1 - (int)(unsigned char)(c) )
+//first bytes of a snapshot file, see mxWriteSnapshot
+#define SNAP_MAGIC "MXSNAP2"
+//bytes mxInputFormat looks at, enough for a snapshot's header
+#define SNAP_PEEK 128
+
+static XmElem *makeElem( xmlDocPtr doc, xmlNodePtr node, MxArena *arena );
+static int readFileChunked( int fd, xmlSchemaPtr sp, XmElem **top );
+typedef struct MxRenderTo MxRenderTo;
+static int readStreamChunked( int fd, xmlSchemaPtr sp, MxRecordFunc recFunc, void *ctx, const MxRenderTo *to );
+static int validDoc( xmlDocPtr doc, xmlSchemaPtr sp );
+static int validRoot( xmlSchemaValidCtxtPtr vsp, xmlNodePtr root, int *nil );
+typedef struct MxCheck MxCheck;
+static int checkRoot( MxCheck *vc, xmlNodePtr root, int *nil );
+static int checkFailed( xmlNodePtr node, const char *why, const char *what );
+static int checkRecord( MxCheck *vc, xmlNodePtr rec );
+static MxCheck *newCheck( void );
+static void freeCheck( MxCheck *vc );
+static void countRecords( const XmElem *top );
+typedef struct MxSnapHeader MxSnapHeader;
+static int isSnapshot( const unsigned char *peek, size_t len, uint64_t size );
+static XmElem *snapRecord( const MxSnapshot *snap, unsigned long n, MxArena *arena );
+
+//library options, indexed by enum MXOPTION
+static int mxOptions[MX_NOPTIONS];
 
 xmlSchemaPtr mxInit( const char *xsdfile ){
   
@@ -58,31 +97,109 @@ void mxTerm( xmlSchemaPtr sp ){
   xmlCleanupParser ();
 }
 
-int mxReadFile( FILE *marcxmlfp, xmlSchemaPtr sp, XmElem **top ){
+/****************************************************
+A regular file mapped read-only in one piece, which libxml2 and the chunk
+splitter read in place
+****************************************************/
+typedef struct MxMapping MxMapping;
+struct MxMapping {
+  void *addr;           // the mapping, NULL if there is none
+  size_t size;          // size of the file
+  const char *data;     // the input: the file from fd's offset on
+  size_t len;
+  size_t released;      // bytes at the start of the mapping given back
+};
+
+/****************************************************
+Map fd's file if it is a regular file with 1 to maxLen bytes left to read.
+Post: returns 1 with m set, else 0 and fd is to be read as usual
+****************************************************/
+static int mapInput( int fd, size_t maxLen, MxMapping *m ){
+  struct stat st;
+  m->addr = NULL;
+  off_t offset = lseek( fd, 0, SEEK_CUR );
+  if ( offset < 0 || fstat( fd, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+       st.st_size <= offset || (size_t)(st.st_size - offset) > maxLen ){
+    return 0;
+  }
+  
+  void *addr = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+  if (addr == MAP_FAILED) return 0;
+  posix_madvise( addr, st.st_size, POSIX_MADV_SEQUENTIAL );
+  
+  m->addr = addr;
+  m->size = st.st_size;
+  m->data = (char *)addr + offset;
+  m->len = st.st_size - offset;
+  m->released = 0;
+  return 1;
+}
+
+//consumed input is given back a megabyte or more at a time
+#define RELEASE_STEP (1 << 20)
+
+/****************************************************
+Let the kernel drop the mapped pages before data + upTo, which have been read.
+They are clean file pages, touching them again just reads them back in.
+****************************************************/
+static void releaseInput( MxMapping *m, size_t upTo ){
+  size_t pageSize = sysconf( _SC_PAGESIZE );
+  size_t end = ((m->data - (char *)m->addr) + upTo) & ~(pageSize - 1);
+  if (end < m->released + RELEASE_STEP) return;
   
-  /*Recommend func: parse an XML file from a file descriptor and build a tree 
-  **Note file descriptor will not be closed by function. Returns
-  resulting document tree or NULL if failure*/
-  xmlDocPtr xmlTree = xmlReadFd(fileno(marcxmlfp),"",NULL,0);
+  madvise( (char *)m->addr + m->released, end - m->released, MADV_DONTNEED );
+  m->released = end;
+}
+
+/****************************************************
+unmap m, leaving fd at the end of the file as reading it would have
+****************************************************/
+static void unmapInput( int fd, MxMapping *m ){
+  mxCount( MX_COUNT_READ, m->len );
+  munmap( m->addr, m->size );
+  lseek( fd, m->size, SEEK_SET );
+  m->addr = NULL;
+}
+
+/****************************************************
+read(2), retried when interrupted, counting what was read for MX_STATS
+****************************************************/
+static ssize_t readInput( int fd, void *buf, size_t len ){
+  ssize_t n;
+  do{
+    n = read( fd, buf, len );
+  }while (n < 0 && errno == EINTR);
+  if (n > 0) mxCount( MX_COUNT_READ, n );
+  return n;
+}
+
+//xmlInputReadCallback reading the file descriptor ctx points to
+static int fdRead( void *ctx, char *buffer, int len ){
+  return readInput( *(int *)ctx, buffer, len );
+}
+
+/****************************************************
+The serial end of mxReadFile: validate xmlTree (see validDoc) and convert it.
+Post: xmlTree has been freed (it can be NULL, which is a parse error)
+****************************************************/
+static int readTree( xmlDocPtr xmlTree, xmlSchemaPtr sp, XmElem **top ){
   if (xmlTree == NULL){
     return 1;//failed to parse xml file
   }
   
-  /*Recommended func: create an xml schemas validation context based on the 
-  given schema, return NULL if error or validation context */
-  xmlSchemaValidCtxtPtr validSchemaPtr = xmlSchemaNewValidCtxt (sp);
-  int isvalid = xmlSchemaValidateDoc ( validSchemaPtr, xmlTree );
-  
-  if (validSchemaPtr == NULL || isvalid != 0){
-  	if (xmlTree != NULL) xmlFreeDoc (xmlTree);
+  MxStamp start = mxPhaseStart();
+  int valid = validDoc( xmlTree, sp );
+  mxPhaseEnd( MX_PHASE_VALIDATE, start );
+  if ( !valid ){
+    xmlFreeDoc (xmlTree);
     return 2; //xml did not match schema
   }
-  /*Recommended Func: free the resources associated to the ValidSchemaPtr
-  No return*/
-  if (validSchemaPtr != NULL) xmlSchemaFreeValidCtxt (validSchemaPtr);
   
   //make the xmElem struct version of the DOM
+  start = mxPhaseStart();
   *top = mxMakeElem(xmlTree, xmlDocGetRootElement (xmlTree));
+  mxPhaseEnd( MX_PHASE_BUILD, start );
+  countRecords( *top );
   
   /*hint function 4 - free up all the structures used by a document, tree included
   Return: VOID*/
@@ -92,27 +209,659 @@ int mxReadFile( FILE *marcxmlfp, xmlSchemaPtr sp, XmElem **top ){
   return 0;
 }
 
+int mxReadFile( FILE *marcxmlfp, xmlSchemaPtr sp, XmElem **top ){
+  
+  if ( mxOptions[MX_THREADS] > 1 && (sp != NULL || mxOptions[MX_VALIDATION] != MX_VALIDATE_XSD) ){
+    return readFileChunked( fileno(marcxmlfp), sp, top );
+  }
+  
+  //a regular file is parsed in place from a mapping, without reading it in
+  MxMapping map;
+  xmlDocPtr xmlTree;
+  MxStamp start = mxPhaseStart();
+  if ( mapInput( fileno(marcxmlfp), INT_MAX, &map ) ){
+    xmlTree = xmlReadMemory( map.data, map.len, "", NULL, XML_PARSE_COMPACT | XML_PARSE_BIG_LINES );
+    unmapInput( fileno(marcxmlfp), &map );//the tree has its own copy
+  }else{
+    /*same as xmlReadFd (the file descriptor is not closed), reading through
+    fdRead so the input can be counted*/
+    int fd = fileno(marcxmlfp);
+    xmlTree = xmlReadIO( fdRead, NULL, &fd, "", NULL, XML_PARSE_COMPACT | XML_PARSE_BIG_LINES );
+  }
+  mxPhaseEnd( MX_PHASE_PARSE, start );
+  return readTree( xmlTree, sp, top );
+}
+
+//xmlTextReaderRead, timed as parsing
+static int readerRead( xmlTextReaderPtr reader ){
+  MxStamp start = mxPhaseStart();
+  int ret = xmlTextReaderRead( reader );
+  mxPhaseEnd( MX_PHASE_PARSE, start );
+  return ret;
+}
+
+/****************************************************
+The serial end of mxReadStream, walking reader (which can be NULL, a parse
+error) until the end or recFunc stops it. If the reader reads from map, the
+input is released as it is consumed. With recFunc NULL the input is only
+validated, no elements are built.
+Post: reader has been freed
+****************************************************/
+static int readStreamReader( xmlTextReaderPtr reader, MxMapping *map, xmlSchemaPtr sp, MxRecordFunc recFunc, void *ctx ){
+  if (reader == NULL){
+    return 1;//failed to create reader
+  }
+
+  /*each record is validated against the schema once it has been read, apart
+  from the parsing, and the root from its start tag*/
+  if (mxOptions[MX_VALIDATION] != MX_VALIDATE_XSD) sp = NULL;
+  xmlSchemaValidCtxtPtr vsp = NULL;
+  if ( sp != NULL && (vsp = xmlSchemaNewValidCtxt( sp )) == NULL ){
+    xmlFreeTextReader( reader );
+    return 2;
+  }
+
+  //with MX_ARENA every record is built in the same arena, reset between records
+  MxArena *arena = (mxOptions[MX_ARENA] ? mxArenaNew() : NULL);
+  //the root is checked (or validated) from its start tag, then each record
+  int builtin = (mxOptions[MX_VALIDATION] == MX_VALIDATE_BUILTIN);
+  int checked = (builtin || vsp != NULL);
+  MxCheck *vc = NULL;
+  int rootNil = 0;
+  if (builtin){
+    vc = newCheck();
+  }
+  XmElem *rec = NULL;
+  int inRecord = 0;
+  int status = 0;
+  int stop = 0;
+  int ret = 1;
+  while ( status == 0 && stop == 0 && (ret = readerRead( reader )) == 1 ){
+
+    //records are the root's children, or the root itself
+    int depth = xmlTextReaderDepth( reader );
+    if ( depth > 1 ) continue;
+
+    int type = xmlTextReaderNodeType( reader );
+    int isRecord = ( type == XML_READER_TYPE_ELEMENT &&
+                     strcmp( (char *)xmlTextReaderConstLocalName( reader ), "record" ) == 0 );
+    //a record as the root has been checked whole
+    if ( isRecord && depth == 0 ) rootNil = -1;
+    if ( checked && rootNil >= 0 && type == XML_READER_TYPE_ELEMENT && !isRecord ){
+      xmlNodePtr node = xmlTextReaderCurrentNode( reader );
+      if ( node == NULL ){
+        status = 1;
+      }else if ( depth > 0 || rootNil > 0 ){
+        status = 2 + checkFailed( node, "expected a record", NULL );
+      }else{
+        MxStamp start = mxPhaseStart();
+        int valid = (builtin ? checkRoot( vc, node, &rootNil ) : validRoot( vsp, node, &rootNil ));
+        mxPhaseEnd( MX_PHASE_VALIDATE, start );
+        if (!valid) status = 2;
+      }
+      continue;
+    }
+    if ( checked && rootNil >= 0 && depth == 1 && (type == XML_READER_TYPE_TEXT || type == XML_READER_TYPE_CDATA) ){
+      fprintf( stderr, "line %d: the collection holds text\n", xmlTextReaderGetParserLineNumber( reader ) );
+      status = 2;
+      continue;
+    }
+    if ( isRecord ){
+
+      /*pull the rest of the record into the reader's tree so it can be copied,
+      the record is handed over on its end tag once the walk has validated it
+      (expanding is also quicker than reading the record node by node)*/
+      {
+        MxStamp start = mxPhaseStart();
+        xmlNodePtr node = xmlTextReaderExpand( reader );
+        mxPhaseEnd( MX_PHASE_PARSE, start );
+        if (node == NULL){
+          status = 1;
+          break;
+        }
+        if ( checked ){
+          start = mxPhaseStart();
+          int valid = ( rootNil <= 0 && (builtin ? checkRecord( vc, node ) :
+                                         xmlSchemaValidateOneElement( vsp, node ) == 0) );
+          mxPhaseEnd( MX_PHASE_VALIDATE, start );
+          if ( !valid ){
+            status = 2;
+            break;
+          }
+        }
+        if (recFunc != NULL){
+          start = mxPhaseStart();
+          rec = makeElem( node->doc, node, arena );
+          mxPhaseEnd( MX_PHASE_BUILD, start );
+        }
+      }
+      inRecord = 1;
+      if ( xmlTextReaderIsEmptyElement( reader ) == 0 ) continue;
+    }else if ( type != XML_READER_TYPE_END_ELEMENT || inRecord == 0 ){
+      continue;
+    }
+
+    if (recFunc != NULL){
+      mxCount( MX_COUNT_RECORDS, 1 );
+      stop = ( recFunc( rec, ctx ) != 0 );
+    }
+    if (arena != NULL){
+      mxArenaReset( arena );
+    }else if (rec != NULL){
+      mxCleanElem( rec );
+    }
+    rec = NULL;
+    inRecord = 0;
+    if (map != NULL) releaseInput( map, xmlTextReaderByteConsumed( reader ) );
+  }
+
+  if (arena != NULL){
+    mxArenaFree( arena );
+  }else if (rec != NULL){
+    mxCleanElem( rec );
+  }
+  if (vc != NULL){
+    freeCheck( vc );
+    free( vc );
+  }
+  if (vsp != NULL) xmlSchemaFreeValidCtxt( vsp );
+  if (status == 0 && stop == 0 && ret != 0){
+    status = 1;//xml was malformed
+  }
+
+  xmlFreeTextReader( reader );
+  return status;
+}
+
+int mxReadStream( FILE *marcxmlfp, xmlSchemaPtr sp, MxRecordFunc recFunc, void *ctx ){
+
+  if ( mxOptions[MX_THREADS] > 1 ){
+    return readStreamChunked( fileno(marcxmlfp), sp, recFunc, ctx, NULL );
+  }
+
+  MxMapping map;
+  if ( mapInput( fileno(marcxmlfp), INT_MAX, &map ) ){
+    int status = readStreamReader( xmlReaderForMemory( map.data, map.len, "", NULL, XML_PARSE_BIG_LINES ),
+                                   &map, sp, recFunc, ctx );
+    unmapInput( fileno(marcxmlfp), &map );
+    return status;
+  }
+
+  /*same as xmlReadFd, but the reader only keeps the nodes around the current
+  read position, earlier siblings are freed as it moves past them*/
+  int fd = fileno(marcxmlfp);
+  return readStreamReader( xmlReaderForIO( fdRead, NULL, &fd, "", NULL, XML_PARSE_BIG_LINES ), NULL, sp, recFunc, ctx );
+}
+
+/****************************************************
+Blocks an MxArena hands out memory from, the data follows the header
+****************************************************/
+typedef struct MxArenaBlock MxArenaBlock;
+struct MxArenaBlock {
+  MxArenaBlock *prev;   // block filled before this one (NULL for the first)
+  size_t size;          // usable bytes after the header
+};
+
+struct MxArena {
+  MxArenaBlock *blocks; // newest block, others chained through prev
+  char *next;           // next free byte in the newest block
+  size_t left;          // bytes free after next
+  const XmElem *owner;  // element freed along with the arena by mxCleanElem
+  MxArena *attached;    // arenas freed along with this one, see attachArena
+  MxArena *sibling;     // next arena attached to the same one
+  void *mapped;         // snapshot unmapped along with the arena, or NULL
+  size_t mappedSize;
+};
+
+//arena blocks are at least this big, larger requests get a block of their own
+#define ARENA_BLOCK_SIZE 65536
+//every allocation is rounded to a multiple of this to keep pointers aligned
+#define ARENA_ALIGN sizeof(void *)
+
+MxArena *mxArenaNew( void ){
+  MxArena *arena = malloc( sizeof(MxArena) );
+  assert(arena);
+  arena->blocks = NULL;
+  arena->next = NULL;
+  arena->left = 0;
+  arena->owner = NULL;
+  arena->attached = NULL;
+  arena->sibling = NULL;
+  arena->mapped = NULL;
+  arena->mappedSize = 0;
+  return arena;
+}
+
+/****************************************************
+make child part of arena: it is released by mxArenaReset/mxArenaFree on arena,
+so a tree can take in elements built in other arenas (by other threads)
+****************************************************/
+static void attachArena( MxArena *arena, MxArena *child ){
+  child->sibling = arena->attached;
+  arena->attached = child;
+}
+
+/****************************************************
+free the arenas attached to arena
+****************************************************/
+static void freeAttached( MxArena *arena ){
+  while (arena->attached != NULL){
+    MxArena *next = arena->attached->sibling;
+    mxArenaFree( arena->attached );
+    arena->attached = next;
+  }
+}
+
+void *mxArenaAlloc( MxArena *arena, size_t size ){
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  
+  if (size > arena->left){
+    size_t blockSize = (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+    MxArenaBlock *block = malloc( sizeof(MxArenaBlock) + blockSize );
+    assert(block);
+    mxCount( MX_COUNT_ALLOCS, 1 );
+    block->prev = arena->blocks;
+    block->size = blockSize;
+    arena->blocks = block;
+    arena->next = (char *)(block + 1);
+    arena->left = blockSize;
+  }
+  
+  void *mem = arena->next;
+  arena->next += size;
+  arena->left -= size;
+  return mem;
+}
+
+char *mxArenaCopy( MxArena *arena, const char *str ){
+  size_t n = strlen(str) + 1;
+  return memcpy( mxArenaAlloc( arena, n ), str, n );
+}
+
+void mxArenaReset( MxArena *arena ){
+  freeAttached( arena );
+  if (arena->blocks == NULL) return;
+  
+  //keep only the first block, it is enough for most records
+  while (arena->blocks->prev != NULL){
+    MxArenaBlock *prev = arena->blocks->prev;
+    free( arena->blocks );
+    arena->blocks = prev;
+  }
+  arena->next = (char *)(arena->blocks + 1);
+  arena->left = arena->blocks->size;
+  arena->owner = NULL;
+}
+
+void mxArenaFree( MxArena *arena ){
+  freeAttached( arena );
+  while (arena->blocks != NULL){
+    MxArenaBlock *prev = arena->blocks->prev;
+    free( arena->blocks );
+    arena->blocks = prev;
+  }
+  if (arena->mapped != NULL) munmap( arena->mapped, arena->mappedSize );
+  free( arena );
+}
+
+static void startStats( void );
+
+int mxSetOption( enum MXOPTION opt, int value ){
+  int old = mxOptions[opt];
+  mxOptions[opt] = value;
+  if (opt == MX_STATS && value != 0 && old == 0) startStats();
+  return old;
+}
+
+int mxGetOption( enum MXOPTION opt ){
+  return mxOptions[opt];
+}
+
+/****************************************************
+Statistics (MX_STATS): the nanoseconds and calls of each phase and the
+counters, added to atomically as MX_THREADS workers time their own phases
+****************************************************/
+static const char *phaseNames[MX_NPHASES] = {
+  "parse", "validate", "build", "extract", "match", "sort", "write"
+};
+static const char *counterNames[MX_NCOUNTERS] = {
+  "records", "elements", "bytes_read", "bytes_written", "allocations", "lookups"
+};
+static unsigned long long phaseTime[MX_NPHASES];
+static unsigned long long phaseCalls[MX_NPHASES];
+static unsigned long long counters[MX_NCOUNTERS];
+static MxStamp statsStart;
+
+static MxStamp clockNow( void ){
+  struct timespec ts;
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return (MxStamp)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/****************************************************
+libxml2's allocator once MX_STATS has been set, counting what it hands out
+****************************************************/
+static void *countedMalloc( size_t size ){
+  __atomic_add_fetch( &counters[MX_COUNT_ALLOCS], 1, __ATOMIC_RELAXED );
+  return malloc( size );
+}
+
+static void *countedRealloc( void *mem, size_t size ){
+  __atomic_add_fetch( &counters[MX_COUNT_ALLOCS], 1, __ATOMIC_RELAXED );
+  return realloc( mem, size );
+}
+
+static char *countedStrdup( const char *str ){
+  __atomic_add_fetch( &counters[MX_COUNT_ALLOCS], 1, __ATOMIC_RELAXED );
+  return customCopy( str );
+}
+
+static void startStats( void ){
+  statsStart = clockNow();
+  xmlMemSetup( free, countedMalloc, countedRealloc, countedStrdup );
+}
+
+MxStamp mxPhaseStart( void ){
+  return (mxOptions[MX_STATS] ? clockNow() : 0);
+}
+
+void mxPhaseEnd( enum MXPHASE phase, MxStamp start ){
+  if (mxOptions[MX_STATS] == 0 || start == 0) return;
+  __atomic_add_fetch( &phaseTime[phase], clockNow() - start, __ATOMIC_RELAXED );
+  __atomic_add_fetch( &phaseCalls[phase], 1, __ATOMIC_RELAXED );
+}
+
+void mxCount( enum MXCOUNTER counter, long long n ){
+  if (mxOptions[MX_STATS] == 0) return;
+  __atomic_add_fetch( &counters[counter], n, __ATOMIC_RELAXED );
+}
+
+void mxPrintStats( FILE *fp, int json ){
+  double wall = (statsStart != 0 ? (clockNow() - statsStart) / 1e9 : 0.0);
+  unsigned long long count[MX_NCOUNTERS];
+  for (int i = 0; i < MX_NCOUNTERS; i++){
+    count[i] = __atomic_load_n( &counters[i], __ATOMIC_RELAXED );
+  }
+  //what went out through MxWriters, on top of what callers wrote themselves
+  count[MX_COUNT_WRITTEN] += mxWriterTotal();
+  
+  if (json){
+    fprintf( fp, "{\"wall_seconds\":%.6f,\"phases\":{", wall );
+    for (int i = 0; i < MX_NPHASES; i++){
+      fprintf( fp, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%llu}", (i > 0 ? "," : ""),
+               phaseNames[i], phaseTime[i] / 1e9, phaseCalls[i] );
+    }
+    fprintf( fp, "}" );
+    for (int i = 0; i < MX_NCOUNTERS; i++){
+      fprintf( fp, ",\"%s\":%llu", counterNames[i], count[i] );
+    }
+    fprintf( fp, "}\n" );
+    return;
+  }
+  
+  fprintf( fp, "%-14s %12.6fs\n", "wall clock", wall );
+  for (int i = 0; i < MX_NPHASES; i++){
+    fprintf( fp, "%-14s %12.6fs %12llu calls\n", phaseNames[i], phaseTime[i] / 1e9, phaseCalls[i] );
+  }
+  for (int i = 0; i < MX_NCOUNTERS; i++){
+    fprintf( fp, "%-14s %13llu\n", counterNames[i], count[i] );
+  }
+}
+
+/****************************************************
+add the records of a tree that has been read: a collection's children, or
+the record itself
+****************************************************/
+static void countRecords( const XmElem *top ){
+  if (mxOptions[MX_STATS] == 0) return;
+  mxCount( MX_COUNT_RECORDS, (top->nameid == MX_COLLECTION ? (long long)top->nsubs : 1) );
+}
+
+/****************************************************
+Name interning. Ids below MX_NNAMES are the MARCXML names, in enum MXNAME
+order, anything else is appended as it is first seen. The hash table holds
+id + 1 so that 0 marks an empty slot.
+****************************************************/
+static const char *knownNames[MX_NNAMES] = {
+  "collection", "record", "leader", "controlfield", "datafield", "subfield",
+  "tag", "code", "ind1", "ind2", "id", "type"
+};
+static const char **names = NULL;    // id -> name
+static int nnames = 0;
+static int namesCap = 0;
+static int *nameHash = NULL;         // open addressing, id + 1 or 0
+static unsigned nameHashSize = 0;    // power of 2, kept at least twice nnames
+static pthread_mutex_t namesLock = PTHREAD_MUTEX_INITIALIZER;
+
+/****************************************************
+FNV-1a hash of a name
+****************************************************/
+static unsigned hashName( const char *name ){
+  unsigned h = 2166136261u;
+  for ( ; *name != '\0'; name++ ){
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  }
+  return h;
+}
+
+/****************************************************
+add a name to the table and give it the next id
+****************************************************/
+static int addName( const char *name ){
+  if (nnames == namesCap){
+    namesCap = (namesCap == 0 ? 64 : namesCap * 2);
+    names = realloc( names, namesCap * sizeof(char *) );
+    assert(names);
+  }
+  
+  //grow the hash table, rehashing what is there
+  if ( (unsigned)(nnames + 1) * 2 > nameHashSize ){
+    unsigned newSize = (nameHashSize == 0 ? 128 : nameHashSize * 2);
+    int *newHash = calloc( newSize, sizeof(int) );
+    assert(newHash);
+    for (int id = 0; id < nnames; id++){
+      unsigned h = hashName( names[id] ) & (newSize - 1);
+      while (newHash[h] != 0) h = (h + 1) & (newSize - 1);
+      newHash[h] = id + 1;
+    }
+    free( nameHash );
+    nameHash = newHash;
+    nameHashSize = newSize;
+  }
+  
+  names[nnames] = (nnames < MX_NNAMES ? name : customCopy( name ));
+  assert(names[nnames]);
+  unsigned h = hashName( name ) & (nameHashSize - 1);
+  while (nameHash[h] != 0) h = (h + 1) & (nameHashSize - 1);
+  nameHash[h] = nnames + 1;
+  return nnames++;
+}
+
+/****************************************************
+load the MARCXML names so they get the ids in enum MXNAME
+****************************************************/
+static void initNames( void ){
+  for (int id = 0; id < MX_NNAMES; id++) addName( knownNames[id] );
+}
+
+/****************************************************
+the id of one of the MARCXML names, or -1. These never change, so they are
+looked up without the lock
+****************************************************/
+static int knownName( const char *name ){
+  for (int id = 0; id < MX_NNAMES; id++){
+    if ( name[0] == knownNames[id][0] && strcmp( name, knownNames[id] ) == 0 ) return id;
+  }
+  return -1;
+}
+
+int mxIntern( const char *name ){
+  int id = knownName( name );
+  if (id >= 0) return id;
+  
+  //other names go through the table, which parallel readers share
+  pthread_mutex_lock( &namesLock );
+  if (nnames == 0) initNames();
+  
+  unsigned h = hashName( name ) & (nameHashSize - 1);
+  while (nameHash[h] != 0){
+    if ( strcmp( names[nameHash[h] - 1], name ) == 0 ) break;
+    h = (h + 1) & (nameHashSize - 1);
+  }
+  id = (nameHash[h] != 0 ? nameHash[h] - 1 : addName( name ));
+  pthread_mutex_unlock( &namesLock );
+  return id;
+}
+
+const char *mxName( int id ){
+  if (id >= 0 && id < MX_NNAMES) return knownNames[id];
+  
+  pthread_mutex_lock( &namesLock );
+  const char *name = (id >= 0 && id < nnames ? names[id] : NULL);
+  pthread_mutex_unlock( &namesLock );
+  return name;
+}
+
+/****************************************************
+allocate memory for part of an element, from arena if the tree is built in one
+****************************************************/
+static void *elemAlloc( MxArena *arena, size_t size ){
+  if (arena == NULL && mxOptions[MX_STATS]) mxCount( MX_COUNT_ALLOCS, 1 );
+  void *mem = (arena != NULL ? mxArenaAlloc( arena, size ) : malloc( size ));
+  assert(mem);
+  return mem;
+}
+
+/****************************************************
+The key an element is indexed under by its parent: its tag number, or its
+subfield code (stored negative so the two can never collide).
+Pre: elem is a valid element
+Post: returns 1 and sets *key if elem has a tag or code attribute, else 0
+****************************************************/
+static int elemKey( const XmElem *elem, int *key ){
+  if (elem->tagnum >= 0){
+    *key = elem->tagnum;
+    return 1;
+  }else if (elem->code != '\0'){
+    *key = CODEKEY( elem->code );
+    return 1;
+  }
+  return 0;
+}
+
+/****************************************************
+qsort compare helper for mxIndexElem, orders by key then by position so
+repeated tags/codes keep their document order
+****************************************************/
+static int compareEntries( const void *a, const void *b ){
+  const MxIndexEntry *ea = a;
+  const MxIndexEntry *eb = b;
+  if (ea->key != eb->key) return (ea->key < eb->key ? -1 : 1);
+  return (ea->pos < eb->pos ? -1 : (ea->pos > eb->pos));
+}
+
+/****************************************************
+mxIndexElem, taking the index from arena if it is not NULL
+****************************************************/
+static void indexElem( XmElem *elem, MxArena *arena ){
+  elem->nindex = 0;
+  elem->index = NULL;
+  if (elem->nsubs == 0) return;
+
+  MxIndexEntry *index = elemAlloc( arena, elem->nsubs * sizeof(MxIndexEntry) );
+  for ( unsigned long i = 0; i < elem->nsubs; i++ ){
+    if ( elemKey( (*elem->subelem)[i], &index[elem->nindex].key ) ){
+      index[elem->nindex].pos = i;
+      elem->nindex++;
+    }
+  }
+
+  if (elem->nindex == 0){
+    if (arena == NULL) free(index);
+    return;
+  }
+  qsort( index, elem->nindex, sizeof(MxIndexEntry), compareEntries );
+  elem->index = index;
+}
+
+void mxIndexElem( XmElem *elem ){
+  indexElem( elem, NULL );
+}
+
+/****************************************************
+copy the text of a node list as xmlNodeListGetString does. With an arena the
+text and cdata nodes are copied straight into it, only lists that contain
+entity references are left to libxml2 and copied afterwards. The nodes are
+libxml2's own decoded copies, not the input bytes, so the text is always copied
+(once) rather than pointed to: only snapshot trees point into their input.
+Post: Returns the text or NULL if there is none, without an arena the caller
+must free it with xmlFree()
+****************************************************/
+static char *nodeListText( xmlDocPtr doc, xmlNodePtr list, MxArena *arena ){
+  
+  //most elements and attributes have a single text node, copied as it is
+  if (list != NULL && list->next == NULL && list->type == XML_TEXT_NODE){
+    if (arena != NULL) return mxArenaCopy( arena, (char *)list->content );
+    return (char *)xmlStrdup( list->content );
+  }
+  if (arena == NULL) return (char *)xmlNodeListGetString( doc, list, 1 );
+  
+  size_t len = 0;
+  int found = 0;
+  for ( xmlNodePtr n = list; n != NULL; n = n->next ){
+    if (n->type == XML_TEXT_NODE || n->type == XML_CDATA_SECTION_NODE){
+      len += strlen( (char *)n->content );
+      found = 1;
+    }else if (n->type == XML_ENTITY_REF_NODE){
+      found = -1;
+      break;
+    }
+  }
+  
+  if (found == 0) return NULL;
+  if (found < 0){
+    char *tmp = (char *)xmlNodeListGetString( doc, list, 1 );
+    if (tmp == NULL) return NULL;
+    char *text = mxArenaCopy( arena, tmp );
+    xmlFree( tmp );
+    return text;
+  }
+  
+  char *text = mxArenaAlloc( arena, len + 1 );
+  char *end = text;
+  for ( xmlNodePtr n = list; n != NULL; n = n->next ){
+    if (n->type == XML_TEXT_NODE || n->type == XML_CDATA_SECTION_NODE){
+      size_t n_len = strlen( (char *)n->content );
+      memcpy( end, n->content, n_len );
+      end += n_len;
+    }
+  }
+  *end = '\0';
+  return text;
+}
+
+/****************************************************
+1 if text is only white space (or empty), else 0
+****************************************************/
+static int textIsBlank( const char *text ){
+  //most text is not, which its first character shows
+  unsigned char c = text[0];
+  if ( c != '\0' && isspace( c ) == 0 ) return 0;
+  return mxTextBlank( text, strlen( text ) );
+}
+
 /****************************************************
 scrape out text stored in subordinate text node. elem isBlank flag = 1 if 
 text is only white space
 *****************************************************/
-static void addElemText( xmlDocPtr doc, xmlNodePtr node, XmElem *elem){
+static void addElemText( xmlDocPtr doc, xmlNodePtr node, XmElem *elem, MxArena *arena){
   
   /*Recommended func: Returns:  a pointer to the string copy,
   the caller must free it with xmlFree(). */
-  elem->text = (char *)xmlNodeListGetString ( doc, node->children,1);
-  
-  int i = 0;
-  if (elem->text != NULL) i = strlen( elem->text );
-  elem->isBlank = 1; //assume text is blank unless otherwise proven
+  elem->text = nodeListText( doc, node->children, arena );
   
-  if (i > 0){ 
-    for (int g = 0; g < i; g++){
-      if ( isspace( elem->text[g] ) == 0 ){ //if it is not whitespace
-		elem->isBlank = 0; //set isBlank to 0, meaning text is not whitespace
-      }
-    }
-  }
+  //text is blank unless a non white space character proves otherwise
+  elem->isBlank = (elem->text == NULL || textIsBlank( elem->text ));
 }
 
 /****************************************************
@@ -150,42 +899,59 @@ char *customCopy(const char *str){
 }
 
 /****************************************************
-loop through each attribute and add it's value and content to new element
+loop through each attribute and add it's value and content to new element.
+Names are interned, and the tag/code attributes are also decoded into the
+element so lookups never have to parse them again
 ****************************************************/
-static void addAttribs( xmlNodePtr node, XmElem *newElem ){
+static void addAttribs( xmlNodePtr node, XmElem *newElem, MxArena *arena ){
 	
+	newElem->tagnum = -1;
+	newElem->code = '\0';
 	xmlAttrPtr a = node->properties;
 	for (int i = 0; i < newElem->nattribs; i++){
-		(*newElem->attrib)[i][0] = customCopy( (char *)a->name );
-        assert( (*newElem->attrib)[i][0] );
-		(*newElem->attrib)[i][1] = (char*)xmlGetProp(node, a->name ); //needs to be freed with xmlFree
+		int nameid = mxIntern( (char *)a->name );
+		(*newElem->attrib)[i][0] = (char *)mxName( nameid );
+		//the value comes from the attribute itself, not a lookup by name
+		(*newElem->attrib)[i][1] = nodeListText( node->doc, a->children, arena );
+		if ( (*newElem->attrib)[i][1] == NULL ){
+			(*newElem->attrib)[i][1] = (arena != NULL ? mxArenaCopy( arena, "" ) : (char *)xmlStrdup( (xmlChar *)"" ));
+		}
+		
+		if (nameid == MX_TAG){
+			newElem->tagnum = atoi( (*newElem->attrib)[i][1] );
+		}else if (nameid == MX_CODE){
+			newElem->code = *(*newElem->attrib)[i][1];
+		}
 		a = a->next;
 	}
 }
 
-XmElem *mxMakeElem( xmlDocPtr doc, xmlNodePtr node ){
+/****************************************************
+mxMakeElem, building the tree in arena if it is not NULL
+****************************************************/
+static XmElem *makeElem( xmlDocPtr doc, xmlNodePtr node, MxArena *arena ){
 	
 	//check for comment node, note this only happens at the begining 
 	while ( node->type == XML_COMMENT_NODE ){
 		node = node->next;
 	}
 	
-	XmElem *newElem = malloc(sizeof(XmElem));
-  	assert(newElem);
+	if (mxOptions[MX_STATS]) mxCount( MX_COUNT_ELEMENTS, 1 );
+	XmElem *newElem = elemAlloc( arena, sizeof(XmElem) );
+	newElem->arena = arena;
     
-  	//copy node->name into newElem, memory needs to be freed later on!
-  	newElem->tag = customCopy( (char *)node->name );
-  	assert(newElem->tag);
-  	addElemText( doc, node, newElem );
+  	//tag names are shared through the intern table rather than copied
+  	newElem->nameid = mxIntern( (char *)node->name );
+  	newElem->tag = (char *)mxName( newElem->nameid );
+  	addElemText( doc, node, newElem, arena );
   
   	newElem->nattribs = getNumAttributes( node );
   	if (newElem->nattribs > 0){
-  		newElem->attrib = malloc ( newElem->nattribs * sizeof (char*[2]) );//allocate the attribute array
-        assert(newElem->attrib);
+  		newElem->attrib = elemAlloc( arena, newElem->nattribs * sizeof (char*[2]) );//allocate the attribute array
   	}else{
   		newElem->attrib = NULL;
   	}
-  	addAttribs( node, newElem ); 
+  	addAttribs( node, newElem, arena ); 
 	
   	//Get Number of SubElements
   	newElem->nsubs = xmlChildElementCount (node);
@@ -194,271 +960,2918 @@ XmElem *mxMakeElem( xmlDocPtr doc, xmlNodePtr node ){
   if (newElem->nsubs > 0){
     
     	//allocate space for an array of child elements
-    	newElem->subelem = malloc( newElem->nsubs * sizeof(XmElem *));
-        assert(newElem->subelem);
+    	newElem->subelem = elemAlloc( arena, newElem->nsubs * sizeof(XmElem *));
     
     	for (int i = 0; i < newElem->nsubs; i++){
-      		(*newElem->subelem)[i] = mxMakeElem( doc, e );
+      		(*newElem->subelem)[i] = makeElem( doc, e, arena );
       		e = xmlNextElementSibling (e);
     	}
+	}else{
+		newElem->subelem = NULL;
 	}
+	
+	//index the children by tag/code so lookups don't rescan the record
+	indexElem( newElem, arena );
 	return newElem;
 }
 
+XmElem *mxMakeElem( xmlDocPtr doc, xmlNodePtr node ){
+	
+	if ( mxOptions[MX_ARENA] == 0 ){
+		return makeElem( doc, node, NULL );
+	}
+	
+	//the whole tree comes from one arena, freed along with the returned element
+	MxArena *arena = mxArenaNew();
+	XmElem *top = makeElem( doc, node, arena );
+	arena->owner = top;
+	return top;
+}
+
 /****************************************************
-Personal note: go through and recursively free each element in turn. Remember!
-subelements are just stored in an array fashion.
+Built-in MARC21slim validation (MX_VALIDATE_BUILTIN): the constraints of
+MARC21slim.xsd checked directly on the parsed nodes, a record at a time,
+rather than by libxml2's generic schema validator. \d in the schema's
+patterns is taken to mean the ASCII digits.
 ****************************************************/
-void mxCleanElem( XmElem *top ){
-    
-  if (top->nsubs > 0){
-    for (int i = 0; i < top->nsubs; ++i){
-      mxCleanElem( (*top->subelem)[i] ); //recursive call to each sub child element
-    }
-    if ( (top->subelem) != NULL) free( top->subelem );//free array of structure pointers
-  }
 
-  if ( (top->tag) != NULL ) free (top->tag);
-  if ( (top->text) != NULL ) xmlFree(top->text);
-  
-  //free attributes, loop through each attribute and free it's value and content fields
- for (int i = 0; i < top->nattribs; i++){
-    if (((*top->attrib)[i][0])!=NULL)free( (*top->attrib)[i][0] );
-    if (((*top->attrib)[i][1]) !=NULL)xmlFree( (*top->attrib)[i][1] ); 
- }
- if ( (top->attrib)!=NULL) free( top->attrib );
-  if ( top !=NULL ) free (top); //free actual structure
+#define MARC_NS "http://www.loc.gov/MARC21/slim"
+#define XSI_NS "http://www.w3.org/2001/XMLSchema-instance"
+#define NAMEBIT(id) (1u << (id))
+
+/****************************************************
+attributes (as NAMEBITs) each element may and must have, and its content:
+simple elements hold text only, the others elements only
+****************************************************/
+static const struct {
+  unsigned allowed;
+  unsigned required;
+  int simple;
+} elemRules[MX_SUBFIELD + 1] = {
+  [MX_COLLECTION] = { NAMEBIT(MX_ID), 0, 0 },
+  [MX_RECORD] = { NAMEBIT(MX_ID) | NAMEBIT(MX_TYPE), 0, 0 },
+  [MX_LEADER] = { NAMEBIT(MX_ID), 0, 1 },
+  [MX_CONTROLFIELD] = { NAMEBIT(MX_ID) | NAMEBIT(MX_TAG), NAMEBIT(MX_TAG), 1 },
+  [MX_DATAFIELD] = { NAMEBIT(MX_ID) | NAMEBIT(MX_TAG) | NAMEBIT(MX_IND1) | NAMEBIT(MX_IND2),
+                     NAMEBIT(MX_TAG) | NAMEBIT(MX_IND1) | NAMEBIT(MX_IND2), 0 },
+  [MX_SUBFIELD] = { NAMEBIT(MX_ID) | NAMEBIT(MX_CODE), NAMEBIT(MX_CODE), 1 },
+};
+
+/****************************************************
+state kept over a document: xsd:ID values have to be unique in it
+****************************************************/
+struct MxCheck {
+  char **ids;           // open addressing set of the ids seen
+  size_t nids;
+  size_t size;          // slots in ids, a power of 2 (0 before the first id)
+};
+
+static MxCheck *newCheck( void ){
+  MxCheck *vc = calloc( 1, sizeof(MxCheck) );
+  assert(vc);
+  return vc;
+}
+
+static void freeCheck( MxCheck *vc ){
+  for ( size_t i = 0; i < vc->size; i++ ) free( vc->ids[i] );
+  free( vc->ids );
+}
+
+/****************************************************
+report why node is not valid
+Post: returns 0, for the caller to return
+****************************************************/
+static int checkFailed( xmlNodePtr node, const char *why, const char *what ){
+  fprintf( stderr, "line %ld: element %s: %s%s\n", xmlGetLineNo( node ),
+           (char *)node->name, why, (what != NULL ? what : "") );
+  return 0;
+}
+
+static int isXmlSpace( char c ){
+  return (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+}
+
+/****************************************************
+[\d ]{5}[\dA-Za-z ]{1}[\dA-Za-z]{1}[\dA-Za-z ]{3}(2| )(2| )[\d ]{5}[\dA-Za-z ]{3}(4500|    )
+****************************************************/
+static int leaderValid( const char *s ){
+  //a class per position: d digit/space, a alnumeric/space, A alnumeric, 2 '2'/space
+  static const char classes[] = "dddddaAaaa22dddddaaa";
+  if (strlen( s ) != 24) return 0;
+  
+  for (int i = 0; classes[i] != '\0'; i++){
+    unsigned char c = s[i];
+    int ok;
+    switch (classes[i]){
+      case 'd': ok = (isdigit( c ) || c == ' '); break;
+      case 'a': ok = (isalnum( c ) || c == ' '); break;
+      case 'A': ok = isalnum( c ); break;
+      default: ok = (c == '2' || c == ' ');
+    }
+    if (!ok) return 0;
+  }
+  return (strcmp( s + 20, "4500" ) == 0 || strcmp( s + 20, "    " ) == 0);
+}
+
+/****************************************************
+datafield tags: three digits/upper case or three digits/lower case letters,
+not starting with 00. Control field tags: 00[1-9A-Za-z]
+****************************************************/
+static int tagValid( const char *s, int control ){
+  if (strlen( s ) != 3) return 0;
+  if (control) return (s[0] == '0' && s[1] == '0' && isalnum( (unsigned char)s[2] ) && s[2] != '0');
+  if (s[0] == '0' && s[1] == '0') return 0;
+  
+  for (int lower = 0; lower < 2; lower++){
+    int ok = 1;
+    for (int i = 0; i < 3; i++){
+      unsigned char c = s[i];
+      ok = ok && (isdigit( c ) || (lower ? islower( c ) : isupper( c )));
+    }
+    if (ok) return 1;
+  }
+  return 0;
+}
+
+static int indicatorValid( const char *s ){
+  return (strlen( s ) == 1 && (isdigit( (unsigned char)s[0] ) || islower( (unsigned char)s[0] ) || s[0] == ' '));
+}
+
+static int codeValid( const char *s ){
+  return (strlen( s ) == 1 &&
+          (isalnum( (unsigned char)s[0] ) || strchr( "!\"#$%&'()*+,-./:;<=>?{}_^`~[]\\", s[0] ) != NULL));
+}
+
+/****************************************************
+copy of s without the white space around it (xsd's whiteSpace collapse for
+the token types), to be freed by the caller
+****************************************************/
+static char *trimmed( const char *s ){
+  while ( isXmlSpace( *s ) ) s++;
+  size_t n = strlen( s );
+  while ( n > 0 && isXmlSpace( s[n - 1] ) ) n--;
+  
+  char *copy = malloc( n + 1 );
+  assert(copy);
+  memcpy( copy, s, n );
+  copy[n] = '\0';
+  return copy;
+}
+
+static int recordTypeValid( const char *s ){
+  static const char *types[] = { "Bibliographic", "Authority", "Holdings", "Classification", "Community" };
+  char *value = trimmed( s );
+  int ok = 0;
+  for (int i = 0; i < 5 && !ok; i++) ok = (strcmp( value, types[i] ) == 0);
+  free( value );
+  return ok;
+}
+
+/****************************************************
+xsd:ID: an NCName (non ASCII bytes are taken as name characters) not used
+before in the document
+Post: the id is added to vc's set
+****************************************************/
+static int idValid( MxCheck *vc, const char *s ){
+  char *id = trimmed( s );
+  int ok = (id[0] != '\0' && !isdigit( (unsigned char)id[0] ) && id[0] != '-' && id[0] != '.');
+  for ( const char *p = id; *p != '\0' && ok; p++ ){
+    ok = (isalnum( (unsigned char)*p ) || *p == '_' || *p == '-' || *p == '.' || (unsigned char)*p >= 0x80);
+  }
+  if (!ok){
+    free( id );
+    return 0;
+  }
+  
+  if (2 * (vc->nids + 1) > vc->size){
+    size_t newSize = (vc->size == 0 ? 64 : 2 * vc->size);
+    char **newIds = calloc( newSize, sizeof(char *) );
+    assert(newIds);
+    for ( size_t i = 0; i < vc->size; i++ ){
+      if (vc->ids[i] == NULL) continue;
+      size_t h = hashName( vc->ids[i] ) & (newSize - 1);
+      while (newIds[h] != NULL) h = (h + 1) & (newSize - 1);
+      newIds[h] = vc->ids[i];
+    }
+    free( vc->ids );
+    vc->ids = newIds;
+    vc->size = newSize;
+  }
+  
+  size_t h = hashName( id ) & (vc->size - 1);
+  while (vc->ids[h] != NULL){
+    if ( strcmp( vc->ids[h], id ) == 0 ){
+      free( id );
+      return 0;
+    }
+    h = (h + 1) & (vc->size - 1);
+  }
+  vc->ids[h] = id;
+  vc->nids++;
+  return 1;
+}
+
+/****************************************************
+Check node's name, namespace and attributes.
+Post: returns its MXNAME id with *nil set if it has xsi:nil="true", or -1
+after reporting what is wrong
+****************************************************/
+static int checkStart( MxCheck *vc, xmlNodePtr node, int *nil ){
+  *nil = 0;
+  if ( node->ns == NULL || strcmp( (char *)node->ns->href, MARC_NS ) != 0 ){
+    checkFailed( node, "not in the namespace ", MARC_NS );
+    return -1;
+  }
+  int id = knownName( (char *)node->name );
+  if (id < 0 || id > MX_SUBFIELD){
+    checkFailed( node, "not a MARC21slim element", NULL );
+    return -1;
+  }
+  
+  unsigned seen = 0;
+  for ( xmlAttrPtr a = node->properties; a != NULL; a = a->next ){
+    //a value is almost always a single text node, only anything else is copied
+    char *value = NULL;
+    const char *v = "";
+    if ( a->children != NULL && a->children->next == NULL && a->children->type == XML_TEXT_NODE ){
+      v = (char *)a->children->content;
+    }else if ( a->children != NULL ){
+      value = (char *)xmlNodeListGetString( node->doc, a->children, 1 );
+      if (value != NULL) v = value;
+    }
+    int ok = 1;
+    
+    if (a->ns != NULL){
+      //the xsi attributes may go anywhere, and xsi:nil on the nillable elements
+      ok = ( strcmp( (char *)a->ns->href, XSI_NS ) == 0 );
+      if ( ok && strcmp( (char *)a->name, "nil" ) == 0 ){
+        char *flag = trimmed( v );
+        *nil = ( strcmp( flag, "true" ) == 0 || strcmp( flag, "1" ) == 0 );
+        ok = ( (id == MX_COLLECTION || id == MX_RECORD) &&
+               (*nil || strcmp( flag, "false" ) == 0 || strcmp( flag, "0" ) == 0) );
+        free( flag );
+      }
+    }else{
+      int aid = knownName( (char *)a->name );
+      ok = (aid >= 0 && (elemRules[id].allowed & NAMEBIT(aid)) != 0);
+      if (ok){
+        seen |= NAMEBIT(aid);
+        switch (aid){
+          case MX_TAG: ok = tagValid( v, id == MX_CONTROLFIELD ); break;
+          case MX_IND1:
+          case MX_IND2: ok = indicatorValid( v ); break;
+          case MX_CODE: ok = codeValid( v ); break;
+          case MX_TYPE: ok = recordTypeValid( v ); break;
+          case MX_ID: ok = idValid( vc, v ); break;
+        }
+      }
+    }
+    
+    if (value != NULL) xmlFree( value );
+    if (!ok){
+      checkFailed( node, "invalid attribute ", (char *)a->name );
+      return -1;
+    }
+  }
+  
+  if ( (seen & elemRules[id].required) != elemRules[id].required ){
+    checkFailed( node, "missing a required attribute", NULL );
+    return -1;
+  }
+  return id;
+}
+
+/****************************************************
+Check the kind of content node (an element with MXNAME id) has: simple
+elements hold no elements, the others no text but white space, and nil
+elements nothing at all.
+Post: returns 1 if it is right, else 0 after reporting it
+****************************************************/
+static int checkContent( xmlNodePtr node, int id, int nil ){
+  for ( xmlNodePtr n = node->children; n != NULL; n = n->next ){
+    if (n->type == XML_ELEMENT_NODE){
+      if (elemRules[id].simple || nil) return checkFailed( node, "holds element ", (char *)n->name );
+    }else if (n->type == XML_TEXT_NODE || n->type == XML_CDATA_SECTION_NODE){
+      if (elemRules[id].simple && !nil) continue;
+      for ( const char *p = (char *)n->content; *p != '\0'; p++ ){
+        if ( !isXmlSpace( *p ) ) return checkFailed( node, "holds text", NULL );
+      }
+      if (nil && n->content[0] != '\0') return checkFailed( node, "nil but not empty", NULL );
+    }
+  }
+  return 1;
+}
+
+/****************************************************
+Check a record element and everything in it
+Post: returns 1 if it is valid, else 0 after reporting why
+****************************************************/
+static int checkRecord( MxCheck *vc, xmlNodePtr rec ){
+  int nil;
+  int id = checkStart( vc, rec, &nil );
+  if (id < 0) return 0;
+  if (id != MX_RECORD) return checkFailed( rec, "expected a record", NULL );
+  if ( !checkContent( rec, MX_RECORD, nil ) ) return 0;
+  
+  //leader, then control fields, then data fields (or nothing at all)
+  int last = -1;
+  for ( xmlNodePtr field = xmlFirstElementChild( rec ); field != NULL; field = xmlNextElementSibling( field ) ){
+    id = checkStart( vc, field, &nil );
+    if (id < 0) return 0;
+    if ( (last < 0 && id != MX_LEADER) ||
+         (last >= 0 && id != MX_CONTROLFIELD && id != MX_DATAFIELD) || id < last ){
+      return checkFailed( field, "out of place in its record", NULL );
+    }
+    last = id;
+    if ( !checkContent( field, id, nil ) ) return 0;
+    
+    if (id == MX_LEADER){
+      char *text = (char *)xmlNodeListGetString( field->doc, field->children, 1 );
+      int ok = leaderValid( (text != NULL ? text : "") );
+      if (text != NULL) xmlFree( text );
+      if (!ok) return checkFailed( field, "invalid leader", NULL );
+    }else if (id == MX_DATAFIELD){
+      xmlNodePtr sub = xmlFirstElementChild( field );
+      if (sub == NULL) return checkFailed( field, "needs a subfield", NULL );
+      for ( ; sub != NULL; sub = xmlNextElementSibling( sub ) ){
+        id = checkStart( vc, sub, &nil );
+        if (id < 0) return 0;
+        if (id != MX_SUBFIELD) return checkFailed( sub, "expected a subfield", NULL );
+        if ( !checkContent( sub, id, nil ) ) return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+/****************************************************
+Check the root start tag of a streamed document: a collection (or a record,
+which is checked as a whole when it is read).
+Post: returns 1 if it is valid, else 0 after reporting why
+****************************************************/
+static int checkRoot( MxCheck *vc, xmlNodePtr root, int *nil ){
+  if ( knownName( (char *)root->name ) == MX_RECORD ) return 1;
+  
+  int id = checkStart( vc, root, nil );
+  if (id < 0) return 0;
+  if (id != MX_COLLECTION) return checkFailed( root, "expected a collection or record", NULL );
+  return 1;
+}
+
+/****************************************************
+Check a whole document
+Post: returns 1 if it is valid, else 0 after reporting why
+****************************************************/
+static int checkDoc( xmlDocPtr doc ){
+  MxCheck vc = { NULL, 0, 0 };
+  xmlNodePtr root = xmlDocGetRootElement( doc );
+  int nil = 0;
+  int ok = (root != NULL && checkRoot( &vc, root, &nil ));
+  
+  if ( ok && knownName( (char *)root->name ) == MX_RECORD ){
+    ok = checkRecord( &vc, root );
+  }else if (ok){
+    ok = checkContent( root, MX_COLLECTION, nil );
+    for ( xmlNodePtr rec = xmlFirstElementChild( root ); ok && rec != NULL; rec = xmlNextElementSibling( rec ) ){
+      ok = checkRecord( &vc, rec );
+    }
+  }
+  freeCheck( &vc );
+  return ok;
+}
+
+/****************************************************
+Validate the root start tag of a streamed document against vsp's schema: a
+copy of the root without its children, the records are validated apart.
+Post: returns 1 if it is valid, else 0; *nil is set if the root is xsi:nil
+****************************************************/
+static int validRoot( xmlSchemaValidCtxtPtr vsp, xmlNodePtr root, int *nil ){
+  xmlDocPtr doc = xmlNewDoc( (const xmlChar *)"1.0" );
+  assert(doc);
+  doc->URL = xmlStrdup( (const xmlChar *)"" );//reported as the input is
+  xmlDocSetRootElement( doc, xmlDocCopyNode( root, doc, 2 ) );
+  int valid = ( xmlSchemaValidateDoc( vsp, doc ) == 0 );
+  xmlFreeDoc( doc );
+  
+  xmlChar *flag = xmlGetNsProp( root, (const xmlChar *)"nil", (const xmlChar *)XSI_NS );
+  *nil = ( flag != NULL && (xmlStrcmp( flag, (xmlChar *)"true" ) == 0 || xmlStrcmp( flag, (xmlChar *)"1" ) == 0) );
+  if (flag != NULL) xmlFree( flag );
+  return valid;
+}
+
+/****************************************************
+validate doc the way MX_VALIDATION says: against sp, with the built-in
+checks, or not at all
+Post: returns 1 if doc is valid, else 0
+****************************************************/
+static int validDoc( xmlDocPtr doc, xmlSchemaPtr sp ){
+  if (mxOptions[MX_VALIDATION] == MX_VALIDATE_BUILTIN) return checkDoc( doc );
+  if (mxOptions[MX_VALIDATION] == MX_VALIDATE_NONE) return 1;
+  
+  /*Recommended func: create an xml schemas validation context based on the 
+  given schema, return NULL if error or validation context */
+  xmlSchemaValidCtxtPtr validSchemaPtr = xmlSchemaNewValidCtxt (sp);
+  int isvalid = (validSchemaPtr != NULL ? xmlSchemaValidateDoc ( validSchemaPtr, doc ) : -1);
+  
+  /*Recommended Func: free the resources associated to the ValidSchemaPtr
+  No return*/
+  if (validSchemaPtr != NULL) xmlSchemaFreeValidCtxt (validSchemaPtr);
+  return (isvalid == 0);
+}
+
+/****************************************************
+Parallel reading, used when MX_THREADS > 1. The input is cut into chunks of
+whole records at record start tags. Each chunk gets the document's prolog and
+root start tag in front and the root end tag behind, so it is a document of
+its own, and worker threads parse, validate (against the shared schema) and
+convert the chunks while the reading thread cuts the next ones and takes the
+finished ones back in document order. Only a few chunks are in memory at once.
+When rendering (mxRenderStream, mxRenderRecords), the worker that parsed a
+chunk goes on to render its records into a memory writer, which the reading
+thread copies to the output as it takes the chunk back.
+Since chunks are validated apart, an xsd:ID repeated in two chunks is not
+caught. Each chunk is parsed with its lines numbered from where its records
+are in the input, so errors are reported at the lines they have there.
+****************************************************/
+
+//a chunk is cut at the first record start tag past this many bytes
+#define CHUNK_SIZE (1 << 19)
+//the least the read buffer is grown by
+#define READ_SIZE (1 << 16)
+//chunks in flight for each worker
+#define CHUNKS_PER_THREAD 2
+//records in each chunk mxRenderRecords hands out
+#define RENDER_BATCH 256
+
+/****************************************************
+A document's worth of records, cut by the splitter and filled in by a worker
+****************************************************/
+typedef struct MxChunk MxChunk;
+struct MxChunk {
+  char *xml;            // the chunk as a document, freed once it is parsed
+  size_t len;
+  long line;            // the line of the input the document is numbered from
+  int done;             // set by the worker, under the pool's lock
+  int status;           // as mxReadFile: 0, 1 parse error or 2 schema error
+  char *text;           // the root's text within the chunk (can be NULL)
+  unsigned long nrecs;  // no. of root children
+  XmElem **recs;        // the root's children, in document order
+  MxArena *arena;       // text and recs are built in it (NULL without MX_ARENA)
+  int borrowed;         // flag: recs belong to the caller, there is nothing to parse
+  const MxSnapshot *snap; // the snapshot recs are built from, NULL if there is none
+  unsigned long first;  // the number of the snapshot's first record in the chunk
+  MxWriter *out;        // the rendered records (NULL when not rendering)
+  int stopped;          // flag: the render function asked to stop
+};
+
+/****************************************************
+where mxRenderStream and mxRenderRecords send the records
+****************************************************/
+struct MxRenderTo {
+  MxRenderFunc render;
+  void *ctx;
+  MxWriter *out;
+};
+
+/****************************************************
+Cuts the input into chunks. buf holds what has been read and not handed out
+yet, which starts at pos, or for a mapped file, the whole input.
+****************************************************/
+typedef struct MxSplitter MxSplitter;
+struct MxSplitter {
+  int fd;
+  MxMapping map;        // the input when it is a mapped file
+  char *buf;
+  size_t len;           // bytes in buf
+  size_t cap;           // size of buf
+  size_t pos;           // start of the next chunk
+  size_t scan;          // where the search for the next cut resumes
+  int eof;              // fd has been read to the end
+  int last;             // the last chunk has been cut
+  char *head;           // prolog and root start tag, put before every chunk
+  size_t headLen;
+  long headLines;       // no. of newlines in head
+  long line;            // the line of the input pos is on
+  char tail[128];       // root end tag, put after every chunk but the last
+  char rootEnd[128];    // root end tag up to the end of its name
+  char recTag[128];     // record start tag up to the end of its name
+};
+
+/****************************************************
+no. of newlines in the len bytes at text
+****************************************************/
+static long countLines( const char *text, size_t len ){
+  long n = 0;
+  const char *end = text + len;
+  while ( (text = memchr( text, '\n', end - text )) != NULL ){
+    n++;
+    text++;
+  }
+  return n;
+}
+
+/****************************************************
+set up a splitter on fd, a regular file is cut straight from a mapping of it
+****************************************************/
+static void initSplitter( MxSplitter *s, int fd ){
+  memset( s, 0, sizeof(*s) );
+  s->fd = fd;
+  if ( mapInput( fd, SIZE_MAX, &s->map ) ){
+    s->buf = (char *)s->map.data;
+    s->len = s->cap = s->map.len;
+    s->eof = 1;
+  }
+}
+
+static void freeSplitter( MxSplitter *s ){
+  free( s->head );
+  if (s->map.addr != NULL){
+    unmapInput( s->fd, &s->map );
+  }else{
+    free( s->buf );
+  }
+}
+
+/****************************************************
+read more of the input into s->buf
+Post: returns 0 (and sets s->eof) at the end of the input or on a read error
+****************************************************/
+static int fillSplitter( MxSplitter *s ){
+  if (s->eof) return 0;
+  
+  if (s->cap - s->len < READ_SIZE){
+    s->cap = (s->cap == 0 ? 2 * CHUNK_SIZE : 2 * s->cap);
+    s->buf = realloc( s->buf, s->cap );
+    assert(s->buf);
+  }
+  
+  ssize_t n = readInput( s->fd, s->buf + s->len, s->cap - s->len );
+  if (n <= 0){
+    s->eof = 1;
+    return 0;
+  }
+  s->len += n;
+  return 1;
+}
+
+/****************************************************
+position of str in s->buf at or after from, or -1 if it is not there (yet)
+****************************************************/
+static long findInBuf( const MxSplitter *s, size_t from, const char *str ){
+  size_t n = strlen( str );
+  while (from + n <= s->len){
+    char *p = memchr( s->buf + from, str[0], s->len - from - n + 1 );
+    if (p == NULL) break;
+    if ( memcmp( p, str, n ) == 0 ) return p - s->buf;
+    from = p - s->buf + 1;
+  }
+  return -1;
+}
+
+/****************************************************
+Skip a comment, CDATA section or processing instruction, where a record
+start tag would not be one.
+Pre: s->buf[at] is '<'
+Post: returns the position after it, 0 if at is some other markup or -1 if
+more input is needed to tell. Markup left open at the end of the input runs
+to the end, for the parser to report.
+****************************************************/
+static long skipMarkup( const MxSplitter *s, size_t at ){
+  static const char *markup[][2] = {
+    { "<!--", "-->" }, { "<![CDATA[", "]]>" }, { "<?", "?>" }
+  };
+  size_t have = s->len - at;
+  
+  for (int i = 0; i < 3; i++){
+    size_t n = strlen( markup[i][0] );
+    if ( memcmp( s->buf + at, markup[i][0], (have < n ? have : n) ) != 0 ) continue;
+    
+    long end = (have < n ? -1 : findInBuf( s, at + n, markup[i][1] ));
+    if (end < 0) return (s->eof ? (long)s->len : -1);
+    return end + strlen( markup[i][1] );
+  }
+  return 0;
+}
+
+/****************************************************
+does the tag at s->buf[at] start with tag followed by the end of the name?
+Post: returns 1 or 0, or -1 if more input is needed to tell
+****************************************************/
+static int tagAt( const MxSplitter *s, size_t at, const char *tag ){
+  size_t n = strlen( tag );
+  size_t have = s->len - at;
+  if ( memcmp( s->buf + at, tag, (have < n ? have : n) ) != 0 ) return 0;
+  if (have <= n) return (s->eof ? 0 : -1);
+  
+  char c = s->buf[at + n];
+  return (c == '>' || c == '/' || isspace( (unsigned char)c ));
+}
+
+/****************************************************
+Read up to the end of the root start tag.
+Post: returns 1 with the tags set and pos after the root start tag, or 0 if
+the document is not one chunks can be cut from (the root is not a
+collection, or a DOCTYPE could declare entities the chunks would not see);
+pos is left at 0 then so the input can still be read from the start.
+****************************************************/
+static int startSplitter( MxSplitter *s ){
+  if ( s->len == 0 && fillSplitter( s ) == 0 ) return 0;
+  
+  //skip the byte order mark, white space, xml declaration, comments and PIs
+  size_t at = (s->len >= 3 && memcmp( s->buf, "\xEF\xBB\xBF", 3 ) == 0 ? 3 : 0);
+  for (;;){
+    if (at >= s->len || at + 1 == s->len){
+      if ( fillSplitter( s ) == 0 ) return 0;
+      continue;
+    }
+    if ( isspace( (unsigned char)s->buf[at] ) ){
+      at++;
+      continue;
+    }
+    if (s->buf[at] != '<') return 0;
+    
+    long end = skipMarkup( s, at );
+    if (end < 0){
+      fillSplitter( s );
+    }else if (end > 0){
+      at = end;
+    }else if (s->buf[at + 1] == '!'){
+      return 0;//DOCTYPE
+    }else{
+      break;
+    }
+  }
+  
+  //find the end of the root start tag, '>' can be in attribute values
+  size_t end = at + 1;
+  char quote = '\0';
+  for (;;){
+    if (end >= s->len){
+      if ( fillSplitter( s ) == 0 ) return 0;
+      continue;
+    }
+    char c = s->buf[end];
+    if (quote != '\0'){
+      if (c == quote) quote = '\0';
+    }else if (c == '"' || c == '\''){
+      quote = c;
+    }else if (c == '>'){
+      break;
+    }
+    end++;
+  }
+  if (s->buf[end - 1] == '/') return 0;//no records at all
+  
+  const char *name = s->buf + at + 1;
+  int nameLen = 0;
+  while ( name[nameLen] != '>' && name[nameLen] != '/' && !isspace( (unsigned char)name[nameLen] ) ){
+    nameLen++;
+  }
+  const char *colon = memchr( name, ':', nameLen );
+  int prefixLen = (colon != NULL ? colon - name + 1 : 0);
+  if ( nameLen - prefixLen != strlen( "collection" ) ||
+       memcmp( name + prefixLen, "collection", nameLen - prefixLen ) != 0 ||
+       nameLen + 4 > sizeof(s->tail) ){
+    return 0;
+  }
+  
+  sprintf( s->tail, "</%.*s>", nameLen, name );
+  sprintf( s->rootEnd, "</%.*s", nameLen, name );
+  sprintf( s->recTag, "<%.*srecord", prefixLen, name );
+  s->headLen = end + 1;
+  s->head = malloc( s->headLen );
+  assert(s->head);
+  memcpy( s->head, s->buf, s->headLen );
+  s->headLines = countLines( s->head, s->headLen );
+  s->line = 1 + s->headLines;
+  s->pos = s->scan = s->headLen;
+  return 1;
+}
+
+/****************************************************
+cut the next chunk: from pos to the first record start tag at least
+CHUNK_SIZE further on, or for the last chunk, to the end of the input
+Pre: src is an MxSplitter
+Post: returns the chunk, or NULL once the last one has been cut
+****************************************************/
+static MxChunk *nextChunk( void *src ){
+  MxSplitter *s = src;
+  if (s->last) return NULL;
+  
+  //drop what has been handed out already, a mapping is cut where it is
+  if (s->pos > 0 && s->map.addr == NULL){
+    memmove( s->buf, s->buf + s->pos, s->len - s->pos );
+    s->len -= s->pos;
+    s->scan -= s->pos;
+    s->pos = 0;
+  }
+  
+  size_t cut;
+  for (;;){
+    char *p = (s->scan < s->len ? memchr( s->buf + s->scan, '<', s->len - s->scan ) : NULL);
+    if (p == NULL){
+      s->scan = s->len;
+      if ( fillSplitter( s ) ) continue;
+      cut = s->len;//no root end tag, the parser will say so
+      break;
+    }
+    
+    size_t at = p - s->buf;
+    long end = skipMarkup( s, at );
+    int isRec = (end == 0 ? tagAt( s, at, s->recTag ) : 0);
+    int isEnd = (end == 0 && isRec == 0 ? tagAt( s, at, s->rootEnd ) : 0);
+    if (end < 0 || isRec < 0 || isEnd < 0){
+      s->scan = at;
+      fillSplitter( s );
+      continue;
+    }
+    
+    if (isEnd){
+      //the last chunk keeps the real end tag and whatever follows it
+      while ( fillSplitter( s ) );
+      cut = s->len;
+      break;
+    }
+    if (isRec && at - s->pos >= CHUNK_SIZE){
+      cut = at;
+      s->scan = at + 1;
+      break;
+    }
+    s->scan = (end > 0 ? end : at + 1);
+  }
+  if (cut == s->len) s->last = 1;
+  
+  MxChunk *c = calloc( 1, sizeof(MxChunk) );
+  assert(c);
+  size_t tailLen = (s->last ? 0 : strlen( s->tail ));
+  c->len = s->headLen + (cut - s->pos) + tailLen;
+  c->xml = malloc( c->len );
+  assert(c->xml);
+  memcpy( c->xml, s->head, s->headLen );
+  memcpy( c->xml + s->headLen, s->buf + s->pos, cut - s->pos );
+  memcpy( c->xml + c->len - tailLen, s->tail, tailLen );
+  c->line = s->line - s->headLines;
+  s->line += countLines( s->buf + s->pos, cut - s->pos );
+  s->pos = cut;
+  if (s->map.addr != NULL) releaseInput( &s->map, s->pos );
+  return c;
+}
+
+/****************************************************
+xmlInputReadCallback giving what the splitter has read and then the rest of
+its input, for documents that are read the usual way after all
+****************************************************/
+static int splitterRead( void *ctx, char *buffer, int len ){
+  MxSplitter *s = ctx;
+  if (s->pos < s->len){
+    size_t n = s->len - s->pos;
+    if (n > (size_t)len) n = len;
+    memcpy( buffer, s->buf + s->pos, n );
+    s->pos += n;
+    return n;
+  }
+  if (s->eof) return 0;
+  return readInput( s->fd, buffer, len );
+}
+
+/****************************************************
+parse c->xml as xmlReadMemory would, but with its lines numbered from c->line
+Post: returns the document, or NULL if it is not well-formed
+****************************************************/
+static xmlDocPtr readChunk( const MxChunk *c ){
+  xmlParserCtxtPtr ctxt = xmlCreateMemoryParserCtxt( c->xml, c->len );
+  if (ctxt == NULL) return NULL;
+  xmlCtxtUseOptions( ctxt, XML_PARSE_COMPACT | XML_PARSE_BIG_LINES );
+  ctxt->input->filename = (const char *)xmlStrdup( (const xmlChar *)"" );
+  ctxt->input->line = c->line;
+  xmlParseDocument( ctxt );
+  
+  xmlDocPtr doc = ctxt->myDoc;
+  if (!ctxt->wellFormed){
+    xmlFreeDoc( doc );
+    doc = NULL;
+  }
+  xmlFreeParserCtxt( ctxt );
+  return doc;
+}
+
+/****************************************************
+parse, validate and convert a chunk, run by the workers
+****************************************************/
+static void parseChunk( MxChunk *c, xmlSchemaPtr sp ){
+  MxStamp start = mxPhaseStart();
+  xmlDocPtr doc = readChunk( c );
+  mxPhaseEnd( MX_PHASE_PARSE, start );
+  free( c->xml );
+  c->xml = NULL;
+  if (doc == NULL){
+    c->status = 1;
+    return;
+  }
+  
+  //the schema is shared, each chunk gets its own validation context
+  start = mxPhaseStart();
+  int valid = ( (sp == NULL && mxOptions[MX_VALIDATION] == MX_VALIDATE_XSD) || validDoc( doc, sp ) );
+  mxPhaseEnd( MX_PHASE_VALIDATE, start );
+  if ( !valid ){
+    c->status = 2;
+    xmlFreeDoc( doc );
+    return;
+  }
+  
+  start = mxPhaseStart();
+  xmlNodePtr root = xmlDocGetRootElement( doc );
+  c->arena = (mxOptions[MX_ARENA] ? mxArenaNew() : NULL);
+  c->text = nodeListText( doc, root->children, c->arena );
+  c->nrecs = xmlChildElementCount( root );
+  c->recs = malloc( (c->nrecs + 1) * sizeof(XmElem *) );
+  assert(c->recs);
+  
+  xmlNodePtr e = xmlFirstElementChild( root );
+  for ( unsigned long i = 0; i < c->nrecs; i++ ){
+    c->recs[i] = makeElem( doc, e, c->arena );
+    e = xmlNextElementSibling( e );
+  }
+  mxPhaseEnd( MX_PHASE_BUILD, start );
+  mxCount( MX_COUNT_RECORDS, c->nrecs );
+  xmlFreeDoc( doc );
+}
+
+/****************************************************
+build the records of a snapshot's chunk, run by the workers
+****************************************************/
+static void buildChunk( MxChunk *c ){
+  MxStamp start = mxPhaseStart();
+  c->arena = mxArenaNew();
+  c->recs = malloc( c->nrecs * sizeof(XmElem *) );
+  assert(c->recs);
+  for ( unsigned long i = 0; i < c->nrecs; i++ ){
+    c->recs[i] = snapRecord( c->snap, c->first + i, c->arena );
+  }
+  mxPhaseEnd( MX_PHASE_BUILD, start );
+  mxCount( MX_COUNT_RECORDS, c->nrecs );
+}
+
+/****************************************************
+free a chunk and whatever has not been taken out of it
+****************************************************/
+static void freeChunk( MxChunk *c ){
+  free( c->xml );
+  if (c->borrowed){
+    //the records are the caller's
+  }else if (c->arena != NULL){
+    mxArenaFree( c->arena );
+  }else{
+    for ( unsigned long i = 0; i < c->nrecs; i++ ) mxCleanElem( c->recs[i] );
+    if (c->text != NULL) xmlFree( c->text );
+  }
+  if (!c->borrowed) free( c->recs );
+  if (c->out != NULL) mxWriterFree( c->out );
+  free( c );
+}
+
+/****************************************************
+The workers and the chunks in flight, oldest first in a ring
+****************************************************/
+typedef struct MxPool MxPool;
+struct MxPool {
+  pthread_mutex_t lock;
+  pthread_cond_t queued;    // a chunk was queued or the pool is closing
+  pthread_cond_t finished;  // a worker finished a chunk
+  MxChunk **ring;
+  int size;                 // slots in ring
+  int first;                // slot of the oldest chunk
+  int count;                // chunks in flight
+  int claimed;              // how many of those (from the oldest) workers took
+  int closing;
+  int workers;              // workers started, each numbered by the count before it
+  xmlSchemaPtr sp;
+  const MxRenderTo *to;     // what renders the records, NULL to leave them be
+};
+
+/****************************************************
+a worker's part of a chunk: parse it (or build it from a snapshot) unless its
+records were given, and render its records if the pool renders them
+****************************************************/
+static void workChunk( MxChunk *c, const MxPool *pool, int worker ){
+  if (c->snap != NULL){
+    buildChunk( c );
+  }else if (!c->borrowed){
+    parseChunk( c, pool->sp );
+  }
+  if (pool->to == NULL || c->status != 0) return;
+  
+  c->out = mxWriterMem();
+  for ( unsigned long i = 0; i < c->nrecs && !c->stopped; i++ ){
+    if (c->recs[i] != NULL && c->recs[i]->nameid == MX_RECORD){
+      c->stopped = ( pool->to->render( c->recs[i], worker, c->out, pool->to->ctx ) != 0 );
+    }
+  }
+}
+
+/****************************************************
+worker thread: work on chunks in the order they were queued until closing
+****************************************************/
+static void *poolWorker( void *arg ){
+  MxPool *pool = arg;
+  
+  pthread_mutex_lock( &pool->lock );
+  int worker = pool->workers++;
+  for (;;){
+    if (pool->claimed < pool->count){
+      MxChunk *c = pool->ring[(pool->first + pool->claimed) % pool->size];
+      pool->claimed++;
+      pthread_mutex_unlock( &pool->lock );
+      workChunk( c, pool, worker );
+      pthread_mutex_lock( &pool->lock );
+      c->done = 1;
+      pthread_cond_signal( &pool->finished );
+    }else if (pool->closing){
+      break;
+    }else{
+      pthread_cond_wait( &pool->queued, &pool->lock );
+    }
+  }
+  pthread_mutex_unlock( &pool->lock );
+  return NULL;
+}
+
+/****************************************************
+Run the chunks next cuts from src (for a splitter, the input after the root
+start tag) through MX_THREADS workers, rendering their records with to (if it
+is not NULL) and handing each finished chunk to take in document order. take
+returns nonzero to stop.
+Post: returns 0, the status of the first chunk that failed, or -1 if take
+stopped the reading. All chunks have been freed.
+****************************************************/
+static int runChunks( MxChunk *(*next)( void *src ), void *src, xmlSchemaPtr sp, const MxRenderTo *to,
+                      int (*take)( MxChunk *c, void *ctx ), void *ctx ){
+  MxPool pool;
+  pthread_mutex_init( &pool.lock, NULL );
+  pthread_cond_init( &pool.queued, NULL );
+  pthread_cond_init( &pool.finished, NULL );
+  pool.size = mxOptions[MX_THREADS] * CHUNKS_PER_THREAD;
+  pool.ring = malloc( pool.size * sizeof(MxChunk *) );
+  assert(pool.ring);
+  pool.first = pool.count = pool.claimed = pool.closing = pool.workers = 0;
+  pool.sp = sp;
+  pool.to = to;
+  
+  int nthreads = 0;
+  pthread_t *threads = malloc( mxOptions[MX_THREADS] * sizeof(pthread_t) );
+  assert(threads);
+  while ( nthreads < mxOptions[MX_THREADS] &&
+          pthread_create( &threads[nthreads], NULL, poolWorker, &pool ) == 0 ){
+    nthreads++;
+  }
+  
+  int status = 0;
+  int more = 1;
+  for (;;){
+    //keep the workers busy
+    while (status == 0 && more && pool.count < pool.size){
+      MxChunk *c = next( src );
+      if (c == NULL){
+        more = 0;
+        break;
+      }
+      pthread_mutex_lock( &pool.lock );
+      pool.ring[(pool.first + pool.count) % pool.size] = c;
+      pool.count++;
+      pthread_cond_signal( &pool.queued );
+      pthread_mutex_unlock( &pool.lock );
+    }
+    if (pool.count == 0) break;
+    
+    //take back the oldest, doing it here if no thread could be started
+    MxChunk *c = pool.ring[pool.first];
+    if (nthreads == 0){
+      pool.claimed++;
+      workChunk( c, &pool, 0 );
+      c->done = 1;
+    }
+    pthread_mutex_lock( &pool.lock );
+    while (c->done == 0) pthread_cond_wait( &pool.finished, &pool.lock );
+    pool.first = (pool.first + 1) % pool.size;
+    pool.count--;
+    pool.claimed--;
+    pthread_mutex_unlock( &pool.lock );
+    
+    if (status == 0){
+      status = c->status;
+      if ( status == 0 && take( c, ctx ) != 0 ) status = -1;
+    }
+    freeChunk( c );
+  }
+  
+  pthread_mutex_lock( &pool.lock );
+  pool.closing = 1;
+  pthread_cond_broadcast( &pool.queued );
+  pthread_mutex_unlock( &pool.lock );
+  for (int i = 0; i < nthreads; i++) pthread_join( threads[i], NULL );
+  
+  free( threads );
+  free( pool.ring );
+  pthread_cond_destroy( &pool.finished );
+  pthread_cond_destroy( &pool.queued );
+  pthread_mutex_destroy( &pool.lock );
+  return status;
+}
+
+/****************************************************
+what readFileChunked has taken out of the chunks so far
+****************************************************/
+typedef struct {
+  XmElem **recs;
+  unsigned long nrecs;
+  unsigned long cap;
+  char *text;           // the root's text, joined
+  size_t textLen;
+  MxArena *arena;       // the root's arena, chunk arenas are attached to it
+} MxCollected;
+
+/****************************************************
+runChunks take function for readFileChunked, moves the chunk's records,
+text and arena over to the tree being built
+****************************************************/
+static int collectChunk( MxChunk *c, void *ctx ){
+  MxCollected *col = ctx;
+  
+  if (col->nrecs + c->nrecs > col->cap){
+    col->cap = (2 * col->cap > col->nrecs + c->nrecs ? 2 * col->cap : col->nrecs + c->nrecs);
+    col->recs = realloc( col->recs, col->cap * sizeof(XmElem *) );
+    assert(col->recs);
+  }
+  memcpy( col->recs + col->nrecs, c->recs, c->nrecs * sizeof(XmElem *) );
+  col->nrecs += c->nrecs;
+  c->nrecs = 0;
+  
+  if (c->text != NULL){
+    size_t n = strlen( c->text );
+    col->text = realloc( col->text, col->textLen + n + 1 );
+    assert(col->text);
+    memcpy( col->text + col->textLen, c->text, n + 1 );
+    col->textLen += n;
+    if (c->arena == NULL) xmlFree( c->text );
+    c->text = NULL;
+  }
+  
+  if (c->arena != NULL){
+    attachArena( col->arena, c->arena );
+    c->arena = NULL;
+  }
+  return 0;
+}
+
+/****************************************************
+mxReadFile on MX_THREADS threads
+****************************************************/
+static int readFileChunked( int fd, xmlSchemaPtr sp, XmElem **top ){
+  MxSplitter s;
+  initSplitter( &s, fd );
+  
+  int status;
+  if ( startSplitter( &s ) == 0 ){
+    //not a document chunks can be cut from, read it the usual way
+    MxStamp start = mxPhaseStart();
+    xmlDocPtr doc = xmlReadIO( splitterRead, NULL, &s, "", NULL, XML_PARSE_COMPACT | XML_PARSE_BIG_LINES );
+    mxPhaseEnd( MX_PHASE_PARSE, start );
+    status = readTree( doc, sp, top );
+    freeSplitter( &s );
+    return status;
+  }
+  
+  //the root is made from its start tag alone, the records come from the chunks
+  size_t tailLen = strlen( s.tail );
+  char *rootXml = malloc( s.headLen + tailLen );
+  assert(rootXml);
+  memcpy( rootXml, s.head, s.headLen );
+  memcpy( rootXml + s.headLen, s.tail, tailLen );
+  xmlDocPtr doc = xmlReadMemory( rootXml, s.headLen + tailLen, "", NULL, 0 );
+  free( rootXml );
+  if (doc == NULL){
+    freeSplitter( &s );
+    return 1;
+  }
+  
+  MxCollected col;
+  memset( &col, 0, sizeof(col) );
+  col.arena = (mxOptions[MX_ARENA] ? mxArenaNew() : NULL);
+  XmElem *root = makeElem( doc, xmlDocGetRootElement( doc ), col.arena );
+  if (col.arena != NULL) col.arena->owner = root;
+  xmlFreeDoc( doc );
+  
+  status = runChunks( nextChunk, &s, sp, NULL, collectChunk, &col );
+  freeSplitter( &s );
+  
+  if (status == 0){
+    root->nsubs = col.nrecs;
+    if (col.nrecs > 0){
+      root->subelem = elemAlloc( col.arena, col.nrecs * sizeof(XmElem *) );
+      memcpy( root->subelem, col.recs, col.nrecs * sizeof(XmElem *) );
+    }
+    if (col.text != NULL){
+      root->text = (col.arena != NULL ? mxArenaCopy( col.arena, col.text ) :
+                    (char *)xmlStrdup( (xmlChar *)col.text ));
+      root->isBlank = textIsBlank( root->text );
+    }
+    indexElem( root, col.arena );
+    *top = root;
+  }else{
+    if (col.arena == NULL){
+      for ( unsigned long i = 0; i < col.nrecs; i++ ) mxCleanElem( col.recs[i] );
+    }
+    mxCleanElem( root );
+  }
+  free( col.recs );
+  free( col.text );
+  return status;
+}
+
+/****************************************************
+runChunks take function for readStreamChunked, hands the chunk's records to
+the MxRecordFunc in ctx
+****************************************************/
+typedef struct {
+  MxRecordFunc recFunc;
+  void *ctx;
+} MxHandOver;
+
+static int handOverChunk( MxChunk *c, void *ctx ){
+  MxHandOver *to = ctx;
+  for ( unsigned long i = 0; i < c->nrecs; i++ ){
+    if ( c->recs[i]->nameid == MX_RECORD && to->recFunc( c->recs[i], to->ctx ) != 0 ) return 1;
+  }
+  return 0;
+}
+
+/****************************************************
+runChunks take function for rendering, copies what the chunk's records were
+rendered to into the output in ctx
+****************************************************/
+static int emitChunk( MxChunk *c, void *ctx ){
+  const MxRenderTo *to = ctx;
+  size_t len;
+  const char *data = mxWriterData( c->out, &len );
+  mxPutBytes( to->out, data, len );
+  return ( c->stopped || mxWriterError( to->out ) );
+}
+
+/****************************************************
+MxRecordFunc rendering a record straight to the output, for a single thread
+****************************************************/
+static int renderRecord( XmElem *rec, void *ctx ){
+  const MxRenderTo *to = ctx;
+  return ( to->render( rec, 0, to->out, to->ctx ) != 0 || mxWriterError( to->out ) );
+}
+
+/****************************************************
+mxReadStream on MX_THREADS threads, or mxRenderStream if to is not NULL
+(recFunc and ctx then render records one by one, for input that cannot be
+cut into chunks)
+****************************************************/
+static int readStreamChunked( int fd, xmlSchemaPtr sp, MxRecordFunc recFunc, void *ctx, const MxRenderTo *to ){
+  MxSplitter s;
+  initSplitter( &s, fd );
+  
+  int status;
+  if ( startSplitter( &s ) == 0 ){
+    //not a document chunks can be cut from, read it the usual way
+    status = readStreamReader( xmlReaderForIO( splitterRead, NULL, &s, "", NULL, XML_PARSE_BIG_LINES ),
+                               NULL, sp, recFunc, ctx );
+  }else if (to != NULL){
+    status = runChunks( nextChunk, &s, sp, to, emitChunk, (void *)to );
+  }else{
+    MxHandOver handOver = { recFunc, ctx };
+    status = runChunks( nextChunk, &s, sp, NULL, handOverChunk, &handOver );
+  }
+  if (status < 0) status = 0;//stopped by recFunc
+  freeSplitter( &s );
+  return status;
+}
+
+int mxRenderStream( FILE *marcxmlfp, xmlSchemaPtr sp, MxRenderFunc render, void *ctx, MxWriter *out ){
+  MxRenderTo to = { render, ctx, out };
+  if ( mxOptions[MX_THREADS] > 1 ){
+    return readStreamChunked( fileno(marcxmlfp), sp, renderRecord, &to, &to );
+  }
+  return mxReadStream( marcxmlfp, sp, renderRecord, &to );
+}
+
+/****************************************************
+the records mxRenderRecords has not handed out yet
+****************************************************/
+typedef struct {
+  XmElem **recs;
+  unsigned long nrecs;
+  unsigned long pos;
+} MxBatcher;
+
+/****************************************************
+runChunks next function for mxRenderRecords, a chunk of the next RENDER_BATCH
+records, which stay where they are
+****************************************************/
+static MxChunk *nextBatch( void *src ){
+  MxBatcher *b = src;
+  if (b->pos >= b->nrecs) return NULL;
+  
+  MxChunk *c = calloc( 1, sizeof(MxChunk) );
+  assert(c);
+  c->borrowed = 1;
+  c->recs = b->recs + b->pos;
+  c->nrecs = (b->nrecs - b->pos < RENDER_BATCH ? b->nrecs - b->pos : RENDER_BATCH);
+  b->pos += c->nrecs;
+  return c;
+}
+
+void mxRenderRecords( XmElem *recs[], unsigned long nrecs, MxRenderFunc render, void *ctx, MxWriter *out ){
+  MxRenderTo to = { render, ctx, out };
+  if ( mxOptions[MX_THREADS] > 1 && nrecs > RENDER_BATCH ){
+    MxBatcher b = { recs, nrecs, 0 };
+    runChunks( nextBatch, &b, NULL, &to, emitChunk, &to );
+    return;
+  }
+  for ( unsigned long i = 0; i < nrecs; i++ ){
+    if ( recs[i] != NULL && recs[i]->nameid == MX_RECORD && renderRecord( recs[i], &to ) ) break;
+  }
+}
+
+/****************************************************
+Byte level copying (mxCopyRecords, mxValidateFiles, mxScanRecords): records
+are cut out of a mapped file with the splitter's scanning and written as they
+are, so nothing is parsed or built. Input files are validated beforehand, all at
+once on several threads, each read by an xmlTextReader that builds nothing.
+****************************************************/
+
+//namespaces a record can be moved into mxWriteHeader's collection with
+#define MARC_NS "http://www.loc.gov/MARC21/slim"
+#define XSI_NS "http://www.w3.org/2001/XMLSchema-instance"
+
+/****************************************************
+Can the records of s (after startSplitter) be copied into another collection
+as they are? Only if they mean the same there: UTF-8, the marc prefix bound
+to MARC21slim on the root and no namespaces declared but marc and xsi.
+****************************************************/
+static int copyable( const MxSplitter *s ){
+  if ( strcmp( s->recTag, "<marc:record" ) != 0 ) return 0;
+  
+  size_t tailLen = strlen( s->tail );
+  char *rootXml = malloc( s->headLen + tailLen );
+  assert(rootXml);
+  memcpy( rootXml, s->head, s->headLen );
+  memcpy( rootXml + s->headLen, s->tail, tailLen );
+  xmlDocPtr doc = xmlReadMemory( rootXml, s->headLen + tailLen, "", NULL, 0 );
+  free( rootXml );
+  if (doc == NULL) return 0;
+  
+  int ok = ( doc->encoding == NULL || xmlStrcasecmp( doc->encoding, (xmlChar *)"UTF-8" ) == 0 );
+  xmlNodePtr root = xmlDocGetRootElement( doc );
+  for (xmlNsPtr ns = root->nsDef; ns != NULL && ok; ns = ns->next){
+    if ( ns->prefix == NULL ){
+      ok = 0;
+    }else if ( xmlStrcmp( ns->prefix, (xmlChar *)"marc" ) == 0 ){
+      ok = ( xmlStrcmp( ns->href, (xmlChar *)MARC_NS ) == 0 );
+    }else{
+      ok = ( xmlStrcmp( ns->prefix, (xmlChar *)"xsi" ) == 0 &&
+             xmlStrcmp( ns->href, (xmlChar *)XSI_NS ) == 0 );
+    }
+  }
+  ok = ok && root->ns != NULL && xmlStrcmp( root->ns->href, (xmlChar *)MARC_NS ) == 0;
+  xmlFreeDoc( doc );
+  return ok;
+}
+
+/****************************************************
+position just after the tag starting at s->buf[at], '>' can be in attribute
+values
+Post: returns 0 if the tag is not closed
+****************************************************/
+static size_t tagEnd( const MxSplitter *s, size_t at ){
+  char quote = '\0';
+  for (size_t i = at + 1; i < s->len; i++){
+    char c = s->buf[i];
+    if (quote != '\0'){
+      if (c == quote) quote = '\0';
+    }else if (c == '"' || c == '\''){
+      quote = c;
+    }else if (c == '>'){
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/****************************************************
+end of the record whose start tag is at s->buf[at], following any record
+elements nested in it (there can only be any without validation)
+Post: returns the position after its end tag, or 0 if it has none
+****************************************************/
+static size_t recordEnd( const MxSplitter *s, size_t at ){
+  size_t end = tagEnd( s, at );
+  if (end == 0 || s->buf[end - 2] == '/') return end;
+  
+  char recEnd[sizeof(s->recTag) + 1];
+  sprintf( recEnd, "</%s", s->recTag + 1 );
+  int depth = 1;
+  while (depth > 0){
+    char *p = (end < s->len ? memchr( s->buf + end, '<', s->len - end ) : NULL);
+    if (p == NULL) return 0;
+    at = p - s->buf;
+    long skip = skipMarkup( s, at );
+    if (skip > 0){
+      end = skip;
+      continue;
+    }
+    end = tagEnd( s, at );
+    if (end == 0) return 0;
+    if ( tagAt( s, at, recEnd ) ){
+      depth--;
+    }else if ( tagAt( s, at, s->recTag ) && s->buf[end - 2] != '/' ){
+      depth++;
+    }
+  }
+  return end;
+}
+
+int mxCopyRecords( FILE *marcxmlfp, MxWriter *w ){
+  int fd = fileno(marcxmlfp);
+  off_t offset = lseek( fd, 0, SEEK_CUR );
+  MxSplitter s;
+  initSplitter( &s, fd );
+  if ( s.map.addr == NULL || !startSplitter( &s ) || !copyable( &s ) ){
+    //left for reading as usual, from where it was
+    if (s.map.addr != NULL){
+      munmap( s.map.addr, s.map.size );
+      s.map.addr = NULL;
+      s.buf = NULL;
+    }
+    freeSplitter( &s );
+    lseek( fd, offset, SEEK_SET );
+    return 3;
+  }
+  
+  MxStamp start = mxPhaseStart();
+  int status = 1;
+  size_t at = s.pos;
+  for (;;){
+    char *p = (at < s.len ? memchr( s.buf + at, '<', s.len - at ) : NULL);
+    if (p == NULL) break;//no root end tag
+    at = p - s.buf;
+    
+    long skip = skipMarkup( &s, at );
+    if (skip > 0){
+      at = skip;
+    }else if ( tagAt( &s, at, s.recTag ) ){
+      size_t end = recordEnd( &s, at );
+      if (end == 0) break;
+      mxPutIndent( w, 1 );
+      mxPutBytes( w, s.buf + at, end - at );
+      mxPutBytes( w, "\n", 1 );
+      mxCount( MX_COUNT_RECORDS, 1 );
+      releaseInput( &s.map, end );
+      at = end;
+    }else if ( tagAt( &s, at, s.rootEnd ) ){
+      status = 0;
+      break;
+    }else{
+      at++;
+    }
+  }
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  freeSplitter( &s );
+  return (status == 0 && mxWriterError( w ) ? -1 : status);
+}
+
+/****************************************************
+mxScanRecords' place in the input: the records scan wants are cut into
+chunks of their own, each a document with the file's head and tail. The
+records of a chunk are kept on the lines they have in the input by putting
+as many newlines between them as the records left out took, so a chunk ends
+where that would be more than LINE_GAP.
+****************************************************/
+#define LINE_GAP 256
+
+typedef struct {
+  MxSplitter s;
+  MxScanFunc scan;
+  void *ctx;
+  size_t at;            // where the search for the next record resumes
+  size_t lineAt;        // where the input's lines have been counted up to
+  long line;            // the line of the input lineAt is on
+  int status;           // as mxScanRecords, once done
+  int done;             // flag: the root end tag (or the end of the input) was reached
+} MxScanner;
+
+/****************************************************
+runChunks next function for mxScanRecords, the records scan wants from
+sc->at on, until they take CHUNK_SIZE bytes
+Pre: src is an MxScanner
+Post: returns the chunk, or NULL once there are no more records
+****************************************************/
+static MxChunk *nextWanted( void *src ){
+  MxScanner *sc = src;
+  MxSplitter *s = &sc->s;
+  if (sc->done) return NULL;
+  
+  size_t tailLen = strlen( s->tail );
+  size_t cap = s->headLen + tailLen + CHUNK_SIZE;
+  char *xml = malloc( cap );
+  assert(xml);
+  memcpy( xml, s->head, s->headLen );
+  size_t len = s->headLen;
+  long firstLine = 0;   // the line of the input the chunk's first record is on
+  long lastLine = 0;    // and the one its end is on
+  
+  MxStamp start = mxPhaseStart();
+  while (!sc->done && len - s->headLen < CHUNK_SIZE){
+    char *p = (sc->at < s->len ? memchr( s->buf + sc->at, '<', s->len - sc->at ) : NULL);
+    if (p == NULL){
+      sc->done = 1;//no root end tag
+      break;
+    }
+    size_t at = p - s->buf;
+    
+    long skip = skipMarkup( s, at );
+    if (skip > 0){
+      sc->at = skip;
+    }else if ( tagAt( s, at, s->recTag ) ){
+      size_t end = recordEnd( s, at );
+      if (end == 0){
+        sc->done = 1;
+        break;
+      }
+      sc->line += countLines( s->buf + sc->lineAt, at - sc->lineAt );
+      sc->lineAt = at;
+      long gap = sc->line - lastLine;
+      if (len > s->headLen && gap > LINE_GAP) break;//the next chunk starts here
+      
+      int want = sc->scan( s->head, s->headLen, s->buf + at, end - at, sc->ctx );
+      if (want < 0){
+        sc->status = -1;
+        sc->done = 1;
+        break;
+      }
+      if (want){
+        if (len == s->headLen){
+          firstLine = sc->line;
+          gap = 0;
+        }
+        if (len + gap + (end - at) + tailLen > cap){
+          cap = 2 * cap + gap + (end - at);
+          xml = realloc( xml, cap );
+          assert(xml);
+        }
+        memset( xml + len, '\n', gap );
+        memcpy( xml + len + gap, s->buf + at, end - at );
+        len += gap + (end - at);
+      }else{
+        mxCount( MX_COUNT_RECORDS, 1 );
+      }
+      sc->line += countLines( s->buf + at, end - at );
+      sc->lineAt = end;
+      if (want) lastLine = sc->line;
+      releaseInput( &s->map, end );
+      sc->at = end;
+    }else if ( tagAt( s, at, s->rootEnd ) ){
+      sc->status = 0;
+      sc->done = 1;
+    }else{
+      sc->at = at + 1;
+    }
+  }
+  mxPhaseEnd( MX_PHASE_EXTRACT, start );
+  
+  if (len == s->headLen){
+    free( xml );
+    return NULL;
+  }
+  memcpy( xml + len, s->tail, tailLen );
+  MxChunk *c = calloc( 1, sizeof(MxChunk) );
+  assert(c);
+  c->xml = xml;
+  c->len = len + tailLen;
+  c->line = firstLine - s->headLines;
+  return c;
+}
+
+int mxScanRecords( FILE *marcxmlfp, xmlSchemaPtr sp, MxScanFunc scan, MxRecordFunc recFunc, void *ctx ){
+  int fd = fileno(marcxmlfp);
+  off_t offset = lseek( fd, 0, SEEK_CUR );
+  MxScanner sc;
+  initSplitter( &sc.s, fd );
+  if ( sc.s.map.addr == NULL || !startSplitter( &sc.s ) ){
+    //left for reading as usual, from where it was
+    if (sc.s.map.addr != NULL){
+      munmap( sc.s.map.addr, sc.s.map.size );
+      sc.s.map.addr = NULL;
+      sc.s.buf = NULL;
+    }
+    freeSplitter( &sc.s );
+    lseek( fd, offset, SEEK_SET );
+    return 3;
+  }
+  sc.scan = scan;
+  sc.ctx = ctx;
+  sc.at = sc.lineAt = sc.s.pos;
+  sc.line = sc.s.line;
+  sc.status = 1;
+  sc.done = 0;
+  
+  MxHandOver handOver = { recFunc, ctx };
+  int status = 0;
+  if ( mxOptions[MX_THREADS] > 1 ){
+    status = runChunks( nextWanted, &sc, sp, NULL, handOverChunk, &handOver );
+  }else{
+    MxChunk *c;
+    while ( status == 0 && (c = nextWanted( &sc )) != NULL ){
+      parseChunk( c, sp );
+      status = c->status;
+      if ( status == 0 && handOverChunk( c, &handOver ) != 0 ) status = -1;
+      freeChunk( c );
+    }
+  }
+  if (status == 0) status = sc.status;
+  if (status < 0) status = 0;//stopped by scan or recFunc
+  freeSplitter( &sc.s );
+  return status;
+}
+
+/****************************************************
+Files for the mxValidateFiles workers, each takes the next one in turn
+****************************************************/
+typedef struct {
+  FILE **fps;
+  int nfiles;
+  int next;             // the next file to take
+  int *status;
+  xmlSchemaPtr sp;
+  pthread_mutex_t lock;
+} MxFileQueue;
+
+/****************************************************
+validate fd's regular file as mxReadStream would, leaving fd where it was
+Post: returns as mxReadStream, or -1 if fd is not a (mappable) regular file
+****************************************************/
+static int validateFile( int fd, xmlSchemaPtr sp ){
+  off_t offset = lseek( fd, 0, SEEK_CUR );
+  MxMapping map;
+  if ( !mapInput( fd, INT_MAX, &map ) ) return -1;
+  
+  int status = readStreamReader( xmlReaderForMemory( map.data, map.len, "", NULL, XML_PARSE_BIG_LINES ),
+                                 &map, sp, NULL, NULL );
+  munmap( map.addr, map.size );
+  lseek( fd, offset, SEEK_SET );
+  return status;
+}
+
+static void *validateWorker( void *arg ){
+  MxFileQueue *q = arg;
+  for (;;){
+    pthread_mutex_lock( &q->lock );
+    int i = q->next++;
+    pthread_mutex_unlock( &q->lock );
+    if (i >= q->nfiles) break;
+    q->status[i] = validateFile( fileno(q->fps[i]), q->sp );
+  }
+  return NULL;
+}
+
+int mxValidateFiles( FILE *fps[], int nfiles, xmlSchemaPtr sp, int status[] ){
+  MxFileQueue q = { fps, nfiles, 0, status, sp };
+  pthread_mutex_init( &q.lock, NULL );
+  
+  //the calling thread is one of the workers
+  long nthreads = (mxOptions[MX_THREADS] > 1 ? mxOptions[MX_THREADS] : sysconf( _SC_NPROCESSORS_ONLN ));
+  if (nthreads > nfiles) nthreads = nfiles;
+  pthread_t *threads = malloc( (nthreads > 1 ? nthreads : 1) * sizeof(pthread_t) );
+  assert(threads);
+  int started = 0;
+  while ( started < nthreads - 1 &&
+          pthread_create( &threads[started], NULL, validateWorker, &q ) == 0 ){
+    started++;
+  }
+  validateWorker( &q );
+  for (int i = 0; i < started; i++) pthread_join( threads[i], NULL );
+  free( threads );
+  pthread_mutex_destroy( &q.lock );
+  
+  for (int i = 0; i < nfiles; i++){
+    if (status[i] > 0) return status[i];
+  }
+  return 0;
+}
+
+/****************************************************
+ISO 2709 (binary MARC). A record is a 24 byte leader, a directory of 12 byte
+entries (tag, field length, field start) ended by a field terminator, then
+the fields: a control field is just its data, a data field two indicators
+followed by subfields, each a delimiter, a code and the data. Records decode
+into the same XmElem shape mxMakeElem builds from MARCXML. Field data is
+passed through as it is, MARC-8 records are not converted to UTF-8.
+****************************************************/
+
+#define ISO_RT 0x1D             // record terminator
+#define ISO_FT 0x1E             // field terminator
+#define ISO_US 0x1F             // subfield delimiter
+#define ISO_LEADER 24
+#define ISO_ENTRY 12
+#define ISO_MAXRECORD 99999     // largest record length, start or base address
+#define ISO_MAXFIELD 9999       // largest field length
+
+/****************************************************
+Input being read a record at a time, mapped when it is a regular file
+****************************************************/
+typedef struct MxMarcInput MxMarcInput;
+struct MxMarcInput {
+  int fd;
+  MxMapping map;
+  int mapped;           // flag: 1 if data is map.data, else buf
+  const char *data;     // the input read so far
+  char *buf;
+  size_t len;           // bytes in data
+  size_t cap;           // size of buf
+  size_t pos;           // start of the next record in data
+  long nrecs;           // records read, for error messages
+};
+
+static void openMarcInput( MxMarcInput *in, int fd ){
+  memset( in, 0, sizeof(*in) );
+  in->fd = fd;
+  in->mapped = mapInput( fd, SIZE_MAX, &in->map );
+  if (in->mapped){
+    in->data = in->map.data;
+    in->len = in->map.len;
+  }
+}
+
+static void closeMarcInput( MxMarcInput *in ){
+  if (in->mapped) unmapInput( in->fd, &in->map );
+  free( in->buf );
+}
+
+/****************************************************
+Make sure need bytes from pos on are in data, reading more if it is not mapped.
+Post: returns 1 if they are there, else 0 (the input ended first)
+****************************************************/
+static int fillMarcInput( MxMarcInput *in, size_t need ){
+  if (in->len - in->pos >= need) return 1;
+  if (in->mapped) return 0;
+  
+  //move what is left of buf to its start, then read to fill it
+  if (in->pos > 0) memmove( in->buf, in->buf + in->pos, in->len - in->pos );
+  in->len -= in->pos;
+  in->pos = 0;
+  if (in->cap < need || in->cap < READ_SIZE){
+    in->cap = (need > READ_SIZE ? need : READ_SIZE);
+    in->buf = realloc( in->buf, in->cap );
+    assert(in->buf);
+  }
+  in->data = in->buf;
+  
+  while (in->len < need){
+    ssize_t n = readInput( in->fd, in->buf + in->len, in->cap - in->len );
+    if (n <= 0) return 0;
+    in->len += n;
+  }
+  return 1;
+}
+
+/****************************************************
+value of the n digits at s
+Post: returns it, or -1 if they are not all digits
+****************************************************/
+static long isoNumber( const char *s, int n ){
+  long value = 0;
+  for (int i = 0; i < n; i++){
+    if ( !isdigit( (unsigned char)s[i] ) ) return -1;
+    value = value * 10 + (s[i] - '0');
+  }
+  return value;
+}
+
+static int isoFailed( const MxMarcInput *in, const char *why ){
+  fprintf( stderr, "record %ld: %s\n", in->nrecs, why );
+  return -1;
+}
+
+/****************************************************
+Find the next record of in, checking its leader and directory so decoding it
+can not fail.
+Post: returns 1 with *rec and *len set (valid until the next call), 0 at the
+end of the input, or -1 after reporting what is wrong with the record
+****************************************************/
+static int nextMarc( MxMarcInput *in, const char **rec, size_t *len ){
+  if (in->mapped) releaseInput( &in->map, in->pos );
+  
+  //line breaks and the like between records are skipped
+  while ( fillMarcInput( in, 1 ) && strchr( " \t\r\n\x1a", in->data[in->pos] ) != NULL ){
+    in->pos++;
+  }
+  if ( !fillMarcInput( in, 1 ) ) return 0;
+  in->nrecs++;
+  if ( !fillMarcInput( in, ISO_LEADER ) ) return isoFailed( in, "input ends in the leader" );
+  
+  const char *r = in->data + in->pos;
+  long recLen = isoNumber( r, 5 );
+  long base = isoNumber( r + 12, 5 );
+  if (recLen < ISO_LEADER + 2 || base < ISO_LEADER + 1 || base >= recLen){
+    return isoFailed( in, "invalid record length or base address in the leader" );
+  }
+  if ( !fillMarcInput( in, recLen ) ) return isoFailed( in, "input ends in the record" );
+  r = in->data + in->pos;
+  if (r[recLen - 1] != ISO_RT) return isoFailed( in, "no record terminator" );
+  if (r[base - 1] != ISO_FT || (base - 1 - ISO_LEADER) % ISO_ENTRY != 0){
+    return isoFailed( in, "invalid directory" );
+  }
+  
+  for ( const char *e = r + ISO_LEADER; e < r + base - 1; e += ISO_ENTRY ){
+    long fieldLen = isoNumber( e + 3, 4 );
+    long start = isoNumber( e + 7, 5 );
+    if (fieldLen < 0 || start < 0 || base + start + fieldLen > recLen - 1){
+      return isoFailed( in, "directory entry out of the record" );
+    }
+    if ( !(e[0] == '0' && e[1] == '0') && fieldLen < 2 ){
+      return isoFailed( in, "data field without indicators" );
+    }
+  }
+  
+  *rec = r;
+  *len = recLen;
+  in->pos += recLen;
+  return 1;
+}
+
+/****************************************************
+an element with room for nattribs attributes and nsubs subelements, from arena
+if it is not NULL, with no text and nothing indexed
+****************************************************/
+static XmElem *newElem( MxArena *arena, int nameid, int nattribs, unsigned long nsubs ){
+  if (mxOptions[MX_STATS]) mxCount( MX_COUNT_ELEMENTS, 1 );
+  XmElem *elem = elemAlloc( arena, sizeof(XmElem) );
+  elem->arena = arena;
+  elem->nameid = nameid;
+  elem->tag = (char *)mxName( nameid );
+  elem->tagnum = -1;
+  elem->code = '\0';
+  elem->text = NULL;
+  elem->isBlank = 1;
+  elem->nattribs = nattribs;
+  elem->attrib = (nattribs > 0 ? elemAlloc( arena, nattribs * sizeof(char *[2]) ) : NULL);
+  elem->nsubs = nsubs;
+  elem->subelem = (nsubs > 0 ? elemAlloc( arena, nsubs * sizeof(XmElem *) ) : NULL);
+  elem->nindex = 0;
+  elem->index = NULL;
+  return elem;
+}
+
+/****************************************************
+copy of the len bytes at str, from arena or else to be freed with xmlFree()
+****************************************************/
+static char *copyBytes( MxArena *arena, const char *str, size_t len ){
+  if (arena == NULL) return (char *)xmlStrndup( (const xmlChar *)str, len );
+  char *copy = mxArenaAlloc( arena, len + 1 );
+  memcpy( copy, str, len );
+  copy[len] = '\0';
+  return copy;
+}
+
+static void setText( MxArena *arena, XmElem *elem, const char *text, size_t len ){
+  //like an empty element in MARCXML, empty data is no text at all
+  if (len == 0) return;
+  elem->text = copyBytes( arena, text, len );
+  elem->isBlank = textIsBlank( elem->text );
+}
+
+static void setAttrib( MxArena *arena, XmElem *elem, int i, int nameid, const char *value, size_t len ){
+  (*elem->attrib)[i][0] = (char *)mxName( nameid );
+  (*elem->attrib)[i][1] = copyBytes( arena, value, len );
+  if (nameid == MX_TAG){
+    elem->tagnum = atoi( (*elem->attrib)[i][1] );
+  }else if (nameid == MX_CODE){
+    elem->code = *(*elem->attrib)[i][1];
+  }
+}
+
+/****************************************************
+Decode a data field, the len bytes at data (indicators and subfields)
+****************************************************/
+static XmElem *marcDataField( MxArena *arena, const char *tag, const char *data, size_t len ){
+  const char *end = data + len;
+  unsigned long nsubs = 0;
+  for ( const char *p = data + 2; (p = memchr( p, ISO_US, end - p )) != NULL; p++ ) nsubs++;
+  
+  XmElem *field = newElem( arena, MX_DATAFIELD, 3, nsubs );
+  setAttrib( arena, field, 0, MX_TAG, tag, 3 );
+  setAttrib( arena, field, 1, MX_IND1, data, 1 );
+  setAttrib( arena, field, 2, MX_IND2, data + 1, 1 );
+  
+  //anything between the indicators and the first delimiter is dropped
+  const char *p = memchr( data + 2, ISO_US, len - 2 );
+  for (unsigned long i = 0; i < nsubs; i++){
+    const char *next = memchr( p + 1, ISO_US, end - p - 1 );
+    if (next == NULL) next = end;
+    
+    XmElem *sub = newElem( arena, MX_SUBFIELD, 1, 0 );
+    setAttrib( arena, sub, 0, MX_CODE, p + 1, (next - p > 1 ? 1 : 0) );
+    if (next - p > 2) setText( arena, sub, p + 2, next - p - 2 );
+    (*field->subelem)[i] = sub;
+    p = next;
+  }
+  indexElem( field, arena );
+  return field;
+}
+
+/****************************************************
+Decode a record checked by nextMarc into a record element
+****************************************************/
+static XmElem *marcRecord( MxArena *arena, const char *r ){
+  long base = isoNumber( r + 12, 5 );
+  unsigned long nfields = (base - 1 - ISO_LEADER) / ISO_ENTRY;
+  XmElem *rec = newElem( arena, MX_RECORD, 0, nfields + 1 );
+  
+  XmElem *leader = newElem( arena, MX_LEADER, 0, 0 );
+  setText( arena, leader, r, ISO_LEADER );
+  (*rec->subelem)[0] = leader;
+  
+  for (unsigned long i = 0; i < nfields; i++){
+    const char *e = r + ISO_LEADER + i * ISO_ENTRY;
+    const char *data = r + base + isoNumber( e + 7, 5 );
+    size_t len = isoNumber( e + 3, 4 );
+    if (len > 0 && data[len - 1] == ISO_FT) len--;
+    
+    XmElem *field;
+    if (e[0] == '0' && e[1] == '0'){
+      field = newElem( arena, MX_CONTROLFIELD, 1, 0 );
+      setAttrib( arena, field, 0, MX_TAG, e, 3 );
+      setText( arena, field, data, len );
+    }else{
+      field = marcDataField( arena, e, data, len );
+    }
+    (*rec->subelem)[i + 1] = field;
+  }
+  indexElem( rec, arena );
+  return rec;
+}
+
+int mxInputFormat( FILE *fp ){
+  int fd = fileno( fp );
+  struct stat st;
+  unsigned char peek[SNAP_PEEK];
+  ssize_t n = 0;
+  uint64_t size = 0;    // bytes left in a regular file, 0 for a pipe
+  if ( fstat( fd, &st ) != 0 ) return MX_FORMAT_XML;
+  
+  if ( S_ISREG( st.st_mode ) ){
+    off_t offset = lseek( fd, 0, SEEK_CUR );
+    if ( offset < 0 || (n = pread( fd, peek, sizeof(peek), offset )) <= 0 ) return MX_FORMAT_XML;
+    size = st.st_size - offset;
+  }else if ( S_ISFIFO( st.st_mode ) ){
+    //tee copies what is waiting in the pipe into another without consuming it
+    int tap[2];
+    if ( pipe( tap ) != 0 ) return MX_FORMAT_XML;
+    while ( (n = tee( fd, tap[1], sizeof(peek), 0 )) < 0 && errno == EINTR );
+    if (n > 0) n = read( tap[0], peek, n );
+    close( tap[0] );
+    close( tap[1] );
+  }
+  if (n <= 0) return MX_FORMAT_XML;
   
+  //a snapshot starts with its header, a record with its length, MARCXML with
+  //'<', a byte order mark or space
+  if ( isSnapshot( peek, n, size ) ) return MX_FORMAT_SNAPSHOT;
+  return ( isdigit( peek[0] ) ? MX_FORMAT_MARC : MX_FORMAT_XML );
 }
 
 /****************************************************
-- first, check if we are looking for a code or a tag attrib
- - For tag attribute, ensure element attributes are "tag" and match int tag
- - For code attribute ensure element attributes are "code" and match int tag.
-    - Note: this makes use of ability pass to compare the ascii codes of characters
-Pre: mrecp contains a valid element to be have it's children checked for tag attribute
-post: return the number of tags found within mrecp
+nextMarc and marcRecord, timed as parsing and building
+Post: returns as nextMarc, with *rec set when it returns 1
 ****************************************************/
-static int findTag(const XmElem *mrecp, int tag, char *strToMatch){
-   for ( int i=0; i < mrecp->nattribs; i++ ){
-    if ( ( strcmp( "tag", strToMatch ) == 0) && 
-      atoi( (*mrecp->attrib)[i][1] ) == tag && ( strcmp( strToMatch, (*mrecp->attrib)[i][0]) == 0) ){
-      return 1;
-    }else if ( ( strcmp( "code", strToMatch ) == 0) && 
-      *(*mrecp->attrib)[i][1] == tag && ( strcmp( strToMatch, (*mrecp->attrib)[i][0]) == 0) ){
-      return 1;
+static int readMarcRecord( MxMarcInput *in, MxArena *arena, XmElem **rec ){
+  const char *r;
+  size_t len;
+  MxStamp start = mxPhaseStart();
+  int ret = nextMarc( in, &r, &len );
+  mxPhaseEnd( MX_PHASE_PARSE, start );
+  if (ret != 1) return ret;
+  
+  start = mxPhaseStart();
+  *rec = marcRecord( arena, r );
+  mxPhaseEnd( MX_PHASE_BUILD, start );
+  mxCount( MX_COUNT_RECORDS, 1 );
+  return 1;
+}
+
+int mxReadMarc( FILE *marcfp, XmElem **top ){
+  MxArena *arena = (mxOptions[MX_ARENA] ? mxArenaNew() : NULL);
+  MxMarcInput in;
+  openMarcInput( &in, fileno(marcfp) );
+  
+  unsigned long nrecs = 0;
+  unsigned long cap = 64;
+  XmElem **recs = malloc( cap * sizeof(XmElem *) );
+  assert(recs);
+  XmElem *rec;
+  int ret;
+  while ( (ret = readMarcRecord( &in, arena, &rec )) == 1 ){
+    if (nrecs == cap){
+      cap *= 2;
+      recs = realloc( recs, cap * sizeof(XmElem *) );
+      assert(recs);
     }
-   }
+    recs[nrecs++] = rec;
+  }
+  closeMarcInput( &in );
   
+  XmElem *collection = newElem( arena, MX_COLLECTION, 0, nrecs );
+  if (nrecs > 0) memcpy( collection->subelem, recs, nrecs * sizeof(XmElem *) );
+  free( recs );
+  if (arena != NULL) arena->owner = collection;
+  
+  if (ret < 0){
+    mxCleanElem( collection );
+    return 1;
+  }
+  *top = collection;
   return 0;
 }
 
+int mxReadMarcStream( FILE *marcfp, MxRecordFunc recFunc, void *ctx ){
+  //with MX_ARENA every record is built in the same arena, reset between records
+  MxArena *arena = (mxOptions[MX_ARENA] ? mxArenaNew() : NULL);
+  MxMarcInput in;
+  openMarcInput( &in, fileno(marcfp) );
+  
+  XmElem *rec;
+  int ret = 0;
+  int stop = 0;
+  while ( stop == 0 && (ret = readMarcRecord( &in, arena, &rec )) == 1 ){
+    stop = recFunc( rec, ctx );
+    if (arena != NULL){
+      mxArenaReset( arena );
+    }else{
+      mxCleanElem( rec );
+    }
+  }
+  closeMarcInput( &in );
+  if (arena != NULL) mxArenaFree( arena );
+  
+  return (stop == 0 && ret < 0 ? 1 : 0);
+}
+
+/****************************************************
+value of elem's attribute nameid, or NULL if it has none. Names are compared
+as strings, those of a snapshot are not the intern table's.
+****************************************************/
+static const char *attribValue( const XmElem *elem, int nameid ){
+  const char *name = mxName( nameid );
+  for (int i = 0; i < elem->nattribs; i++){
+    if ( strcmp( (*elem->attrib)[i][0], name ) == 0 ) return (*elem->attrib)[i][1];
+  }
+  return NULL;
+}
+
 /****************************************************
-this function acts just as mxFindField would, however is needed to assert from 
-caller that the record in question is in fact a record element.
+length of field (a controlfield or datafield) in ISO 2709, with its terminator
 ****************************************************/
-static int mxFindFieldAfterAssert( const XmElem *mrecp, int tag ){
-   int count = 0;
+static size_t marcFieldLength( const XmElem *field ){
+  if (field->nameid == MX_CONTROLFIELD){
+    return (field->text != NULL ? strlen( field->text ) : 0) + 1;
+  }
+  size_t len = 2 + 1;
+  for (unsigned long i = 0; i < field->nsubs; i++){
+    const XmElem *sub = (*field->subelem)[i];
+    if (sub->nameid != MX_SUBFIELD) continue;
+    len += 2 + (sub->text != NULL ? strlen( sub->text ) : 0);
+  }
+  return len;
+}
+
+static void putIndicator( MxWriter *w, const char *ind ){
+  mxPutBytes( w, (ind != NULL && ind[0] != '\0' ? ind : " "), 1 );
+}
 
-   if (mrecp->nsubs > 0){
-    for (int i = 0; i < mrecp->nsubs; i++){
-      count += mxFindFieldAfterAssert( (*mrecp->subelem)[i], tag ); //recursive call to each sub child element
+int mxPutMarc( MxWriter *w, const XmElem *rec ){
+  
+  //directory and lengths first, nothing is written for a record that can't be
+  const char *leaderText = NULL;
+  unsigned long nfields = 0;
+  size_t dataLen = 0;
+  for (unsigned long i = 0; i < rec->nsubs; i++){
+    const XmElem *field = (*rec->subelem)[i];
+    if (field->nameid == MX_LEADER){
+      if (leaderText == NULL) leaderText = (field->text != NULL ? field->text : "");
+      continue;
+    }
+    if (field->nameid != MX_CONTROLFIELD && field->nameid != MX_DATAFIELD) continue;
+    
+    const char *tag = attribValue( field, MX_TAG );
+    size_t len = marcFieldLength( field );
+    if (tag == NULL || strlen( tag ) != 3){
+      fprintf( stderr, "\nError, a field has no 3 character tag, record not written\n" );
+      return -1;
+    }
+    if (len > ISO_MAXFIELD || dataLen > ISO_MAXRECORD){
+      fprintf( stderr, "\nError, record too long for ISO 2709, not written\n" );
+      return -1;
+    }
+    dataLen += len;
+    nfields++;
+  }
+  size_t base = ISO_LEADER + nfields * ISO_ENTRY + 1;
+  size_t recLen = base + dataLen + 1;
+  if (recLen > ISO_MAXRECORD){
+    fprintf( stderr, "\nError, record too long for ISO 2709, not written\n" );
+    return -1;
+  }
+  
+  //the leader keeps what it had, but with the lengths and layout of this record
+  char leader[ISO_LEADER + 1];
+  snprintf( leader, sizeof(leader), "%-24.24s", (leaderText != NULL ? leaderText : "     nam a22     uu 4500") );
+  char num[6];
+  snprintf( num, sizeof(num), "%05zu", recLen );
+  memcpy( leader, num, 5 );
+  snprintf( num, sizeof(num), "%05zu", base );
+  memcpy( leader + 12, num, 5 );
+  memcpy( leader + 10, "22", 2 );
+  memcpy( leader + 20, "4500", 4 );
+  mxPutBytes( w, leader, ISO_LEADER );
+  
+  size_t start = 0;
+  for (unsigned long i = 0; i < rec->nsubs; i++){
+    const XmElem *field = (*rec->subelem)[i];
+    if (field->nameid != MX_CONTROLFIELD && field->nameid != MX_DATAFIELD) continue;
+    char entry[ISO_ENTRY + 1];
+    size_t len = marcFieldLength( field );
+    snprintf( entry, sizeof(entry), "%.3s%04zu%05zu", attribValue( field, MX_TAG ), len, start );
+    mxPutBytes( w, entry, ISO_ENTRY );
+    start += len;
+  }
+  mxPutBytes( w, "\x1e", 1 );
+  
+  for (unsigned long i = 0; i < rec->nsubs; i++){
+    const XmElem *field = (*rec->subelem)[i];
+    if (field->nameid == MX_CONTROLFIELD){
+      mxPuts( w, field->text );
+    }else if (field->nameid == MX_DATAFIELD){
+      putIndicator( w, attribValue( field, MX_IND1 ) );
+      putIndicator( w, attribValue( field, MX_IND2 ) );
+      for (unsigned long j = 0; j < field->nsubs; j++){
+        const XmElem *sub = (*field->subelem)[j];
+        if (sub->nameid != MX_SUBFIELD) continue;
+        const char *code = attribValue( sub, MX_CODE );
+        mxPutBytes( w, "\x1f", 1 );
+        mxPutBytes( w, (code != NULL && code[0] != '\0' ? code : " "), 1 );
+        mxPuts( w, sub->text );
+      }
+    }else{
+      continue;
     }
+    mxPutBytes( w, "\x1e", 1 );
+  }
+  mxPutBytes( w, "\x1d", 1 );
+  
+  return (mxWriterError( w ) ? -1 : 0);
+}
+
+int mxWriteMarc( const XmElem *top, FILE *marcfp ){
+  if (top == NULL || (top->nameid != MX_COLLECTION && top->nameid != MX_RECORD)){
+    fprintf(stderr, "\nError, invalid root node\n");
+    return -1;
   }
   
-  //check for occurence of 'tag', must compare characters to ints
-   for ( int i=0; i < mrecp->nattribs; i++ ){   
-     /*compare each attribute, if it is == tag and of element "tag", add onto count
-     this assumes only 1 tag attribute per set.*/
-    if ( atoi( (*mrecp->attrib)[i][1] ) == tag && ( strcmp("tag", (*mrecp->attrib)[i][0]) == 0) ){
-      return (count + 1);
+  MxStamp start = mxPhaseStart();
+  MxWriter *w = mxWriterNew( marcfp );
+  int nrecs = 0;
+  int status = 0;
+  if (top->nameid == MX_RECORD){
+    status = mxPutMarc( w, top );
+    nrecs = 1;
+  }else{
+    for (unsigned long i = 0; i < top->nsubs && status == 0; i++){
+      if ( (*top->subelem)[i]->nameid != MX_RECORD ) continue;
+      status = mxPutMarc( w, (*top->subelem)[i] );
+      nrecs++;
     }
-   }
-  return count;
+  }
+  status = ( mxWriterFree( w ) != 0 || status != 0 );
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  return (status ? -1 : nrecs);
 }
 
 /****************************************************
-note, two functions used due to recursive nature of searching for "tag", and
-complications arising from asserting the passed in element is of type record.
-Designed this way to adhere to assignment spec
+Snapshots: a parsed tree saved as tables of offsets, so it can be mapped
+anywhere and is checked before anything in it is used. Elements are stored a
+level at a time (the root, the records, their fields, the subfields), each
+level in its parents' order, so an element's children are a run of rows in
+the next level's table, and the rows of the records' level are the record
+index. Opening a snapshot maps it and checks every table and offset in it;
+records are then built from their rows when they are asked for, with their
+text and attribute values left in the mapping rather than copied.
+File: header, names table (pool offsets of the element and attribute names),
+a table of MxSnapElem rows for each level, the MxSnapAttrib rows of every
+level's elements, level by level in the same order, then the pool of NUL
+terminated strings, with short ones stored once. Numbers are in the byte
+order of the machine that wrote the file.
 ****************************************************/
-int mxFindField( const XmElem *mrecp, int tag ){
-  assert( strcmp(mrecp->tag, "record") == 0 );
+
+//levels of elements a snapshot holds: collection, record, field and subfield
+#define SNAP_LEVELS 4
+//the text offset of an element without text
+#define SNAP_NONE UINT64_MAX
+//stored as a number, it only reads back the same with the writer's byte order
+#define SNAP_ORDER 0x01020304u
+//the most bytes a snapshot can take, so offsets never overflow
+#define SNAP_LIMIT ((uint64_t)(SIZE_MAX / 2))
+//strings this long or shorter (tags, indicators, codes...) are shared in the pool
+#define SNAP_SHARED 16
+
+struct MxSnapHeader {
+  char magic[8];        // SNAP_MAGIC
+  uint32_t order;       // SNAP_ORDER
+  uint32_t nnames;      // entries in the names table
+  uint64_t size;        // bytes in the file
+  uint64_t nelems[SNAP_LEVELS];   // rows of each level's table
+  uint64_t nattribs[SNAP_LEVELS]; // attribute rows of each level's elements
+  uint64_t poolLen;     // bytes in the pool
+};
+
+typedef struct MxSnapElem MxSnapElem;
+struct MxSnapElem {
+  uint32_t name;        // in the names table
+  uint32_t nattribs;
+  uint32_t isBlank;
+  uint32_t unused;      // 0
+  uint64_t text;        // pool offset, or SNAP_NONE
+  uint64_t attribs;     // first row in the attribute table
+  uint64_t subs;        // first row in the next level's table
+  uint64_t nsubs;
+};
+
+typedef struct MxSnapAttrib MxSnapAttrib;
+struct MxSnapAttrib {
+  uint32_t name;        // in the names table
+  uint32_t unused;      // 0
+  uint64_t value;       // pool offset
+};
+
+//the tables in file order: names, each level, attributes and pool
+#define SNAP_TABLES (SNAP_LEVELS + 3)
+
+struct MxSnapshot {
+  char *addr;           // the file, mapped (or read into anonymous memory)
+  size_t size;
+  const MxSnapHeader *header;
+  const uint64_t *names;
+  const MxSnapElem *levels[SNAP_LEVELS];
+  const MxSnapAttrib *attribs;
+  const char *pool;
+  int *nameids;         // each name's interned id
+  const char **tags;    // and the intern table's copy of it
+};
+
+/****************************************************
+add the bytes of count entries of size to *at
+Post: returns 0 if that would take it past SNAP_LIMIT, else 1
+****************************************************/
+static int snapAdd( uint64_t *at, uint64_t count, size_t size ){
+  if (*at > SNAP_LIMIT || count > (SNAP_LIMIT - *at) / size) return 0;
+  *at += count * size;
+  return 1;
+}
+
+/****************************************************
+Where the tables of a snapshot with header h start, in SNAP_TABLES order,
+and where the file ends
+Post: returns 0 if the counts are too large for a snapshot, else 1
+****************************************************/
+static int snapLayout( const MxSnapHeader *h, uint64_t offsets[SNAP_TABLES], uint64_t *end ){
+  uint64_t at = sizeof(MxSnapHeader);
+  uint64_t nattribs = 0;
+  offsets[0] = at;
+  if ( !snapAdd( &at, h->nnames, sizeof(uint64_t) ) ) return 0;
+  for (int level = 0; level < SNAP_LEVELS; level++){
+    offsets[1 + level] = at;
+    if ( !snapAdd( &at, h->nelems[level], sizeof(MxSnapElem) ) ) return 0;
+    if ( !snapAdd( &nattribs, h->nattribs[level], 1 ) ) return 0;
+  }
+  offsets[SNAP_LEVELS + 1] = at;
+  if ( !snapAdd( &at, nattribs, sizeof(MxSnapAttrib) ) ) return 0;
+  offsets[SNAP_LEVELS + 2] = at;
+  if ( !snapAdd( &at, h->poolLen, 1 ) ) return 0;
+  *end = at;
+  return 1;
+}
+
+/****************************************************
+Is h the header of a snapshot this build can read, size bytes long (0 if the
+size is not known)?
+Post: returns 1 or 0
+****************************************************/
+static int snapHeaderValid( const MxSnapHeader *h, uint64_t size ){
+  uint64_t offsets[SNAP_TABLES];
+  uint64_t end;
+  return ( memcmp( h->magic, SNAP_MAGIC, sizeof(h->magic) ) == 0 && h->order == SNAP_ORDER &&
+           h->nelems[0] == 1 && h->poolLen > 0 && snapLayout( h, offsets, &end ) &&
+           end == h->size && (size == 0 || size == h->size) );
+}
+
+/****************************************************
+do the len bytes peeked at the start of an input of size bytes (0 if not
+known) start with a snapshot header?
+****************************************************/
+static int isSnapshot( const unsigned char *peek, size_t len, uint64_t size ){
+  assert(sizeof(MxSnapHeader) <= SNAP_PEEK);
+  MxSnapHeader h;
+  if (len < sizeof(h)) return 0;
+  memcpy( &h, peek, sizeof(h) );
+  return snapHeaderValid( &h, size );
+}
+
+typedef struct MxSnapBuilder MxSnapBuilder;
+struct MxSnapBuilder {
+  MxSnapHeader *header;
+  uint64_t *names;      // pool offset of each name
+  MxSnapElem *levels[SNAP_LEVELS];
+  MxSnapAttrib *attribs;
+  uint64_t next[SNAP_LEVELS];       // each level's next row
+  uint64_t nextAttrib[SNAP_LEVELS]; // and the next attribute row of its elements
+  const char **nameList;// names in the order they were first seen
+  uint32_t nnames;
+  uint32_t namesCap;
+  uint32_t *nameHash;   // open addressing set of name indexes + 1, 0 if empty
+  uint32_t nameHashSize;// a power of 2
+  char *pool;
+  size_t poolLen;
+  size_t poolCap;
+  size_t *shared;       // open addressing set of pool offsets + 1, 0 if empty
+  size_t nshared;
+  size_t sharedSize;    // slots in shared, a power of 2
+};
+
+/****************************************************
+index of name in the snapshot's names table, adding it if it is new
+****************************************************/
+static uint32_t snapName( MxSnapBuilder *b, const char *name ){
+  uint32_t h = hashName( name ) & (b->nameHashSize - 1);
+  while (b->nameHash[h] != 0){
+    const char *known = b->nameList[b->nameHash[h] - 1];
+    if ( known == name || strcmp( known, name ) == 0 ) return b->nameHash[h] - 1;
+    h = (h + 1) & (b->nameHashSize - 1);
+  }
   
-  return ( mxFindFieldAfterAssert(mrecp, tag) );
+  if (b->nnames == b->namesCap){
+    b->namesCap *= 2;
+    b->nameList = realloc( b->nameList, b->namesCap * sizeof(char *) );
+    assert(b->nameList);
+  }
+  b->nameList[b->nnames] = name;
+  b->nameHash[h] = ++b->nnames;
+  if (2 * b->nnames > b->nameHashSize){
+    //rehash into a table twice the size
+    uint32_t newSize = 2 * b->nameHashSize;
+    uint32_t *newHash = calloc( newSize, sizeof(uint32_t) );
+    assert(newHash);
+    for (uint32_t i = 0; i < b->nnames; i++){
+      uint32_t j = hashName( b->nameList[i] ) & (newSize - 1);
+      while (newHash[j] != 0) j = (j + 1) & (newSize - 1);
+      newHash[j] = i + 1;
+    }
+    free( b->nameHash );
+    b->nameHash = newHash;
+    b->nameHashSize = newSize;
+  }
+  return b->nnames - 1;
 }
 
 /****************************************************
-internal function called by mxFindSubField,did not use recursion this time,
-see mxFindFieldAfterAssert for a similar function using recursion
-Pre: elem points to a record child
-Post: returns the number of sub occurances in elems children
+offset str has in the snapshot's pool, adding it
 ****************************************************/
-static int getSubCount(const XmElem *elem, char sub){
+static uint64_t snapString( MxSnapBuilder *b, const char *str ){
+  size_t len = strlen( str );
   
-   int count = 0;
+  size_t h = 0;
+  if (len <= SNAP_SHARED){
+    h = hashName( str ) & (b->sharedSize - 1);
+    while (b->shared[h] != 0){
+      if ( strcmp( b->pool + b->shared[h] - 1, str ) == 0 ) return b->shared[h] - 1;
+      h = (h + 1) & (b->sharedSize - 1);
+    }
+  }
+  
+  if (b->poolLen + len + 1 > b->poolCap){
+    while (b->poolLen + len + 1 > b->poolCap) b->poolCap *= 2;
+    b->pool = realloc( b->pool, b->poolCap );
+    assert(b->pool);
+  }
+  size_t at = b->poolLen;
+  memcpy( b->pool + at, str, len + 1 );
+  b->poolLen += len + 1;
   
-    if (elem->nsubs > 0){
-     for (int i = 0; i < elem->nsubs; i++){
-       count += getSubCount( (*elem->subelem)[i], sub ); //recursive call to each sub child element
-     }
-   }
-   
-   //check for occurence of 'sub', must compare characters to string
-    for ( int i=0; i < elem->nattribs; i++ ){   
-      /*compare each attribute, if it is == sub and of element "code", add onto count
-      this assumes only 1 tag attribute per set.*/
-     if ( ( strcmp("code", (*elem->attrib)[i][0]) == 0) && *(*elem->attrib)[i][1] == sub  ){
-       return (count + 1);
-     }
+  if (len <= SNAP_SHARED){
+    b->shared[h] = at + 1;
+    if (2 * ++b->nshared > b->sharedSize){
+      //rehash into a table twice the size
+      size_t newSize = 2 * b->sharedSize;
+      size_t *newShared = calloc( newSize, sizeof(size_t) );
+      assert(newShared);
+      for (size_t i = 0; i < b->sharedSize; i++){
+        if (b->shared[i] == 0) continue;
+        size_t j = hashName( b->pool + b->shared[i] - 1 ) & (newSize - 1);
+        while (newShared[j] != 0) j = (j + 1) & (newSize - 1);
+        newShared[j] = b->shared[i];
+      }
+      free( b->shared );
+      b->shared = newShared;
+      b->sharedSize = newSize;
     }
-   return count;
+  }
+  return at;
 }
 
 /****************************************************
-  traverse to the tnum'th occurance of strToMatch - will be either code or tag, 
-  for loop will traverse through each element, breaking out after finding 
-  tnum'th tag, that element will be the ith child.
-  Pre: mrecp points to a valid record structure and tag is within a valid 
-  range i.e, 1 < tag < Max
-  Post: returns an integer representing child element position containing 
-  tnum'th tag
+Count elem and everything under it into the header's levels, and their names
+into the names table
+Post: returns 0 if the tree is deeper than SNAP_LEVELS, else 1
 ****************************************************/
-static int findNthAttrib(const XmElem *mrecp, int tag, int tnum, char *strToMatch ){
+static int snapCount( MxSnapBuilder *b, const XmElem *elem, int level ){
+  if (level >= SNAP_LEVELS) return 0;
+  b->header->nelems[level]++;
+  b->header->nattribs[level] += elem->nattribs;
+  snapName( b, elem->tag );
+  for (int i = 0; i < elem->nattribs; i++){
+    snapName( b, (*elem->attrib)[i][0] );
+  }
+  for (unsigned long i = 0; i < elem->nsubs; i++){
+    if ( !snapCount( b, (*elem->subelem)[i], level + 1 ) ) return 0;
+  }
+  return 1;
+}
 
-  int tagCount = 0;
-  int i = 0;
-  for (i=0; i < mrecp->nsubs; i++){ //this for loop goes through each child of the mrecp record
-     if ( findTag( (*mrecp->subelem)[i], tag, strToMatch ) ) { //find tag returns 1 if the passed in child has the tag attribute
-       tagCount+=1;
-     }
-     if (tagCount == tnum){
-       break;
-     }
+/****************************************************
+Fill in the rows of elem and everything under it. Each level's rows are
+taken in document order, so an element's children get the rows that follow
+those of the children of the elements before it.
+****************************************************/
+static void snapFill( MxSnapBuilder *b, const XmElem *elem, int level ){
+  MxSnapElem *row = &b->levels[level][b->next[level]++];
+  row->name = snapName( b, elem->tag );
+  row->nattribs = elem->nattribs;
+  row->isBlank = (elem->isBlank != 0);
+  row->text = (elem->text != NULL ? snapString( b, elem->text ) : SNAP_NONE);
+  row->attribs = b->nextAttrib[level];
+  row->subs = (level + 1 < SNAP_LEVELS ? b->next[level + 1] : 0);
+  row->nsubs = elem->nsubs;
+  
+  for (int i = 0; i < elem->nattribs; i++){
+    MxSnapAttrib *a = &b->attribs[b->nextAttrib[level]++];
+    a->name = snapName( b, (*elem->attrib)[i][0] );
+    a->value = snapString( b, (*elem->attrib)[i][1] );
+  }
+  for (unsigned long i = 0; i < elem->nsubs; i++){
+    snapFill( b, (*elem->subelem)[i], level + 1 );
   }
-  return i;
 }
 
-int mxFindSubfield( const XmElem *mrecp, int tag, int tnum, char sub ){  
+int mxWriteSnapshot( const XmElem *top, FILE *snapfp ){
+  if (top == NULL || (top->nameid != MX_COLLECTION && top->nameid != MX_RECORD)){
+    fprintf(stderr, "\nError, invalid root node\n");
+    return -1;
+  }
+  
+  MxStamp start = mxPhaseStart();
+  MxSnapHeader header;
+  memset( &header, 0, sizeof(header) );
+  MxSnapBuilder b = { .header = &header, .namesCap = 64, .nameHashSize = 128,
+                      .poolCap = 1 << 16, .sharedSize = 1024 };
+  b.nameList = malloc( b.namesCap * sizeof(char *) );
+  b.nameHash = calloc( b.nameHashSize, sizeof(uint32_t) );
+  b.pool = malloc( b.poolCap );
+  b.shared = calloc( b.sharedSize, sizeof(size_t) );
+  assert(b.nameList && b.nameHash && b.pool && b.shared);
+  
+  int status = -1;
+  char *tables = NULL;
+  uint64_t offsets[SNAP_TABLES];
+  uint64_t end;
+  if ( !snapCount( &b, top, 0 ) ){
+    fprintf(stderr, "\nError, the tree is too deep for a snapshot\n");
+  }else{
+    //the pool is not known yet, the tables are laid out without it
+    header.nnames = b.nnames;
+    int fits = snapLayout( &header, offsets, &end );
+    tables = (fits ? calloc( 1, offsets[SNAP_LEVELS + 2] ) : NULL);
+    if (tables == NULL) fprintf(stderr, "\nError, the tree is too large for a snapshot\n");
+  }
+  
+  if (tables != NULL){
+    b.names = (uint64_t *)(tables + offsets[0]);
+    uint64_t firstAttrib = 0;
+    for (int level = 0; level < SNAP_LEVELS; level++){
+      b.levels[level] = (MxSnapElem *)(tables + offsets[1 + level]);
+      b.nextAttrib[level] = firstAttrib;
+      firstAttrib += header.nattribs[level];
+    }
+    b.attribs = (MxSnapAttrib *)(tables + offsets[SNAP_LEVELS + 1]);
+    for (uint32_t i = 0; i < b.nnames; i++){
+      b.names[i] = snapString( &b, b.nameList[i] );
+    }
+    snapFill( &b, top, 0 );
     
-  int maxRange = mxFindField( mrecp, tag);
-  if ( tnum < 1 || tnum > maxRange ) return 0; //tnum is out of range
+    memcpy( header.magic, SNAP_MAGIC, sizeof(header.magic) );
+    header.order = SNAP_ORDER;
+    header.poolLen = b.poolLen;
+    header.size = offsets[SNAP_LEVELS + 2] + b.poolLen;
+    memcpy( tables, &header, sizeof(header) );
+    
+    MxWriter *w = mxWriterNew( snapfp );
+    mxPutBytes( w, tables, offsets[SNAP_LEVELS + 2] );
+    mxPutBytes( w, b.pool, b.poolLen );
+    status = mxWriterFree( w );
+  }
+  free( tables );
+  free( b.nameList );
+  free( b.nameHash );
+  free( b.pool );
+  free( b.shared );
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  return status;
+}
+
+/****************************************************
+read len bytes of fd into buf
+Post: returns 1, or 0 if the input ended first
+****************************************************/
+static int readFull( int fd, void *buf, size_t len ){
+  while (len > 0){
+    ssize_t n = readInput( fd, buf, len );
+    if (n <= 0) return 0;
+    buf = (char *)buf + n;
+    len -= n;
+  }
+  return 1;
+}
+
+/****************************************************
+Check every table of snap: names, attribute names and text in range, each
+level's children and attributes following on from the rows before them and
+adding up to the next level and the attribute table, and a pool that ends in
+a NUL (so every string in it ends within it).
+Post: returns 1 if the tree can be built from it, else 0
+****************************************************/
+static int snapCheck( const MxSnapshot *snap ){
+  const MxSnapHeader *h = snap->header;
+  if (snap->pool[h->poolLen - 1] != '\0') return 0;
+  for (uint32_t i = 0; i < h->nnames; i++){
+    if (snap->names[i] >= h->poolLen) return 0;
+  }
+  
+  uint64_t attrib = 0;
+  for (int level = 0; level < SNAP_LEVELS; level++){
+    uint64_t sub = 0;
+    uint64_t below = (level + 1 < SNAP_LEVELS ? h->nelems[level + 1] : 0);
+    uint64_t attribEnd = attrib + h->nattribs[level];
+    for (uint64_t r = 0; r < h->nelems[level]; r++){
+      const MxSnapElem *e = &snap->levels[level][r];
+      if ( e->name >= h->nnames || e->isBlank > 1 || e->unused != 0 ||
+           (e->text != SNAP_NONE && e->text >= h->poolLen) ||
+           e->subs != sub || e->nsubs > below - sub ||
+           e->attribs != attrib || e->nattribs > attribEnd - attrib || e->nattribs > INT_MAX ){
+        return 0;
+      }
+      sub += e->nsubs;
+      attrib += e->nattribs;
+    }
+    if (sub != below || attrib != attribEnd) return 0;
+  }
   
-  int i = findNthAttrib(mrecp, tag, tnum, "tag");
-  return getSubCount((*mrecp->subelem)[i], sub ); //pass tnum'th( i ) child into getSubelem
+  for (uint64_t i = 0; i < attrib; i++){
+    const MxSnapAttrib *a = &snap->attribs[i];
+    if (a->name >= h->nnames || a->unused != 0 || a->value >= h->poolLen) return 0;
+  }
+  return 1;
 }
 
-const char *mxGetData( const XmElem *mrecp, int tag, int tnum, char sub, int snum ){
-  assert( strcmp(mrecp->tag, "record") == 0 );//assert mrecp is of type record
+/****************************************************
+mxSnapshotOpen, untimed
+****************************************************/
+static MxSnapshot *openSnapshot( FILE *snapfp ){
+  int fd = fileno(snapfp);
+  struct stat st;
+  MxSnapHeader header;
   
-  int maxTnumRange = mxFindField( mrecp, tag); 
-  if ( tnum < 1 || tnum > maxTnumRange ) return NULL; //tnum is out of range
-       
-    //if 000<= tag <= 009, ignore subfield and return text from target tag child
-    if ( 0 <= tag && tag <= 9 ){
-      int tagChildLocation = findNthAttrib (mrecp, tag, tnum, "tag");
-      
-      XmElem *targetChild = (*mrecp->subelem)[tagChildLocation];
-      return targetChild->text;
+  //files are mapped as they are, anything else (a pipe) is read into anonymous memory
+  int isFile = ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && lseek( fd, 0, SEEK_CUR ) == 0 );
+  int haveHeader = (isFile ? pread( fd, &header, sizeof(header), 0 ) == sizeof(header)
+                           : readFull( fd, &header, sizeof(header) ));
+  if ( !haveHeader || !snapHeaderValid( &header, (isFile ? (uint64_t)st.st_size : 0) ) ){
+    fprintf(stderr, "\nError, not a snapshot this build can read\n");
+    return NULL;
+  }
+  
+  int flags = (isFile ? MAP_PRIVATE : MAP_PRIVATE | MAP_ANONYMOUS);
+  int prot = (isFile ? PROT_READ : PROT_READ | PROT_WRITE);
+  char *addr = mmap( NULL, header.size, prot, flags, (isFile ? fd : -1), 0 );
+  if (addr == MAP_FAILED){
+    fprintf(stderr, "\nError, could not map the snapshot\n");
+    return NULL;
+  }
+  
+  int ok = 1;
+  if (isFile){
+    lseek( fd, header.size, SEEK_SET );
+    mxCount( MX_COUNT_READ, header.size );
+  }else{
+    memcpy( addr, &header, sizeof(header) );
+    ok = readFull( fd, addr + sizeof(header), header.size - sizeof(header) );
+    mprotect( addr, header.size, PROT_READ );
+  }
+  
+  MxSnapshot *snap = calloc( 1, sizeof(MxSnapshot) );
+  assert(snap);
+  uint64_t offsets[SNAP_TABLES];
+  uint64_t end;
+  snapLayout( &header, offsets, &end );
+  snap->addr = addr;
+  snap->size = header.size;
+  snap->header = (const MxSnapHeader *)addr;
+  snap->names = (const uint64_t *)(addr + offsets[0]);
+  for (int level = 0; level < SNAP_LEVELS; level++){
+    snap->levels[level] = (const MxSnapElem *)(addr + offsets[1 + level]);
+  }
+  snap->attribs = (const MxSnapAttrib *)(addr + offsets[SNAP_LEVELS + 1]);
+  snap->pool = addr + offsets[SNAP_LEVELS + 2];
+  if ( !ok || !snapCheck( snap ) ){
+    fprintf(stderr, "\nError, snapshot is truncated or corrupt\n");
+    mxSnapshotClose( snap );
+    return NULL;
+  }
+  
+  //the names are interned once, the elements take theirs from here
+  snap->nameids = malloc( header.nnames * sizeof(int) );
+  snap->tags = malloc( header.nnames * sizeof(char *) );
+  assert(snap->nameids && snap->tags);
+  for (uint32_t i = 0; i < header.nnames; i++){
+    snap->nameids[i] = mxIntern( snap->pool + snap->names[i] );
+    snap->tags[i] = mxName( snap->nameids[i] );
+  }
+  return snap;
+}
+
+MxSnapshot *mxSnapshotOpen( FILE *snapfp ){
+  MxStamp start = mxPhaseStart();
+  MxSnapshot *snap = openSnapshot( snapfp );
+  mxPhaseEnd( MX_PHASE_PARSE, start );
+  return snap;
+}
+
+unsigned long mxSnapshotRecords( const MxSnapshot *snap ){
+  const MxSnapElem *root = &snap->levels[0][0];
+  return (snap->nameids[root->name] == MX_COLLECTION ? root->nsubs : 1);
+}
+
+/****************************************************
+build the element of row at level of snap, and everything under it, in arena
+****************************************************/
+static XmElem *snapElem( const MxSnapshot *snap, int level, uint64_t row, MxArena *arena ){
+  const MxSnapElem *e = &snap->levels[level][row];
+  if (mxOptions[MX_STATS]) mxCount( MX_COUNT_ELEMENTS, 1 );
+  XmElem *elem = mxArenaAlloc( arena, sizeof(XmElem) );
+  elem->arena = arena;
+  elem->nameid = snap->nameids[e->name];
+  elem->tag = (char *)snap->tags[e->name];
+  elem->text = (e->text != SNAP_NONE ? (char *)snap->pool + e->text : NULL);
+  elem->isBlank = e->isBlank;
+  
+  //the tag and code attributes are decoded as addAttribs does
+  elem->tagnum = -1;
+  elem->code = '\0';
+  elem->nattribs = e->nattribs;
+  elem->attrib = NULL;
+  if (e->nattribs > 0){
+    elem->attrib = mxArenaAlloc( arena, e->nattribs * sizeof(char *[2]) );
+    for (int i = 0; i < elem->nattribs; i++){
+      const MxSnapAttrib *a = &snap->attribs[e->attribs + i];
+      (*elem->attrib)[i][0] = (char *)snap->tags[a->name];
+      (*elem->attrib)[i][1] = (char *)snap->pool + a->value;
+      if (snap->nameids[a->name] == MX_TAG){
+        elem->tagnum = atoi( (*elem->attrib)[i][1] );
+      }else if (snap->nameids[a->name] == MX_CODE){
+        elem->code = *(*elem->attrib)[i][1];
+      }
     }
+  }
+  
+  elem->nsubs = e->nsubs;
+  elem->subelem = NULL;
+  if (e->nsubs > 0){
+    elem->subelem = mxArenaAlloc( arena, e->nsubs * sizeof(XmElem *) );
+    for (unsigned long i = 0; i < elem->nsubs; i++){
+      (*elem->subelem)[i] = snapElem( snap, level + 1, e->subs + i, arena );
+    }
+  }
+  indexElem( elem, arena );
+  return elem;
+}
+
+/****************************************************
+mxSnapshotRecord, untimed and uncounted
+****************************************************/
+static XmElem *snapRecord( const MxSnapshot *snap, unsigned long n, MxArena *arena ){
+  int level = (snap->nameids[snap->levels[0][0].name] == MX_COLLECTION ? 1 : 0);
+  return snapElem( snap, level, n, arena );
+}
+
+XmElem *mxSnapshotRecord( const MxSnapshot *snap, unsigned long n, MxArena *arena ){
+  assert(n < mxSnapshotRecords( snap ));
+  MxStamp start = mxPhaseStart();
+  XmElem *rec = snapRecord( snap, n, arena );
+  mxPhaseEnd( MX_PHASE_BUILD, start );
+  mxCount( MX_COUNT_RECORDS, 1 );
+  return rec;
+}
+
+void mxSnapshotClose( MxSnapshot *snap ){
+  if (snap == NULL) return;
+  if (snap->addr != NULL) munmap( snap->addr, snap->size );
+  free( snap->nameids );
+  free( snap->tags );
+  free( snap );
+}
+
+/****************************************************
+runChunks next function for mxRenderSnapshot, a batch of records for a
+worker to build and render
+****************************************************/
+typedef struct {
+  const MxSnapshot *snap;
+  unsigned long nrecs;
+  unsigned long pos;
+} MxSnapBatcher;
+
+static MxChunk *nextSnapBatch( void *src ){
+  MxSnapBatcher *b = src;
+  if (b->pos >= b->nrecs) return NULL;
+  
+  MxChunk *c = calloc( 1, sizeof(MxChunk) );
+  assert(c);
+  c->snap = b->snap;
+  c->first = b->pos;
+  c->nrecs = (b->nrecs - b->pos < RENDER_BATCH ? b->nrecs - b->pos : RENDER_BATCH);
+  b->pos += c->nrecs;
+  return c;
+}
+
+void mxRenderSnapshot( const MxSnapshot *snap, MxRenderFunc render, void *ctx, MxWriter *out ){
+  MxRenderTo to = { render, ctx, out };
+  unsigned long nrecs = mxSnapshotRecords( snap );
+  if ( mxOptions[MX_THREADS] > 1 && nrecs > RENDER_BATCH ){
+    MxSnapBatcher b = { snap, nrecs, 0 };
+    runChunks( nextSnapBatch, &b, NULL, &to, emitChunk, &to );
+    return;
+  }
+  
+  MxArena *arena = mxArenaNew();
+  for ( unsigned long i = 0; i < nrecs; i++ ){
+    XmElem *rec = mxSnapshotRecord( snap, i, arena );
+    int stop = ( rec->nameid == MX_RECORD && renderRecord( rec, &to ) );
+    mxArenaReset( arena );
+    if (stop) break;
+  }
+  mxArenaFree( arena );
+}
+
+int mxOpenSnapshot( FILE *snapfp, XmElem **top ){
+  MxSnapshot *snap = mxSnapshotOpen( snapfp );
+  if (snap == NULL) return 1;
+  
+  //the whole tree is built in an arena that unmaps the snapshot when freed
+  MxStamp start = mxPhaseStart();
+  MxArena *arena = mxArenaNew();
+  XmElem *root = snapElem( snap, 0, 0, arena );
+  arena->owner = root;
+  arena->mapped = snap->addr;
+  arena->mappedSize = snap->size;
+  snap->addr = NULL;
+  mxSnapshotClose( snap );
+  mxPhaseEnd( MX_PHASE_BUILD, start );
+  countRecords( root );
+  *top = root;
+  return 0;
+}
+
+/****************************************************
+Personal note: go through and recursively free each element in turn. Remember!
+subelements are just stored in an array fashion.
+****************************************************/
+void mxCleanElem( XmElem *top ){
+  
+  //arena trees are freed all at once, and only through the element owning it
+  if (top->arena != NULL){
+    if (top->arena->owner == top) mxArenaFree( top->arena );
+    return;
+  }
     
-    //*************check for invald sub tag here e.g = ''
-      
-    int maxSnumRange = mxFindSubfield(mrecp, tag, tnum, sub);
-    if ( snum < 1 || snum > maxSnumRange ) return NULL; //ensure snum is within valid range
-    
-    //traverse to specific element and return data
-    int tagChildLocation = findNthAttrib (mrecp, tag, tnum, "tag");
-    XmElem *targetTagChild = (*mrecp->subelem)[tagChildLocation];
+  if (top->nsubs > 0){
+    for (int i = 0; i < top->nsubs; ++i){
+      mxCleanElem( (*top->subelem)[i] ); //recursive call to each sub child element
+    }
+    if ( (top->subelem) != NULL) free( top->subelem );//free array of structure pointers
+  }
+
+  //tag and attribute names belong to the intern table
+  if ( (top->index) != NULL ) free (top->index);
+  if ( (top->text) != NULL ) xmlFree(top->text);
+  
+  //free attributes, loop through each attribute and free it's value
+ for (int i = 0; i < top->nattribs; i++){
+    if (((*top->attrib)[i][1]) !=NULL)xmlFree( (*top->attrib)[i][1] ); 
+ }
+ if ( (top->attrib)!=NULL) free( top->attrib );
+  if ( top !=NULL ) free (top); //free actual structure
+  
+}
+
+/****************************************************
+Locate the nth child of elem indexed under key, using elem's index. Elements
+that were never indexed (e.g. built by hand) are scanned instead.
+Pre: elem is a valid element, nth >= 1
+Post: returns the total no. of children with key in *count, and the position
+in elem->subelem of the nth of them, or -1 if there are fewer than nth
+****************************************************/
+static long findNthKey( const XmElem *elem, int key, int nth, int *count ){
+  long pos = -1;
+  *count = 0;
+
+  if (elem->index == NULL){
+    int childKey;
+    for ( unsigned long i = 0; i < elem->nsubs; i++ ){
+      if ( elemKey( (*elem->subelem)[i], &childKey ) && childKey == key ){
+        *count += 1;
+        if (*count == nth) pos = i;
+      }
+    }
+    return pos;
+  }
+
+  //binary search for the first entry with key
+  int lo = 0;
+  int hi = elem->nindex;
+  while (lo < hi){
+    int mid = (lo + hi) / 2;
+    if (elem->index[mid].key < key){
+      lo = mid + 1;
+    }else{
+      hi = mid;
+    }
+  }
+
+  //entries for the same key are contiguous and in document order
+  for ( int i = lo; i < elem->nindex && elem->index[i].key == key; i++ ){
+    *count += 1;
+  }
+  if (nth >= 1 && nth <= *count) pos = elem->index[lo + nth - 1].pos;
+  return pos;
+}
+
+/****************************************************
+Must assert the record in question is in fact a record element, the lookup
+itself is done on the record's index
+****************************************************/
+int mxFindField( const XmElem *mrecp, int tag ){
+  assert( mrecp->nameid == MX_RECORD );
+  
+  int count;
+  findNthKey( mrecp, tag, 1, &count );
+  return count;
+}
+
+int mxFindSubfield( const XmElem *mrecp, int tag, int tnum, char sub ){  
     
-    int subChildLocation = findNthAttrib (targetTagChild, (int)sub, snum, "code");
+  int count;
+  long fieldPos = findNthKey( mrecp, tag, tnum, &count );
+  if ( tnum < 1 || fieldPos < 0 ) return 0; //tnum is out of range
+  
+  findNthKey( (*mrecp->subelem)[fieldPos], CODEKEY(sub), 1, &count );
+  return count;
+}
+
+const char *mxGetData( const XmElem *mrecp, int tag, int tnum, char sub, int snum ){
+  assert( mrecp->nameid == MX_RECORD );//assert mrecp is of type record
+  if (mxOptions[MX_STATS]) mxCount( MX_COUNT_LOOKUPS, 1 );
+  
+  int count;
+  long fieldPos = findNthKey( mrecp, tag, tnum, &count );
+  if ( tnum < 1 || fieldPos < 0 ) return NULL; //tnum is out of range
+  XmElem *targetTagChild = (*mrecp->subelem)[fieldPos];
+       
+  //if 000<= tag <= 009, ignore subfield and return text from target tag child
+  if ( 0 <= tag && tag <= 9 ){
+    return targetTagChild->text;
+  }
     
-    XmElem *targetSubChild = (*targetTagChild->subelem)[subChildLocation];
+  long subPos = findNthKey( targetTagChild, CODEKEY(sub), snum, &count );
+  if ( snum < 1 || subPos < 0 ) return NULL; //ensure snum is within valid range
     
-    return targetSubChild->text;
+  return (*targetTagChild->subelem)[subPos]->text;
+}
+
+//what mxWriteHeader writes, the root of every collection written
+static const char collectionHeader[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<!-- Output by mxutil library ( Craig Lehmann ) -->\n"
+  "<marc:collection xmlns:marc=\"http://www.loc.gov/MARC21/slim\" "
+  "xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" "
+  "xsi:schemaLocation=\"http://www.loc.gov/MARC21/slim "
+  "http://www.loc.gov/standards/marcxml/schema/MARC21slim.xsd\">\n";
+
+void mxWriteHeader( MxWriter *w ){
+  mxPutBytes( w, collectionHeader, sizeof(collectionHeader) - 1 );
+}
+
+void mxWriteFooter( MxWriter *w ){
+  mxPuts( w, "</marc:collection>\n" );
 }
 
 /****************************************************
-Helper function for mxWriteFile, allows use of this function for other cases when 
-printing a function header out each time is not ideal
-Pre: top was successfully returned by mxReadFile and mxfile is open for writing
-Post: The MarcXML contents of *top has been written to mxfile. Return # of records written
-or EXIT_FAILURE if error. (e.g. an elements tag or attribs are NULL when they shouldn't be.
+mxPutElement without the final error check
 ****************************************************/
-int printElement(const XmElem *top, FILE *mxfile, int depth){
+static int putElement( MxWriter *w, const XmElem *top, int depth ){
   int numElements = 0;
+  int isCollection = (top->nameid == MX_COLLECTION);
   
-  for ( int i=0; i<depth; i++ ) fprintf(mxfile, "\t" );
- 
-    // print tag + attributes
-   if ( top->tag != NULL && strcmp(top->tag, "collection") != 0 ){
-     if ( fprintf( mxfile, "<marc:%s", top->tag ) < 1 ){
-       fprintf (stderr, "\nError, could not write to file\n");
-       return -1;
-     }
-     numElements += 1;
-   }
-  
-  for ( int i=0; i < top->nattribs; i++ ){
+  mxPutIndent( w, depth );
+  
+  // print tag + attributes
+  if ( top->tag != NULL && !isCollection ){
+    mxPuts( w, "<marc:" );
+    mxPuts( w, top->tag );
+    numElements += 1;
+  }
+  
+  for ( int i=0; i < top->nattribs && !isCollection; i++ ){
     if ( (*top->attrib)[i][0] != NULL && (*top->attrib)[i][1] != NULL ){
-      if ( strcmp(top->tag, "collection") != 0 ){
-        fprintf( mxfile, " %s=\"%s\"", (*top->attrib)[i][0], (*top->attrib)[i][1] );
-      }
+      mxPuts( w, " " );
+      mxPuts( w, (*top->attrib)[i][0] );
+      mxPuts( w, "=\"" );
+      mxPutEscaped( w, (*top->attrib)[i][1] );
+      mxPuts( w, "\"" );
     }
   }
-  if (strcmp(top->tag, "collection") != 0){
-    fprintf (mxfile, ">");
+  if ( !isCollection ){
+    mxPuts( w, ">" );
   }
   
-  //print out element text
-  int closeTagAfterKids = 0; 
-  if (top->nsubs > 0){
-    if ( strcmp(top->tag, "collection") != 0 ){
-      fprintf(mxfile, "\n");
-    }
-    closeTagAfterKids = 1;
-  }else{
-     /*replace any entity special characters as discussed here:
-     http://moodle.socs.uoguelph.ca/mod/forum/discuss.php?d=4544 */
-     xmlChar *text = xmlEncodeSpecialChars (NULL, (xmlChar*)top->text);
-    fprintf(mxfile, "%s</marc:%s>\n",text,top->tag);
-    if (text !=NULL){
-      free(text);
-    }
-    
+  //print out element text, or the subelements
+  if (top->nsubs == 0){
+    mxPutEscaped( w, top->text );
+    mxPuts( w, "</marc:" );
+    mxPuts( w, top->tag );
+    mxPuts( w, ">\n" );
+    return numElements;
+  }
+  
+  if ( !isCollection ){
+    mxPuts( w, "\n" );
   }
- 
-  // print subelements
   for ( int i=0; i < top->nsubs; i++ ) {
-    ++depth;
-    numElements += printElement( (*top->subelem)[i] , mxfile, depth);
-    --depth;
+    numElements += putElement( w, (*top->subelem)[i], depth + 1 );
   }
   
-  if (closeTagAfterKids==1 && strcmp(top->tag, "collection") != 0){
-    for ( int i=0; i<depth; i++ ) fprintf(mxfile, "\t" );
-    fprintf(mxfile, "</marc:%s>\n", top->tag);
+  if ( !isCollection ){
+    mxPutIndent( w, depth );
+    mxPuts( w, "</marc:" );
+    mxPuts( w, top->tag );
+    mxPuts( w, ">\n" );
   }
   return numElements; 
 }
 
+int mxPutElement( MxWriter *w, const XmElem *top, int depth ){
+  int numElements = putElement( w, top, depth );
+  return (mxWriterError( w ) ? -1 : numElements);
+}
+
+int printElement( const XmElem *top, FILE *mxfile, int depth ){
+  MxStamp start = mxPhaseStart();
+  MxWriter *w = mxWriterNew( mxfile );
+  int numElements = putElement( w, top, depth );
+  int status = mxWriterFree( w );
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  return (status != 0 ? -1 : numElements);
+}
+
 int mxWriteFile( const XmElem *top, FILE *mxfile ){
-  if (top != NULL && top->tag !=NULL && strcmp(top->tag, "collection") == 0){
-    if ( fprintf (mxfile, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n") < 1 ){
-      fprintf(stderr, "\nError, could not write to output file\n");
-      return -1;
-    }
-    fprintf (mxfile,  "<!-- Output by mxutil library ( Craig Lehmann ) -->\n");
-    fprintf( mxfile, "<marc:%s", top->tag );
-    fprintf(mxfile, " xmlns:marc=\"http://www.loc.gov/MARC21/slim\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:schemaLocation=\"http://www.loc.gov/MARC21/slim http://www.loc.gov/standards/marcxml/schema/MARC21slim.xsd\">\n");
-  }else{
+  if (top == NULL || top->nameid != MX_COLLECTION){
     fprintf(stderr, "\nError, invalid root node\n");
     return -1;
   }
   
-  int temp = printElement( top, mxfile, 0 );
-  fprintf (mxfile, "</marc:collection>\n");
-
-  return temp;
+  MxStamp start = mxPhaseStart();
+  MxWriter *w = mxWriterNew( mxfile );
+  mxWriteHeader( w );
+  int numElements = putElement( w, top, 0 );
+  mxWriteFooter( w );
+  int status = mxWriterFree( w );
+  mxPhaseEnd( MX_PHASE_WRITE, start );
+  return (status != 0 ? -1 : numElements);
 }
-
@@ -14,18 +14,64 @@
 
 #include <stdio.h>
 #include <libxml/xmlschemastypes.h>
+#include <libxml/xmlreader.h>
+#include "mxwriter.h"
 
-// XmElem is a container for a generic XML element
+// MxIndexEntry maps a child's tag number (or subfield code) to its position
+typedef struct MxIndexEntry MxIndexEntry;
+struct MxIndexEntry {
+    int key;			// tag number, or subfield code (see mxIndexElem)
+    unsigned long pos;		// position of the child in subelem
+};
+
+// MxArena is a bump allocator, a tree built in one is freed in one go
+typedef struct MxArena MxArena;
+
+// XmElem is a container for a generic XML element. Trees read from MARCXML
+// hold NUL-terminated copies of their text and attribute values, one per value
+// made from libxml2's decoded nodes (which do not point into the input, mapped
+// or not); trees from snapshots point into the snapshot's mapping instead.
 typedef struct XmElem XmElem;	// lets us avoid coding "struct"
 struct XmElem {    // fixed-length container for a generic XML element
-    char *tag;			// <tag>
+    char *tag;			// <tag>, shared through the intern table (see mxIntern)
+    int nameid;			// tag's interned id, one of enum MXNAME for MARCXML
+    int tagnum;			// decoded "tag" attribute, or -1 if there is none
+    char code;			// "code" attribute of a subfield, or '\0' if none
     char *text;			// any text between <tag> and </tag>, or NULL for <tag/>
     int isBlank;		// flag: 0 if text has some non-whitespace
     int nattribs;		// no. of attributes (can be 0)
     char *(*attrib)[][2];	// ->array of attributes (can be NULL)
-				//   [0]->attribute; [1]->value
+				//   [0]->attribute (interned); [1]->value
     unsigned long nsubs; 	// no. of subelements (can be 0)
     XmElem *(*subelem)[]; 	// ->array of subelements (can be NULL)
+    int nindex;			// no. of entries in index (can be 0)
+    MxIndexEntry *index;	// ->children with a tag/code, sorted by key (can be NULL)
+    MxArena *arena;		// ->arena the element was allocated from (can be NULL)
+};
+
+// ids of the MARCXML element and attribute names, see mxIntern
+enum MXNAME {
+    MX_COLLECTION = 0, MX_RECORD, MX_LEADER, MX_CONTROLFIELD, MX_DATAFIELD,
+    MX_SUBFIELD, MX_TAG, MX_CODE, MX_IND1, MX_IND2, MX_ID, MX_TYPE,
+    MX_NNAMES			// first id given to any other name
+};
+
+// library wide options, see mxSetOption
+enum MXOPTION {
+    MX_ARENA = 0,		// 1: mxMakeElem builds each tree in an MxArena
+    MX_THREADS,			// n > 1: mxReadFile/mxReadStream parse and validate
+				// chunks of records on n threads, mxRender* render
+				// records on n threads
+    MX_VALIDATION,		// how sp is used by mxReadFile/mxReadStream, an MXVALIDATION
+    MX_STATS,			// 1: collect timings and counts, see mxPrintStats
+    MX_NOPTIONS
+};
+
+// values of MX_VALIDATION
+enum MXVALIDATION {
+    MX_VALIDATE_XSD = 0,	// against the schema sp, skipped when sp is NULL
+    MX_VALIDATE_BUILTIN,	// built-in MARC21slim checks, sp is not needed
+    MX_VALIDATE_NONE		// no validation at all
 };
 
 
@@ -44,6 +90,253 @@ XmElem *mxMakeElem( xmlDocPtr doc, xmlNodePtr node );
 
 int mxWriteFile( const XmElem *top, FILE *mxfile );
 
+/*************************************************
+Build elem's index: an entry for each child with a "tag" or "code" attribute,
+sorted by tag number/code and then document order. Done by mxMakeElem, so
+mxFindField, mxFindSubfield and mxGetData are lookups rather than scans.
+Pre: elem's subelements are complete, elem->index is not already allocated
+Post: elem->index and elem->nindex are set, index is freed by mxCleanElem
+**************************************************/
+void mxIndexElem( XmElem *elem );
+
+/*************************************************
+Set or get one of the library options, they default to 0
+Pre: opt is a valid MXOPTION
+Post: mxSetOption returns the previous value of opt, mxGetOption its value
+**************************************************/
+int mxSetOption( enum MXOPTION opt, int value );
+int mxGetOption( enum MXOPTION opt );
+
+// phases timed with MX_STATS, see mxPhaseStart
+enum MXPHASE {
+    MX_PHASE_PARSE = 0,		// libxml2 parsing, ISO 2709 decoding, opening snapshots
+    MX_PHASE_VALIDATE,		// schema or built-in validation
+    MX_PHASE_BUILD,		// building XmElem trees (mxMakeElem)
+    MX_PHASE_EXTRACT,		// getting fields out of records (marc2bib)
+    MX_PHASE_MATCH,		// regex matching
+    MX_PHASE_SORT,		// sorting records
+    MX_PHASE_WRITE,		// writing output
+    MX_NPHASES
+};
+
+// counters kept with MX_STATS, see mxCount
+enum MXCOUNTER {
+    MX_COUNT_RECORDS = 0,	// records read
+    MX_COUNT_ELEMENTS,		// elements built
+    MX_COUNT_READ,		// bytes of input read (or mapped)
+    MX_COUNT_WRITTEN,		// bytes of output written
+    MX_COUNT_ALLOCS,		// allocations by libxml2 and for elements
+    MX_COUNT_LOOKUPS,		// subfields (or control fields) looked up: mxGetData
+				// calls and the ones marc2bib takes
+    MX_NCOUNTERS
+};
+
+/*************************************************
+Statistics, collected while MX_STATS is set. Setting it starts the wall clock
+and counts libxml2's allocations from then on, so it should be set before
+anything else. The library times and counts its own work, and callers add
+theirs the same way: mxPhaseStart gives a timestamp, mxPhaseEnd adds the time
+since then to a phase, mxCount adds n to a counter. Without MX_STATS they do
+nothing. Phases timed on MX_THREADS workers add up the time of every thread.
+Post: mxPrintStats writes the totals to fp, as text or (json nonzero) as a
+JSON object on one line
+**************************************************/
+typedef long long MxStamp;
+MxStamp mxPhaseStart( void );
+void mxPhaseEnd( enum MXPHASE phase, MxStamp start );
+void mxCount( enum MXCOUNTER counter, long long n );
+void mxPrintStats( FILE *fp, int json );
+
+/*************************************************
+Map an element or attribute name to a small integer id, adding it if it has
+not been seen before. Element tags and attribute names in an XmElem point to
+the table's copy, so they can be compared by id (or pointer) and are never
+freed with the element.
+Pre: name is a NUL terminated string
+Post: mxIntern returns name's id, mxName returns the name for an id or NULL
+**************************************************/
+int mxIntern( const char *name );
+const char *mxName( int id );
+
+/*************************************************
+Arena allocation. mxArenaAlloc never fails (asserts), memory is only given back
+by mxArenaReset, which keeps the first block for reuse, or mxArenaFree. When
+MX_ARENA is set every element, string, attribute array and index of a tree
+comes from one arena and mxCleanElem on the root frees it all at once; calling
+it on any other element of such a tree does nothing.
+**************************************************/
+MxArena *mxArenaNew( void );
+void *mxArenaAlloc( MxArena *arena, size_t size );
+char *mxArenaCopy( MxArena *arena, const char *str );
+void mxArenaReset( MxArena *arena );
+void mxArenaFree( MxArena *arena );
+
+/*************************************************
+Callback used by mxReadStream, called once for every record element.
+Pre: rec is a complete, validated record element
+Post: return 0 to keep reading, nonzero to stop. rec is freed by mxReadStream
+once the callback returns, so it must not be kept by the caller.
+**************************************************/
+typedef int (*MxRecordFunc)( XmElem *rec, void *ctx );
+
+/*************************************************
+Streaming counterpart of mxReadFile, uses an xmlTextReader so only one record
+is held in memory at a time, rather than the whole document.
+Pre: marcxmlfp is open for reading, sp from mxInit (or NULL to skip validation)
+Post: recFunc has been called for each record in document order, until it
+returned nonzero. Returns 0 on success, 1 if the xml could not be parsed or
+2 if it did not match the schema. Records before the error have already been
+handed to recFunc.
+With MX_THREADS set, records are parsed a chunk at a time on worker threads
+and handed over in document order from the calling thread.
+With MX_VALIDATION set to MX_VALIDATE_BUILTIN, each record is checked against
+the MARC21slim rules as it is read, and whatever is wrong is reported on stderr.
+**************************************************/
+int mxReadStream( FILE *marcxmlfp, xmlSchemaPtr sp, MxRecordFunc recFunc, void *ctx );
+
+/*************************************************
+Callback used by mxRenderStream and mxRenderRecords, called once for every
+record element to write whatever it makes of rec to out. With MX_THREADS set
+it runs on that many threads at once, worker (from 0 to MX_THREADS - 1) telling
+them apart, so each worker can have state of its own.
+Pre: rec is a complete, validated record element, out is the writer for rec
+Post: return 0 to go on, nonzero to stop after rec. rec must not be kept.
+**************************************************/
+typedef int (*MxRenderFunc)( XmElem *rec, int worker, MxWriter *out, void *ctx );
+
+/*************************************************
+Render records to out in document order, on MX_THREADS threads if it is set:
+each thread renders a chunk of records into a buffer of its own, and the
+buffers are written to out in order, so out gets the same bytes as it would
+from a single thread. mxRenderStream reads marcxmlfp as mxReadStream does,
+parsing the chunks on the same threads that render them. mxRenderRecords
+renders nrecs records already in memory (NULL entries are skipped).
+Post: render has been called for every record (in document order with one
+thread) unless it or out stopped early, records after the one that stopped
+it are not written. mxRenderStream returns as mxReadStream.
+**************************************************/
+int mxRenderStream( FILE *marcxmlfp, xmlSchemaPtr sp, MxRenderFunc render, void *ctx, MxWriter *out );
+void mxRenderRecords( XmElem *recs[], unsigned long nrecs, MxRenderFunc render, void *ctx, MxWriter *out );
+
+/*************************************************
+Byte level copying, for joining MARCXML files without building any trees.
+mxCopyRecords writes each record of marcxmlfp to w exactly as it is in the
+input, from its start tag to its end tag (after a tab, followed by a newline),
+for use between mxWriteHeader and mxWriteFooter. Nothing is validated, that
+is what mxValidateFiles is for: it checks the nfiles regular files in fps at
+once, on MX_THREADS threads (one per CPU if it is not set), as mxReadStream
+would but without building anything or moving the files' positions.
+Records are only copied from a regular file whose records mean the same in
+mxWriteHeader's collection: UTF-8, with no DOCTYPE, the marc prefix bound to
+MARC21slim on the root and no other namespace declared but xsi.
+Pre: marcxmlfp and fps are open for reading at the start of the document
+Post: mxCopyRecords returns 0, 1 if the records could not be cut out (the
+file was not checked), -1 if w has failed, or 3 if marcxmlfp can't be copied
+from, which leaves it as it was to be read as usual. mxValidateFiles sets
+status[i] as mxReadStream returns, or to -1 for input that is not a regular
+file, and returns the first status above 0, or 0.
+**************************************************/
+int mxCopyRecords( FILE *marcxmlfp, MxWriter *w );
+int mxValidateFiles( FILE *fps[], int nfiles, xmlSchemaPtr sp, int status[] );
+
+/*************************************************
+Called by mxScanRecords with each record as it is in the input, from its
+start tag to its end tag, and the document's prolog and root start tag (head,
+the same for every record of the file).
+Post: return 1 to have the record parsed and handed to the MxRecordFunc, 0 to
+pass it by, or -1 to stop
+**************************************************/
+typedef int (*MxScanFunc)( const char *head, size_t headLen, const char *xml, size_t len, void *ctx );
+
+/*************************************************
+Incremental reading: mxScanRecords cuts each record of marcxmlfp out of the
+file, as mxCopyRecords does, and hands its bytes to scan in document order.
+Only the records scan wants are parsed and validated (a chunk of them at a
+time in a document with the file's head, on MX_THREADS threads if it is set)
+and given to recFunc, in document order but interleaved with the scan calls
+of the records that follow them. Unlike mxCopyRecords, any namespaces and
+encoding will do, since the records are parsed with their own head.
+Pre: marcxmlfp is open for reading at the start of the document
+Post: returns as mxReadStream, or 3 if marcxmlfp is not a regular MARCXML
+file records can be cut from, which leaves it as it was to be read as usual.
+Records the scan passed by are not checked at all.
+**************************************************/
+int mxScanRecords( FILE *marcxmlfp, xmlSchemaPtr sp, MxScanFunc scan, MxRecordFunc recFunc, void *ctx );
+
+// input formats, see mxInputFormat
+enum MXFORMAT {
+    MX_FORMAT_XML = 0,		// MARCXML
+    MX_FORMAT_MARC,		// ISO 2709 binary MARC (.mrc)
+    MX_FORMAT_SNAPSHOT		// from mxWriteSnapshot
+};
+
+/*************************************************
+Tell which format fp holds by its first bytes, without consuming any input
+(regular files are peeked at with pread, pipes with tee). A snapshot is only
+taken for one if its whole header is there and sound.
+Pre: fp is open for reading and has not been read through stdio
+Post: Returns an MXFORMAT, MX_FORMAT_XML if it can't be told
+**************************************************/
+int mxInputFormat( FILE *fp );
+
+/*************************************************
+ISO 2709 counterparts of mxReadFile and mxReadStream. Records are decoded
+straight into the element shape mxMakeElem gives MARCXML records (leader,
+controlfield and datafield/subfield elements with the same attributes),
+without any XML. Field data is taken as it is (no MARC-8 conversion), and
+there is no schema to validate against: records are only checked for a sound
+leader and directory, what is wrong is reported on stderr.
+Pre: marcfp is open for reading
+Post: As mxReadFile and mxReadStream, with 1 returned for a malformed record
+**************************************************/
+int mxReadMarc( FILE *marcfp, XmElem **top );
+int mxReadMarcStream( FILE *marcfp, MxRecordFunc recFunc, void *ctx );
+
+/*************************************************
+ISO 2709 counterparts of mxPutElement and mxWriteFile. The leader is taken
+from the record's leader element, with the record length, base address and
+layout positions set for the record written.
+Pre: rec is a record element, top a collection or record
+Post: mxPutMarc returns 0, or -1 if the record does not fit ISO 2709 (then
+nothing is written) or w has failed. mxWriteMarc returns # of records written
+or -1 if error
+**************************************************/
+int mxPutMarc( MxWriter *w, const XmElem *rec );
+int mxWriteMarc( const XmElem *top, FILE *marcfp );
+
+/*************************************************
+Snapshots: a tree saved as tables of offsets into the file (a string pool,
+the elements of each level and their attributes, the records' level being
+the record index), which mxSnapshotOpen maps into memory and checks in full,
+so a damaged or foreign file is refused rather than read. Records are built
+from the tables when they are asked for, their text and attribute values
+pointing into the mapping rather than copied, so there is nothing to parse or
+validate again. Only a machine of the writer's byte order can open one.
+Pre: top is a collection or record no deeper than its subfields. snapfp is
+open for reading, at the start of the file if it is a regular file (other
+input is read into memory). arena is from mxArenaNew, n below
+mxSnapshotRecords
+Post: mxWriteSnapshot returns 0, or -1 if it could not be written.
+mxSnapshotOpen returns the snapshot, to be closed with mxSnapshotClose, or
+NULL if snapfp does not hold a sound one. mxSnapshotRecords gives the no. of
+records (the root's children, or 1 for a record as the root), and
+mxSnapshotRecord builds record n (from 0) in arena, until the arena is reset
+or freed or the snapshot closed. mxRenderSnapshot is mxRenderRecords on every
+record, building them on the threads that render them.
+mxOpenSnapshot builds the whole tree at once, returning 0 with *top set, to
+be freed with mxCleanElem (which unmaps the snapshot), or 1 as mxSnapshotOpen
+returns NULL. Trees from snapshots must not be changed, apart from the root
+element itself.
+**************************************************/
+typedef struct MxSnapshot MxSnapshot;
+int mxWriteSnapshot( const XmElem *top, FILE *snapfp );
+MxSnapshot *mxSnapshotOpen( FILE *snapfp );
+unsigned long mxSnapshotRecords( const MxSnapshot *snap );
+XmElem *mxSnapshotRecord( const MxSnapshot *snap, unsigned long n, MxArena *arena );
+void mxRenderSnapshot( const MxSnapshot *snap, MxRenderFunc render, void *ctx, MxWriter *out );
+void mxSnapshotClose( MxSnapshot *snap );
+int mxOpenSnapshot( FILE *snapfp, XmElem **top );
+
 /*************************************************
 Pre: top was successfully returned by mxReadFile and mxfile is open for writing
 Post: The MarcXML contents of *top has been written to mxfile. Return # of records written
@@ -51,6 +344,16 @@ or -1 if error. (e.g. an elements tag or attribs are NULL when they shouldn't be
 **************************************************/
 int printElement(const XmElem *top, FILE *mxfile, int depthOffset);
 
+/*************************************************
+printElement on an MxWriter, and the collection start/end tags mxWriteFile
+puts around it, for writing many records through one buffer.
+Pre: w is from mxWriterNew or mxWriterMem
+Post: mxPutElement returns # of elements written, or -1 if w has failed
+**************************************************/
+int mxPutElement( MxWriter *w, const XmElem *top, int depth );
+void mxWriteHeader( MxWriter *w );
+void mxWriteFooter( MxWriter *w );
+
 /*************************************************
 same as strdup From here: http://cboard.cprogramming.com/c-programming/95462
 -compiler-error-warning-implicit-declaration-function-strdup.html
@@ -0,0 +1,207 @@
+/****************************************************
+ * mxwriter.c - buffered output writer, see mxwriter.h
+ ****************************************************/
+
+#define _POSIX_SOURCE 1
+
+#include "mxwriter.h"
+#include "mxtext.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+//size of the buffer of a writer on a file, data longer than this bypasses it
+#define WRITER_SIZE 65536
+//room always left for the longest entity while escaping
+#define MAX_ENTITY 8
+
+struct MxWriter {
+  char *buf;
+  size_t len;           // bytes in buf
+  size_t cap;           // size of buf
+  FILE *fp;             // where the output goes, NULL for a memory writer
+  int fd;               // fp's file descriptor, or -1 to go through fwrite
+  int error;            // flag: 1 once a write has failed
+};
+
+/****************************************************
+entity for each byte mxPutEscaped replaces, NULL for the rest
+****************************************************/
+static const char *entities[256] = {
+  ['<'] = "&lt;", ['>'] = "&gt;", ['&'] = "&amp;", ['"'] = "&quot;", ['\r'] = "&#13;"
+};
+
+//bytes written to files by every writer, see mxWriterTotal
+static unsigned long long written = 0;
+
+MxWriter *mxWriterNew( FILE *fp ){
+  MxWriter *w = mxWriterMem();
+
+  //anything fp buffered has to go out ahead of the writer
+  fflush( fp );
+  w->fp = fp;
+  w->fd = fileno( fp );
+  return w;
+}
+
+MxWriter *mxWriterMem( void ){
+  MxWriter *w = malloc( sizeof(MxWriter) );
+  assert(w);
+  w->cap = WRITER_SIZE;
+  w->buf = malloc( w->cap );
+  assert(w->buf);
+  w->len = 0;
+  w->fp = NULL;
+  w->fd = -1;
+  w->error = 0;
+  return w;
+}
+
+/****************************************************
+record a failed write, reported the first time
+****************************************************/
+static void writeFailed( MxWriter *w ){
+  if (w->error == 0) fprintf( stderr, "\nError, could not write to file\n" );
+  w->error = 1;
+}
+
+/****************************************************
+Write all of iov to w's file descriptor, picking up after partial writes.
+Post: iov has been used up (its entries are changed)
+****************************************************/
+static void writeAll( MxWriter *w, struct iovec *iov, int iovcnt ){
+  while (iovcnt > 0 && w->error == 0){
+    ssize_t n = writev( w->fd, iov, iovcnt );
+    if (n < 0){
+      if (errno != EINTR) writeFailed( w );
+      continue;
+    }
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len){
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0){
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+}
+
+/****************************************************
+write out buf, followed by data (which can be NULL)
+****************************************************/
+static void flushWith( MxWriter *w, const char *data, size_t len ){
+  if (w->error == 0) __atomic_add_fetch( &written, w->len + len, __ATOMIC_RELAXED );
+  if (w->error == 0 && w->fd >= 0){
+    struct iovec iov[2] = { { w->buf, w->len }, { (char *)data, len } };
+    writeAll( w, iov, (data != NULL ? 2 : 1) );
+  }else if (w->error == 0){
+    if ( fwrite( w->buf, 1, w->len, w->fp ) != w->len ||
+         (len > 0 && fwrite( data, 1, len, w->fp ) != len) ){
+      writeFailed( w );
+    }
+  }
+  w->len = 0;
+}
+
+/****************************************************
+make sure there is room for len more bytes in buf, flushing it or (in memory)
+growing it
+****************************************************/
+static void makeRoom( MxWriter *w, size_t len ){
+  if (w->cap - w->len >= len) return;
+
+  if (w->fp != NULL){
+    flushWith( w, NULL, 0 );
+    return;
+  }
+  while (w->cap - w->len < len) w->cap *= 2;
+  w->buf = realloc( w->buf, w->cap );
+  assert(w->buf);
+}
+
+void mxPutBytes( MxWriter *w, const char *data, size_t len ){
+  if (w->cap - w->len < len){
+    //a long piece goes out along with the buffer rather than through it
+    if (w->fp != NULL && len >= WRITER_SIZE / 2){
+      flushWith( w, data, len );
+      return;
+    }
+    makeRoom( w, len );
+  }
+  memcpy( w->buf + w->len, data, len );
+  w->len += len;
+}
+
+void mxPuts( MxWriter *w, const char *str ){
+  if (str != NULL) mxPutBytes( w, str, strlen( str ) );
+}
+
+void mxPutEscaped( MxWriter *w, const char *str ){
+  if (str == NULL) return;
+
+  //the runs between bytes to replace are found a vector at a time and copied whole
+  size_t len = strlen( str );
+  for (;;){
+    size_t n = mxTextSpecial( str, len );
+    if (w->cap - w->len >= n + MAX_ENTITY){
+      memcpy( w->buf + w->len, str, n );
+      w->len += n;
+    }else{
+      mxPutBytes( w, str, n );
+      makeRoom( w, MAX_ENTITY );
+    }
+    if (n == len) return;
+
+    for (const char *entity = entities[(unsigned char)str[n]]; *entity != '\0'; entity++){
+      w->buf[w->len++] = *entity;
+    }
+    str += n + 1;
+    len -= n + 1;
+  }
+}
+
+void mxPutIndent( MxWriter *w, int depth ){
+  static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+  while (depth > 0){
+    int n = (depth < (int)sizeof(tabs) - 1 ? depth : (int)sizeof(tabs) - 1);
+    mxPutBytes( w, tabs, n );
+    depth -= n;
+  }
+}
+
+int mxWriterError( const MxWriter *w ){
+  return w->error;
+}
+
+int mxWriterFlush( MxWriter *w ){
+  if (w->fp != NULL){
+    flushWith( w, NULL, 0 );
+    if (w->fd < 0 && fflush( w->fp ) != 0) writeFailed( w );
+  }
+  return (w->error ? -1 : 0);
+}
+
+int mxWriterFree( MxWriter *w ){
+  int status = mxWriterFlush( w );
+  free( w->buf );
+  free( w );
+  return status;
+}
+
+unsigned long long mxWriterTotal( void ){
+  return __atomic_load_n( &written, __ATOMIC_RELAXED );
+}
+
+const char *mxWriterData( const MxWriter *w, size_t *len ){
+  *len = w->len;
+  return w->buf;
+}
+
+void mxWriterClear( MxWriter *w ){
+  w->len = 0;
+}
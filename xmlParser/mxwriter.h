@@ -0,0 +1,60 @@
+/****************************************************
+ * mxwriter.h - buffered output for mxutil and mxtool. Output is gathered in a
+ * large reusable buffer, with xml escaping done a run of plain text at a time
+ * (see mxtext.h), and handed to the kernel with write/writev rather than
+ * through stdio.
+ ****************************************************/
+
+#ifndef MXWRITER_H_
+#define MXWRITER_H_ 1
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct MxWriter MxWriter;
+
+/*************************************************
+Create a writer. mxWriterNew writes to fp: fp is flushed first, then the
+writer goes straight to its file descriptor (or through fwrite if it has
+none, e.g. a memory stream), so nothing else should write to fp until the
+writer is freed. mxWriterMem keeps everything in memory, see mxWriterData.
+Post: Returns the writer, freed with mxWriterFree
+**************************************************/
+MxWriter *mxWriterNew( FILE *fp );
+MxWriter *mxWriterMem( void );
+
+/*************************************************
+Append to the output. mxPutEscaped replaces < > & " and carriage returns
+with their entities, as xmlEncodeSpecialChars does, and writes nothing for
+NULL. mxPutIndent writes depth tabs.
+Write errors are kept by the writer and reported by mxWriterError,
+mxWriterFlush and mxWriterFree, after the first one nothing more is written.
+**************************************************/
+void mxPutBytes( MxWriter *w, const char *data, size_t len );
+void mxPuts( MxWriter *w, const char *str );
+void mxPutEscaped( MxWriter *w, const char *str );
+void mxPutIndent( MxWriter *w, int depth );
+
+/*************************************************
+Post: mxWriterError returns 1 if a write has failed, else 0. mxWriterFlush
+writes out what is buffered (a no-op in memory) and returns 0, or -1 if any
+write has failed. mxWriterFree flushes, frees w and returns as mxWriterFlush.
+**************************************************/
+int mxWriterError( const MxWriter *w );
+int mxWriterFlush( MxWriter *w );
+int mxWriterFree( MxWriter *w );
+
+/*************************************************
+Post: Returns the bytes all writers have written to their files so far
+**************************************************/
+unsigned long long mxWriterTotal( void );
+
+/*************************************************
+Pre: w is from mxWriterMem
+Post: Returns what has been written so far (not NUL terminated) and its length
+in *len, valid until the next write. mxWriterClear empties it for reuse.
+**************************************************/
+const char *mxWriterData( const MxWriter *w, size_t *len );
+void mxWriterClear( MxWriter *w );
+
+#endif
@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+#####################################################
+# servetest.py - checks that mxtool -serve outlives clients that go away in
+# the middle of a request, and still answers the next client. Run by
+# make servetest, from this directory.
+#####################################################
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+COLLECTION = "trellis.xml"
+
+
+def request(path, args):
+    """send one request on a new connection, return (status, body)"""
+    req = b"".join(a.encode() + b"\0" for a in args)
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(path)
+        s.sendall(b"%d\n" % len(req) + req)
+        reply = b""
+        while True:
+            data = s.recv(65536)
+            if not data:
+                break
+            reply += data
+            head, sep, body = reply.partition(b"\n")
+            if sep and len(body) >= int(head.split()[1]):
+                return head.split()[0].decode(), body
+    raise AssertionError("no response to %r" % (args,))
+
+
+def send_and_hang_up(path, data):
+    """send data, which is not a whole request, and close the connection"""
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(path)
+        s.sendall(data)
+
+
+def main():
+    os.environ.setdefault("MXTOOL_XSD", "MARC21slim.xsd")
+    path = os.path.join(tempfile.mkdtemp(), "mxtool.sock")
+    server = subprocess.Popen(["./mxtool", "-serve", path, COLLECTION])
+    try:
+        for _ in range(100):
+            if os.path.exists(path) or server.poll() is not None:
+                break
+            time.sleep(0.1)
+        assert server.poll() is None, "the server did not start"
+
+        status, expected = request(path, ["keep", COLLECTION, "a=."])
+        assert status == "ok", "keep failed"
+
+        #a body cut short, a length cut short, and a length with no body
+        for data in (b"5\nab", b"12", b"40\n"):
+            send_and_hang_up(path, data)
+            status, body = request(path, ["keep", COLLECTION, "a=."])
+            assert server.poll() is None, "the server died after %r" % data
+            assert (status, body) == ("ok", expected), "wrong answer after %r" % data
+
+        status, body = request(path, ["get", COLLECTION, "99999"])
+        assert status == "error", "a record that is not there was found"
+    finally:
+        if server.poll() is None:
+            server.send_signal(signal.SIGTERM)
+        code = server.wait(timeout=10)
+    assert code == 0, "the server exited with %d" % code
+    assert not os.path.exists(path), "the socket was left behind"
+    print("servetest OK")
+
+
+if __name__ == "__main__":
+    try:
+        main()
+    except (AssertionError, OSError) as e:
+        print("servetest FAILED: %s" % e)
+        sys.exit(1)